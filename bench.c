@@ -0,0 +1,391 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * benchmark and replay harness: feeds queries straight to the frame handler,
+ * without any network, and reports how fast they were answered
+ *
+ * Copyright (c) 2025-2026 D. Flissinger (megapearl)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "cksum.h"
+#include "metrics.h"
+
+/* MAC of the simulated client (locally administered) */
+static const unsigned char benchmac[6] = {0x02, 0x00, 0x00, 0x00, 0xbe, 0x01};
+
+/* synthetic workload: amount and size of small files, size of the big one */
+#define SYNTHFILES 200
+#define SYNTHFILESZ (16ul * 1024ul)
+#define SYNTHBIGSZ (4ul * 1024ul * 1024ul)
+#define SYNTHCHUNK 1024
+#define SYNTHLISTS 10
+
+/* latencies (in ns) measured for each AL subfunction */
+static struct {
+  unsigned long count;
+  unsigned long cap;
+  unsigned long *ns;
+} stats[256];
+
+static const unsigned char *srv;
+static unsigned char protover;
+static unsigned char seq;
+static int answlen; /* length of the last answer given to query() */
+
+/* remembers that a query of type al took ns nanoseconds */
+static void record(unsigned char al, unsigned long ns) {
+  if (stats[al].count == stats[al].cap) {
+    unsigned long newcap = (stats[al].cap == 0) ? 1024 : stats[al].cap * 2;
+    unsigned long *newns = realloc(stats[al].ns, newcap * sizeof(unsigned long));
+    if (newns == NULL) return;
+    stats[al].ns = newns;
+    stats[al].cap = newcap;
+  }
+  stats[al].ns[stats[al].count++] = ns;
+}
+
+/* hands frame (len bytes) to handler, recording how long it took. returns
+ * the answer's length */
+static int timedquery(benchhandler handler, unsigned char *frame, int len, unsigned char *answ) {
+  unsigned long long t0;
+  int res;
+  t0 = metricsclock();
+  res = handler(frame, len, answ);
+  record(frame[59], (unsigned long)(metricsclock() - t0));
+  return(res);
+}
+
+/* builds a query of type al with plen bytes of payload for drive C: and
+ * hands it over. returns the AX value of the answer, or -1 if none came */
+static int query(benchhandler handler, unsigned char al, const void *payload, int plen, unsigned char *answ) {
+  unsigned char frame[1520];
+  int len = 60 + plen;
+  memset(frame, 0, 60);
+  memcpy(frame, srv, 6);
+  memcpy(frame + 6, benchmac, 6);
+  frame[12] = 0xed;
+  frame[13] = 0xf5;
+  frame[52] = len & 0xff;
+  frame[53] = len >> 8;
+  frame[56] = protover;
+  frame[57] = ++seq;
+  frame[58] = 2; /* C: */
+  frame[59] = al;
+  memcpy(frame + 60, payload, plen);
+  answlen = timedquery(handler, frame, len, answ);
+  if (answlen < 60) return(-1);
+  return(answ[58] | (answ[59] << 8));
+}
+
+/* stores a little-endian word at p */
+static void putw16(unsigned char *p, unsigned short w) {
+  p[0] = w & 0xff;
+  p[1] = w >> 8;
+}
+
+/* stores a little-endian dword at p */
+static void putw32(unsigned char *p, unsigned long w) {
+  putw16(p, w & 0xffff);
+  putw16(p + 2, (w >> 16) & 0xffff);
+}
+
+/* opens (al = 0x16) or creates (al = 0x17) path, returns its file id or -1 */
+static long openpath(benchhandler handler, unsigned char al, const char *path) {
+  unsigned char p[512], answ[1520];
+  int plen = strlen(path);
+  putw16(p, (al == 0x17) ? 0x20 : 2); /* attributes / open mode */
+  putw16(p + 2, 0);
+  putw16(p + 4, 0);
+  memcpy(p + 6, path, plen);
+  if (query(handler, al, p, plen + 6, answ) != 0) return(-1);
+  return(answ[80] | (answ[81] << 8));
+}
+
+/* sends a query made of a file id only (CLSFIL...) */
+static void fidquery(benchhandler handler, unsigned char al, unsigned short fid) {
+  unsigned char p[2], answ[1520];
+  putw16(p, fid);
+  query(handler, al, p, 2, answ);
+}
+
+/* creates path and fills it with size bytes, returns 0 on success */
+static int synthfile(benchhandler handler, const char *path, unsigned long size) {
+  unsigned char p[6 + SYNTHCHUNK], answ[1520];
+  unsigned long off;
+  long fid;
+  fid = openpath(handler, 0x17, path);
+  if (fid < 0) {
+    fprintf(stderr, "ERROR: failed to create %s\n", path);
+    return(-1);
+  }
+  memset(p + 6, 'x', SYNTHCHUNK);
+  for (off = 0; off < size; off += SYNTHCHUNK) {
+    putw32(p, off);
+    putw16(p + 4, (unsigned short)fid);
+    if (query(handler, 0x09, p, sizeof(p), answ) != 0) {
+      fprintf(stderr, "ERROR: failed to write to %s\n", path);
+      return(-1);
+    }
+  }
+  fidquery(handler, 0x06, (unsigned short)fid);
+  return(0);
+}
+
+/* synthetic workloads: write, list, open, stat and read files in \EBENCH */
+static int synth(benchhandler handler) {
+  static const char mask[] = "\\EBENCH\\????????.???";
+  unsigned char p[64], answ[1520];
+  char path[64];
+  unsigned long total;
+  long fid;
+  int i, r, got;
+
+  query(handler, 0x03, "\\EBENCH", 7, answ); /* MKDIR, may exist already */
+
+  for (i = 0; i < SYNTHFILES; i++) {
+    sprintf(path, "\\EBENCH\\F%07d.DAT", i);
+    if (synthfile(handler, path, SYNTHFILESZ) != 0) return(-1);
+  }
+  if (synthfile(handler, "\\EBENCH\\BIG.DAT", SYNTHBIGSZ) != 0) return(-1);
+
+  /* list the directory with FINDFIRST / FINDNEXT */
+  for (r = 0; r < SYNTHLISTS; r++) {
+    p[0] = 0x16; /* attributes */
+    memcpy(p + 1, mask, sizeof(mask) - 1);
+    if (query(handler, 0x1b, p, sizeof(mask), answ) != 0) {
+      fprintf(stderr, "ERROR: FINDFIRST failed\n");
+      return(-1);
+    }
+    do {
+      memcpy(p, answ + 80, 4); /* dir id and position */
+      p[4] = 0x16;
+      memcpy(p + 5, "???????????", 11);
+    } while (query(handler, 0x1c, p, 16, answ) == 0);
+  }
+
+  /* open, stat and close every file */
+  for (i = 0; i < SYNTHFILES; i++) {
+    sprintf(path, "\\EBENCH\\F%07d.DAT", i);
+    fid = openpath(handler, 0x16, path);
+    if (fid >= 0) fidquery(handler, 0x06, (unsigned short)fid);
+    query(handler, 0x0f, path, strlen(path), answ);
+  }
+
+  /* read the big file sequentially, twice */
+  for (r = 0; r < 2; r++) {
+    fid = openpath(handler, 0x16, "\\EBENCH\\BIG.DAT");
+    if (fid < 0) {
+      fprintf(stderr, "ERROR: failed to open BIG.DAT\n");
+      return(-1);
+    }
+    total = 0;
+    do {
+      putw32(p, total);
+      putw16(p + 4, (unsigned short)fid);
+      putw16(p + 6, SYNTHCHUNK);
+      if (query(handler, 0x08, p, 8, answ) != 0) break;
+      got = answlen - 60;
+      total += got;
+    } while (got == SYNTHCHUNK);
+    fidquery(handler, 0x06, (unsigned short)fid);
+    if (total != SYNTHBIGSZ) {
+      fprintf(stderr, "ERROR: read %lu bytes of BIG.DAT instead of %lu\n", total, SYNTHBIGSZ);
+      return(-1);
+    }
+  }
+
+  /* clean up */
+  for (i = 0; i < SYNTHFILES; i++) {
+    sprintf(path, "\\EBENCH\\F%07d.DAT", i);
+    query(handler, 0x13, path, strlen(path), answ);
+  }
+  query(handler, 0x13, "\\EBENCH\\BIG.DAT", 15, answ);
+  query(handler, 0x01, "\\EBENCH", 7, answ); /* RMDIR */
+  return(0);
+}
+
+/* parses a line of a dumpframe() listing into buff. returns the amount of
+ * bytes found, or -1 if the line is not part of a listing */
+static int parsedumpline(const char *line, unsigned char *buff) {
+  int n = 0;
+  unsigned int b;
+  if (strchr(line, '|') == NULL) return(-1);
+  while (*line != '|') {
+    if (*line == ' ') {
+      line++;
+      continue;
+    }
+    if ((n == 16) || (sscanf(line, "%2x", &b) != 1) || (line[1] == ' ') || (line[1] == '|')) return(-1);
+    buff[n++] = (unsigned char)b;
+    line += 2;
+  }
+  return(n);
+}
+
+/* reads the next frame of a dumpframe() listing. returns its length, or 0
+ * when there are no more frames */
+static int readdumpframe(FILE *fd, unsigned char *frame) {
+  char line[256];
+  unsigned char bytes[16];
+  int len = 0, n, want = 0;
+  while (fgets(line, sizeof(line), fd) != NULL) {
+    n = parsedumpline(line, bytes);
+    if (n < 0) {
+      if (len >= 60) return(len); /* frame of unknown length */
+      len = 0;
+      continue;
+    }
+    if (len + n > 1520) {
+      len = 0;
+      continue;
+    }
+    memcpy(frame + len, bytes, n);
+    len += n;
+    /* frames are dumped with the length they announce, if they do, but
+     * answers are cut after their header when their data is sent from the
+     * read-ahead cache: a line that is not complete ends the frame, too */
+    if ((want == 0) && (len >= 54)) want = frame[52] | (frame[53] << 8);
+    if ((want >= 60) && (len >= want)) return(want);
+    if ((n < 16) && (len >= 60)) return(len);
+  }
+  return((len >= 60) ? len : 0);
+}
+
+/* replays the queries found in a listing made by ethersrv -v. answers from
+ * the listing are used to map the file and directory ids of the recorded
+ * session to the ones given out now */
+static int replay(benchhandler handler, const char *fname) {
+  static unsigned short idmap[65536];
+  unsigned char frame[1520], q[1520], answ[1520];
+  FILE *fd;
+  int len, qlen = 0, alen = 0, idoff;
+  unsigned long i;
+
+  fd = fopen(fname, "r");
+  if (fd == NULL) {
+    fprintf(stderr, "ERROR: failed to open %s\n", fname);
+    return(-1);
+  }
+  for (i = 0; i < 65536; i++) idmap[i] = (unsigned short)i;
+
+  while ((len = readdumpframe(fd, frame)) > 0) {
+    /* an answer to the previous query, from the recorded session? */
+    if ((qlen > 0) && (memcmp(frame, q + 6, 6) == 0) && (memcmp(frame + 6, q + 6, 6) != 0) && (frame[57] == q[57])) {
+      /* OPEN, CREATE, SPOPNFIL and FINDFIRST answers carry an id at 80 */
+      if (((q[59] == 0x16) || (q[59] == 0x17) || (q[59] == 0x2e) || (q[59] == 0x1b)) &&
+          (len >= 82) && (alen >= 82) && (frame[58] == 0) && (frame[59] == 0)) {
+        idmap[frame[80] | (frame[81] << 8)] = answ[80] | (answ[81] << 8);
+      }
+      qlen = 0;
+      continue;
+    }
+    if ((frame[12] != 0xed) || (frame[13] != 0xf5)) continue;
+
+    /* translate the file or directory id the query refers to */
+    switch (frame[59]) {
+      case 0x06: /* CLSFIL */
+      case 0x07: /* CMMTFIL */
+      case 0x1c: /* FINDNEXT */
+        idoff = 60;
+        break;
+      case 0x08: /* READFIL */
+      case 0x09: /* WRITEFIL */
+      case 0x21: /* SKFMEND */
+        idoff = 64;
+        break;
+      default:
+        idoff = 0;
+    }
+    if ((idoff > 0) && (len >= idoff + 2)) putw16(frame + idoff, idmap[frame[idoff] | (frame[idoff + 1] << 8)]);
+
+    memcpy(q, frame, len);
+    qlen = len;
+    memcpy(frame, srv, 6); /* the recorded server may have had another MAC */
+    frame[56] &= 127;      /* no checksum (payload ids may have changed) */
+    alen = timedquery(handler, frame, len, answ);
+  }
+  fclose(fd);
+  return(0);
+}
+
+/* BSD checksum the obvious way, to check bsdsum() against */
+static unsigned short refsum(const unsigned char *ptr, unsigned short l) {
+  unsigned short res = 0;
+  for (; l > 0; l--) {
+    res = (unsigned short)((res >> 1) + ((res & 1) << 15));
+    res = (unsigned short)(res + *ptr);
+    ptr++;
+  }
+  return(res);
+}
+
+/* checks bsdsum() results and measures its throughput */
+static int cksumbench(void) {
+  unsigned char buff[1514];
+  unsigned long long t0, t1;
+  unsigned long i, rounds = 200000;
+  unsigned short sum = 0;
+  for (i = 0; i < sizeof(buff); i++) buff[i] = (unsigned char)rand();
+  for (i = 0; i <= sizeof(buff); i++) {
+    if (bsdsum(buff, i) != refsum(buff, i)) {
+      fprintf(stderr, "ERROR: bsdsum() is wrong for %lu bytes\n", i);
+      return(-1);
+    }
+  }
+  t0 = metricsclock();
+  for (i = 0; i < rounds; i++) sum = (unsigned short)(sum + bsdsum(buff + (i & 7), sizeof(buff) - 8));
+  t1 = metricsclock();
+  printf("bsdsum: %.1f MiB/s, %.3f ns/byte (check: %04X)\n",
+         (double)rounds * (sizeof(buff) - 8) / (1024.0 * 1024.0) / ((t1 - t0) / 1e9),
+         (double)(t1 - t0) / ((double)rounds * (sizeof(buff) - 8)), sum);
+  return(0);
+}
+
+static int cmpul(const void *a, const void *b) {
+  unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+  return((x > y) - (x < y));
+}
+
+/* prints statistics gathered for every AL subfunction seen */
+static void report(unsigned long long elapsed) {
+  unsigned long i, n, total = 0;
+  double sum;
+  printf("AL  %-10s %8s %10s %9s %9s %9s %9s\n", "query", "count", "ops/s", "p50 us", "p90 us", "p99 us", "max us");
+  for (i = 0; i < 256; i++) {
+    n = stats[i].count;
+    if (n == 0) continue;
+    qsort(stats[i].ns, n, sizeof(unsigned long), cmpul);
+    for (sum = 0, total += n; n-- > 0;) sum += stats[i].ns[n];
+    n = stats[i].count;
+    printf("%02lX  %-10s %8lu %10.0f %9.1f %9.1f %9.1f %9.1f\n", i, alname(i), n, n / (sum / 1e9),
+           stats[i].ns[n / 2] / 1e3, stats[i].ns[n * 9 / 10] / 1e3, stats[i].ns[n * 99 / 100] / 1e3, stats[i].ns[n - 1] / 1e3);
+    free(stats[i].ns);
+    stats[i].ns = NULL;
+    stats[i].count = 0;
+    stats[i].cap = 0;
+  }
+  printf("total: %lu queries in %.3f s (%.0f queries/s)\n", total, elapsed / 1e9, total / (elapsed / 1e9));
+}
+
+/* runs benchmark spec */
+int benchrun(const char *spec, benchhandler handler, const unsigned char *srvmac, unsigned char pver) {
+  unsigned long long t0;
+  int res;
+  srv = srvmac;
+  protover = pver;
+  if (strcmp(spec, "cksum") == 0) return(cksumbench());
+  t0 = metricsclock();
+  if (strcmp(spec, "synth") == 0) {
+    res = synth(handler);
+  } else {
+    res = replay(handler, spec);
+  }
+  report(metricsclock() - t0);
+  return(res);
+}
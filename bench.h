@@ -0,0 +1,22 @@
+/*
+ * part of ethersrv
+ *
+ * Copyright (c) 2025-2026 D. Flissinger (megapearl)
+ */
+
+#ifndef BENCH_H_SENTINEL
+#define BENCH_H_SENTINEL
+
+/* the frame handler driven by the benchmark: processes query (len bytes),
+ * writes the whole answer frame to answer (at least 1520 bytes) and returns
+ * its length, or 0 if there is no answer */
+typedef int (*benchhandler)(unsigned char *query, int len, unsigned char *answer);
+
+/* runs a benchmark and prints per-query statistics to stdout. spec is either
+ * "synth" (synthetic workloads on drive C:), "cksum" (checksum throughput),
+ * or the name of a file with frames in the format dumped by ethersrv -v, to
+ * be replayed. srvmac is the server's MAC and protover the protocol version
+ * queries are built with. returns 0 on success */
+int benchrun(const char *spec, benchhandler handler, const unsigned char *srvmac, unsigned char protover);
+
+#endif
@@ -0,0 +1,30 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * Copyright (C) 2017 Mateusz Viste
+ * Copyright (c) 2025-2026 D. Flissinger (megapearl)
+ */
+
+#include "cksum.h"
+
+/* each step rotates the whole sum before adding the next byte, so every
+ * byte depends on the complete result of the previous one: the sum cannot
+ * be split into words or SIMD lanes, nor merged from partial sums. a table
+ * indexed by the sum and the next bytes would take 2^24 entries (32 MiB)
+ * for a one-byte step and 2^32 (8 GiB) for two, and a lookup is no faster
+ * than the ror + add chain per byte the loop below compiles to. there is
+ * thus no faster variant for the CPU to be probed for at runtime */
+unsigned short bsdsumcont(unsigned short res, const unsigned char *ptr, unsigned short l) {
+  for (; l > 0; l--) {
+    res = (res << 15) | (res >> 1);
+    res += *ptr;
+    ptr++;
+  }
+  return(res);
+}
+
+/* computes the BSD checksum of l bytes starting at ptr */
+unsigned short bsdsum(const unsigned char *ptr, unsigned short l) {
+  return(bsdsumcont(0, ptr, l));
+}
@@ -0,0 +1,17 @@
+/*
+ * part of ethersrv
+ *
+ * Copyright (c) 2025-2026 D. Flissinger (megapearl)
+ */
+
+#ifndef CKSUM_H_SENTINEL
+#define CKSUM_H_SENTINEL
+
+/* computes the BSD checksum of l bytes starting at ptr */
+unsigned short bsdsum(const unsigned char *ptr, unsigned short l);
+
+/* continues a BSD checksum: returns the checksum of data already summed up
+ * to res, followed by l bytes at ptr. bsdsumcont(0, ...) is bsdsum() */
+unsigned short bsdsumcont(unsigned short res, const unsigned char *ptr, unsigned short l);
+
+#endif
@@ -12,6 +12,8 @@
  * Copyright (c) 2025-2026 D. Flissinger (megapearl)
  */
 
+#define _GNU_SOURCE          /* recvmmsg(), sendmmsg() */
+
 #include <arpa/inet.h>       /* htons() */
 #include <errno.h>
 #include <fcntl.h>           /* fcntl(), open() */
@@ -25,16 +27,20 @@
 #else
   #include <endian.h>        /* le16toh(), le32toh() */
   #include <net/ethernet.h>
-  #include <netpacket/packet.h> /* sockaddr_ll */
+  #include <linux/filter.h>  /* struct sock_filter, BPF_STMT() */
+  #include <linux/if_packet.h> /* sockaddr_ll, PACKET_MMAP rings */
+  #include <sys/mman.h>      /* mmap() */
 #endif
 #include <limits.h>          /* PATH_MAX and such */
 #include <net/if.h>
+#include <pthread.h>
 #include <signal.h>
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>          /* memcpy() */
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <sys/uio.h>         /* struct iovec */
 #include <stdint.h>          /* uint16_t, uint32_t */
 #include <stdlib.h>          /* realpath() */
 #include <time.h>            /* time() */
@@ -43,8 +49,12 @@
 #include <stdarg.h>          /* va_list for debug function */
 
 /* NOTE: We do NOT include debug.h anymore as we handle it internally now */
+#include "bench.h"
+#include "cksum.h"
 #include "fs.h"
 #include "lock.h"
+#include "metrics.h"
+#include "trace.h"
 
 /* program version */
 #define PVER "20260217-fix"
@@ -54,12 +64,38 @@
 /* protocol version (single byte, must be in sync with etherdfs) */
 #define PROTOVER 2
 
-/* answer cache - last answers sent to clients */
-#define ANSWCACHESZ 16
+/* amount of last answers remembered for each client, so they can be sent
+ * again if the client did not get them, and for how many seconds */
+#define CLIENTANSWERS 4
+#define ANSW_MAXAGE 10
+
+/* hash buckets of a client table (must be a power of 2), max amount of
+ * clients in a table and seconds of inactivity after which a client is
+ * forgotten */
+#define CLIENTHASHSZ 256
+#define MAXCLIENTS 4096
+#define CLIENT_MAXIDLE 600
+
+/* pacing (-d): answers to a client that loses frames are held back. the
+ * delay grows to twice as much plus PACE_STEP ns with each retransmitted
+ * query, and shrinks by 1/16th with each new one. each thread holds back
+ * at most PACEQ answers at a time */
+#define PACE_STEP 250000ull
+#define PACEQ 16
+
+/* "nothing held back" value of paceflush() */
+#define PACE_IDLE (~0ull)
 
 /* Static buffer size, sufficient for max ethernet frame */
 #define BUFF_LEN 2048
 
+/* max amount of worker threads, and of frames queued for each of them */
+#define MAXWORKERS 64
+#define WORKQLEN 32
+
+/* how often (in seconds) the metrics file gets rewritten with -M */
+#define METRICS_PERIOD 5
+
 /* GLOBAL DEBUG FLAG */
 static int debug_enabled = 0;
 
@@ -76,14 +112,130 @@ static void debug_log(const char *format, ...) {
 /* Macro to replace old DBG calls */
 #define DBG(...) debug_log(__VA_ARGS__)
 
-static struct struct_answcache {
+struct struct_answcache {
   unsigned char frame[1520]; /* entire frame that was sent (first 6 bytes is the client's mac) */
-  time_t timestamp; /* time of answer (so if cache full I can drop oldest) */
+  time_t timestamp; /* time of answer */
   unsigned short len;  /* frame's length */
-} answcache[ANSWCACHESZ];
+  /* READFIL data served from a read-ahead buffer is not copied to frame:
+   * frame only holds the 60-byte header, payload points to the rest and
+   * payloadref keeps it valid (see readfileref()) */
+  const unsigned char *payload;
+  void *payloadref;
+  struct spending *pending; /* set while waiting for an asynchronous read */
+  unsigned long long due;   /* metricsclock() time it is to be sent at, 0 for right away */
+};
+
+/* an answer waiting for the data of an asynchronous read (-a). answer is
+ * cleared when the cache entry gets reused or freed meanwhile */
+struct spending {
+  struct struct_answcache *answer;
+};
+
+/* process() result for a query answered once its asynchronous read is done */
+#define ANSW_PENDING (-4)
+
+/* non-zero when READFIL cache misses are read asynchronously */
+static int asyncreads;
+
+/* longest delay answers may be held back for (ns), 0 if pacing is off */
+static unsigned long long pacemax;
+
+/* answers held back by a thread until they are due, copied along with
+ * their payload */
+struct spacer {
+  int count;
+  struct spaced {
+    struct sport *port;
+    struct struct_answcache a;
+  } q[PACEQ];
+};
+
+/* a client, with its last answers */
+struct sclient {
+  unsigned char mac[6];
+  unsigned char nextansw;  /* answers[] entry to be used for the next answer */
+  time_t lastseen;
+  struct sclient *hnext;   /* next client in the same hash bucket */
+  struct struct_answcache answers[CLIENTANSWERS];
+  /* flow statistics, and the pacing they lead to (see pace()) */
+  unsigned long queries;      /* queries processed */
+  unsigned long retrans;      /* queries answered again */
+  unsigned long long lastquery; /* metricsclock() time of the last query */
+  unsigned long long gap;     /* average time between queries (ns) */
+  unsigned long long delay;   /* current pacing delay (ns) */
+  unsigned long long lastdue; /* time its last answer is due at */
+};
 
-/* Global receive buffer to avoid repeated malloc/free */
-static unsigned char rx_buffer[BUFF_LEN];
+/* clients known to a thread, hashed by MAC */
+struct sclients {
+  struct sclient *hash[CLIENTHASHSZ];
+  unsigned int count;
+  time_t lastpurge;
+};
+
+/* a worker thread processes frames of the clients assigned to it, in the
+ * order they arrived. each client always goes to the same worker, which
+ * keeps its own client table */
+static struct sworker {
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int stop;
+  unsigned int head;  /* queue entry being (or to be) processed */
+  unsigned int count; /* amount of queued frames, including the one at head */
+  struct {
+    int len;
+    struct sport *port; /* the socket the frame came from */
+    unsigned char frame[BUFF_LEN];
+  } queue[WORKQLEN];
+  struct sclients clients;
+  struct spacer pacer;
+} *workers;
+
+static int workerscount = 0;
+
+#if defined(__linux__)
+/* max amount of frames received or sent by a single syscall */
+#define RXBATCH 32
+
+/* PACKET_MMAP rings (-m): frames are read from and written to memory shared
+ * with the kernel. each block holds RINGBLOCKSZ / RINGFRAMESZ frames */
+#define RINGFRAMESZ 2048
+#define RINGBLOCKSZ (128 * 1024)
+#define RXRINGBLOCKS 8
+#define TXRINGBLOCKS 4
+#else
+#define RXBATCH 1
+#endif
+
+/* max amount of sockets frames are served from: interfaces given on the
+ * command line, times the sockets of each (-q) */
+#define MAXPORTS 64
+
+/* a socket frames are received from and answered on, with the clients it
+ * serves. when there are several, each is served by its own thread, all of
+ * them sharing the same fs caches */
+struct sport {
+  int sock;
+  unsigned char mac[6];
+  const char *intname;
+  char **root;
+  pthread_t thread;
+  struct sclients clients;
+  struct spacer pacer;  /* answers held back by the thread serving it */
+#if defined(__linux__)
+  struct {
+    unsigned char *map;     /* RX ring, followed by the TX ring if any */
+    size_t mapsz;
+    unsigned int rxframes, txframes;
+    unsigned int rxhead, txhead; /* next frame to look at */
+  } ring;
+#endif
+  unsigned char rx[RXBATCH][BUFF_LEN]; /* receive buffers */
+};
+
+static struct sport *ports;
+static int portscount = 0;
 
 /* all the calls I support are in the range AL=0..2Eh */
 enum AL_SUBFUNCTIONS {
@@ -115,6 +267,34 @@ enum AL_SUBFUNCTIONS {
 /* an array with flags indicating whether given drive is FAT-based or not */
 static unsigned char drivesfat[26]; /* 0 if not, non-zero otherwise */
 
+/* drives that are served read-only, and whose files never change (-R) */
+static unsigned char drivesro[26];
+
+/* GETATTR and DISKSPACE answers are reused for that long (in ns, 0 to
+ * never) unless a query changed something on their drive meanwhile. the
+ * generation of a drive is bumped by each such query. nothing checks the
+ * host, so changes made there are missed until then: off unless -A */
+static unsigned long long attrttl = 0, diskttl = 0;
+static unsigned long drivegen[26];
+
+/* free space of each drive */
+static struct {
+  unsigned long long total, free;
+  unsigned long long due; /* metricsclock() time it expires at */
+  unsigned long gen;
+} diskcache[26];
+
+/* GETATTR results, per path */
+#define ATTRCACHESZ 256
+static struct {
+  char dos[80];           /* lower-case DOS path below the drive's root */
+  unsigned char drv;
+  unsigned char found;    /* zero if the item does not exist */
+  unsigned long long due;
+  unsigned long gen;
+  struct fileprops fprops;
+} attrcache[ATTRCACHESZ];
+
 /* the flag is set when ethersrv is expected to terminate */
 static sig_atomic_t volatile terminationflag = 0;
 
@@ -123,6 +303,14 @@ static void sigcatcher(int sig) {
   terminationflag = 1;
 }
 
+/* set by SIGUSR1, the main loop then dumps the trace ring (-T) */
+static sig_atomic_t volatile dumpflag = 0;
+
+static void sigdump(int sig) {
+  (void)sig;
+  dumpflag = 1;
+}
+
 /* returns a printable version of a FCB block (ie. with added null terminator) */
 static char *pfcb(char *s) {
   static char r[12] = "FILENAMEEXT";
@@ -130,34 +318,127 @@ static char *pfcb(char *s) {
   return(r);
 }
 
-/* OPTIMIZED: turns a string into all-lower-case characters, up to n chars max */
-static void lostring(char *s, int n) {
-    if (n < 0) { /* Process until null terminator */
-        while (*s) {
-            *s = tolower((unsigned char)*s);
-            s++;
-        }
-    } else { /* Process exactly n chars or until null */
-        while (n-- > 0 && *s) {
-            *s = tolower((unsigned char)*s);
-            s++;
-        }
+/* returns the hash bucket of a client MAC. the last bytes vary the most */
+static unsigned int clienthash(const unsigned char *mac) {
+  unsigned int h = ((unsigned int)mac[3] << 16) | ((unsigned int)mac[4] << 8) | mac[5];
+  h ^= h >> 11;
+  return((h ^ (h >> 5)) & (CLIENTHASHSZ - 1));
+}
+
+/* forgets the asynchronous read answer a may be waiting for */
+static void unpend(struct struct_answcache *a) {
+  if (a->pending == NULL) return;
+  a->pending->answer = NULL;
+  a->pending = NULL;
+}
+
+/* frees client c, dropping the data its answers still refer to */
+static void freeclient(struct sclient *c) {
+  int i;
+  for (i = 0; i < CLIENTANSWERS; i++) {
+    unpend(&(c->answers[i]));
+    readfileunref(c->answers[i].payloadref);
+  }
+  free(c);
+}
+
+/* forgets clients that were not heard of for CLIENT_MAXIDLE seconds. if
+ * none is idle and the table is full, the least recently seen one goes.
+ * must be called under fslock() */
+static void purgeclients(struct sclients *t, time_t now) {
+  struct sclient **link, **oldest = NULL, *c;
+  unsigned int b;
+  for (b = 0; b < CLIENTHASHSZ; b++) {
+    link = &(t->hash[b]);
+    while (*link != NULL) {
+      c = *link;
+      if (now - c->lastseen > CLIENT_MAXIDLE) {
+        *link = c->hnext;
+        freeclient(c);
+        t->count--;
+        continue;
+      }
+      if ((oldest == NULL) || (c->lastseen < (*oldest)->lastseen)) oldest = link;
+      link = &(c->hnext);
     }
+  }
+  if ((t->count >= MAXCLIENTS) && (oldest != NULL)) {
+    c = *oldest;
+    *oldest = c->hnext;
+    freeclient(c);
+    t->count--;
+  }
+  t->lastpurge = now;
 }
 
-/* finds the cache entry related to given client */
-static struct struct_answcache *findcacheentry(unsigned char *clientmac) {
-  int i, oldest = 0;
-  /* iterate through cache entries until matching mac is found */
-  for (i = 0; i < ANSWCACHESZ; i++) {
-    if (memcmp(answcache[i].frame, clientmac, 6) == 0) {
-      return(&(answcache[i])); /* found! */
+/* drops the read-ahead data referred to by answers of table t that are too
+ * old to be sent again, so idle clients do not keep buffers busy. must be
+ * called under fslock() */
+static void ageanswers(struct sclients *t, time_t now) {
+  struct struct_answcache *a;
+  struct sclient *c;
+  unsigned int b;
+  int i;
+  for (b = 0; b < CLIENTHASHSZ; b++) {
+    for (c = t->hash[b]; c != NULL; c = c->hnext) {
+      for (i = 0; i < CLIENTANSWERS; i++) {
+        a = &(c->answers[i]);
+        if ((a->payloadref == NULL) || (a->pending != NULL) || (now - a->timestamp <= ANSW_MAXAGE)) continue;
+        readfileunref(a->payloadref);
+        a->payloadref = NULL;
+        a->payload = NULL;
+        a->len = 0;
+      }
     }
-    /* is this the oldest entry? remember it. */
-    if (answcache[i].timestamp < answcache[oldest].timestamp) oldest = i;
   }
-  /* if nothing found, over-write the oldest entry */
-  return(&(answcache[oldest]));
+}
+
+/* returns the client with given MAC in table t, or NULL if unknown */
+static struct sclient *getclient(struct sclients *t, const unsigned char *mac) {
+  struct sclient *c;
+  for (c = t->hash[clienthash(mac)]; c != NULL; c = c->hnext) {
+    if (memcmp(c->mac, mac, 6) == 0) return(c);
+  }
+  return(NULL);
+}
+
+/* finds the client with given MAC in table t, registering it if new.
+ * returns NULL if out of memory. must be called under fslock() */
+static struct sclient *findclient(struct sclients *t, const unsigned char *mac) {
+  struct sclient *c;
+  unsigned int b = clienthash(mac);
+  time_t now = time(NULL);
+  c = getclient(t, mac);
+  if (c != NULL) {
+    c->lastseen = now;
+    return(c);
+  }
+  /* a new client is a good time to look for forgotten ones, but no more
+   * than once a minute (or when the table is full) */
+  if ((t->count >= MAXCLIENTS) || (now - t->lastpurge > 60)) purgeclients(t, now);
+  c = calloc(1, sizeof(struct sclient));
+  if (c == NULL) return(NULL);
+  memcpy(c->mac, mac, 6);
+  c->lastseen = now;
+  c->hnext = t->hash[b];
+  t->hash[b] = c;
+  t->count++;
+  return(c);
+}
+
+/* returns the answer already sent (or about to be) to client c for
+ * sequence seq, if it is recent enough, or NULL. an answer still waiting
+ * for its asynchronous read is matched however old it is: the retransmits
+ * of a client stuck on a slow disk must not start more reads */
+static struct struct_answcache *findanswer(struct sclient *c, unsigned char seq) {
+  struct struct_answcache *a;
+  int i;
+  for (i = 0; i < CLIENTANSWERS; i++) {
+    a = &(c->answers[i]);
+    if (a->frame[57] != seq) continue;
+    if ((a->pending != NULL) || ((a->len > 0) && (c->lastseen - a->timestamp <= ANSW_MAXAGE))) return(a);
+  }
+  return(NULL);
 }
 
 
@@ -180,556 +461,744 @@ static int isroot(char *root, char *dir) {
 }
 
 
-/* explode a full X:\DIR\FILE????.??? search path into directory and mask */
-static void explodepath(char *dir, char *file, char *source, int sourcelen) {
-  int i, lastbackslash;
-  /* if drive present, skip it */
-  if (sourcelen >= 2 && source[1] == ':') {
-    source += 2;
-    sourcelen -= 2;
+/* copies everything after last slash into dst */
+static void copy_after_last_slash(char *dst, const char *src) {
+    const char *last_slash = strrchr(src, '/');
+    if (last_slash)
+        strcpy(dst, last_slash + 1);
+}
+
+/* a query being processed, along with the answer being built. the DOS path
+ * the query names, if any, is turned once into a host-like path for all
+ * handlers: the drive's root, a slash and the path in lower case with
+ * slashes instead of backslashes */
+struct sreq {
+  struct struct_answcache *answer;
+  unsigned char *req;    /* query payload, past the 60-byte header */
+  int reqlen;
+  unsigned short *wreq;  /* same as req, but word-based (16 bits) */
+  unsigned char *answ;   /* answer payload */
+  unsigned short *wansw; /* same as answ, but word-based (16 bits) */
+  unsigned short *ax;    /* AX result */
+  int query;             /* AL subfunction */
+  int drv;
+  char *root;
+  char path[DIR_MAX];
+  int dirlen;            /* length of path up to its last slash included */
+  char name[DIR_MAX];    /* last component of the path, case preserved */
+};
+
+/* turns the len bytes long DOS path src (an optional drive letter, then
+ * backslashes) into a host-like path below root at dst (of size dstsz).
+ * the last component, as given, goes to name if not NULL (of size dstsz as
+ * well). returns the length of dst up to its last slash, or -1 if the path
+ * does not fit */
+static int dospath(char *dst, size_t dstsz, char *name, const char *root, const unsigned char *src, int len) {
+  size_t off = strlen(root);
+  int i, dirlen;
+  if ((len >= 2) && (src[1] == ':')) {
+    src += 2;
+    len -= 2;
+  }
+  if (memchr(src, 0, len) != NULL) len = (int)((const unsigned char *)memchr(src, 0, len) - src);
+  if (off + 1 + len >= dstsz) return(-1);
+  memcpy(dst, root, off);
+  dst[off++] = '/';
+  dirlen = (int)off;
+  for (i = 0; i < len; i++) {
+    if ((src[i] == '\\') || (src[i] == '/')) {
+      dst[off + i] = '/';
+      dirlen = (int)off + i + 1;
+    } else {
+      dst[off + i] = tolower(src[i]);
+    }
+  }
+  dst[off + len] = 0;
+  if (name != NULL) {
+    i = dirlen - (int)off;
+    memcpy(name, src + i, len - i);
+    name[len - i] = 0;
+  }
+  return(dirlen);
+}
+
+/* translates the directory of DOS path src (its first dirlen bytes) to the
+ * host path in dst, of DIR_MAX bytes, followed by the last component of src
+ * as is. returns 0 on success */
+static int dirtolong(char *dst, const char *src, int dirlen, const char *root) {
+  char dir[DIR_MAX];
+  size_t len;
+  memcpy(dir, src, dirlen);
+  dir[dirlen] = 0;
+  if (shorttolong(dst, dir, root) != 0) return(-1);
+  len = strlen(dst);
+  if (len + 1 + strlen(src + dirlen) >= DIR_MAX) return(-1);
+  if (dst[len - 1] != '/') dst[len++] = '/';
+  strcpy(dst + len, src + dirlen);
+  return(0);
+}
+
+/* translates DOS path src to the host path in dst, of DIR_MAX bytes. a last
+ * component with wildcards is left for the fs layer to match, only its
+ * directory (of dirlen bytes) is translated. returns 0 on success */
+static int wildtolong(char *dst, char *src, int dirlen, const char *root) {
+  if (strchr(src + dirlen, '?') != NULL) return(dirtolong(dst, src, dirlen, root));
+  return(shorttolong(dst, src, root));
+}
+
+/* copies the directory of the path of r (with its trailing slash) to dir */
+static void reqdir(char *dir, const struct sreq *r) {
+  memcpy(dir, r->path, r->dirlen);
+  dir[r->dirlen] = 0;
+}
+
+/* writes the properties of a found file the way FINDFIRST and FINDNEXT
+ * answer them. returns the length of the answer */
+static int answerfound(struct sreq *r, const struct fileprops *fprops, unsigned short dirss, unsigned short fpos) {
+  r->answ[0] = fprops->fattr;
+  memcpy(r->answ + 1, fprops->fcbname, 11);
+  r->answ[12] = fprops->ftime & 0xff;
+  r->answ[13] = (fprops->ftime >> 8) & 0xff;
+  r->answ[14] = (fprops->ftime >> 16) & 0xff;
+  r->answ[15] = (fprops->ftime >> 24) & 0xff;
+  r->answ[16] = fprops->fsize & 0xff;         /* fsize */
+  r->answ[17] = (fprops->fsize >> 8) & 0xff;  /* fsize */
+  r->answ[18] = (fprops->fsize >> 16) & 0xff; /* fsize */
+  r->answ[19] = (fprops->fsize >> 24) & 0xff; /* fsize */
+  r->wansw[10] = htole16(dirss); /* dir id */
+  r->wansw[11] = htole16(fpos);  /* file position in dir */
+  return(24);
+}
+
+/* query handlers: each returns the length of its answer past the 60-byte
+ * header, or a negative process() result */
+
+static int dodiskspace(struct sreq *r) {
+  unsigned long long diskspace = 0, freespace = 0, now;
+  DBG("DISKSPACE for drive '%c:'\n", 'A' + r->drv);
+  /* statvfs() can be slow on large pools, and some programs poll this */
+  now = metricsclock();
+  if ((diskcache[r->drv].due > now) && (diskcache[r->drv].gen == drivegen[r->drv])) {
+    METRICADD(MET_DISKHITS, 1);
+    diskspace = diskcache[r->drv].total;
+    freespace = diskcache[r->drv].free;
+  } else {
+    METRICADD(MET_DISKMISSES, 1);
+    diskspace = diskinfo(r->root, &freespace);
+    diskcache[r->drv].total = diskspace;
+    diskcache[r->drv].free = freespace;
+    diskcache[r->drv].due = (diskttl != 0) ? now + diskttl : 0;
+    diskcache[r->drv].gen = drivegen[r->drv];
+  }
+  /* limit results to slightly under 2 GiB (otherwise MS-DOS is confused) */
+  if (diskspace >= 2147483647LU) diskspace = 2147483647LU;
+  if (freespace >= 2147483647LU) freespace = 2147483647LU;
+
+  DBG("TOTAL: %llu KiB ; FREE: %llu KiB\n", diskspace >> 10, freespace >> 10);
+  *(r->ax) = 1; /* AX: media id (8 bits) | sectors per cluster (8 bits) -- MSDOS tolerates only 1 here! */
+  r->wansw[1] = htole16(32768);  /* CX: bytes per sector */
+  diskspace >>= 15; /* space to number of 32K clusters */
+  freespace >>= 15; /* space to number of 32K clusters */
+  r->wansw[0] = htole16(diskspace); /* BX: total clusters */
+  r->wansw[2] = htole16(freespace); /* DX: available clusters */
+  return(6);
+}
+
+static int doreadfil(struct sreq *r) {
+  struct struct_answcache *answer = r->answer;
+  uint16_t len, fileid;
+  uint32_t offset;
+  long readlen;
+  const unsigned char *data;
+  offset = le32toh(((uint32_t *)r->req)[0]);
+  fileid = le16toh(r->wreq[2]);
+  len = le16toh(r->wreq[3]);
+  DBG("Asking for %u bytes of the file #%u, starting offset %u\n", len, fileid, offset);
+  if (asyncreads != 0) {
+    /* the answer goes out once the data is there, see asyncanswers() */
+    struct spending *p = malloc(sizeof(struct spending));
+    readlen = FS_PENDING;
+    if (p != NULL) {
+      unsigned long long t = tracebegin();
+      p->answer = answer;
+      readlen = readfileasync(r->answ, fileid, offset, len, &data, &(answer->payloadref), p);
+      traceend(TRACE_IO, t, NULL);
+    }
+    if (readlen == FS_PENDING) {
+      answer->pending = p;
+      return((p != NULL) ? ANSW_PENDING : -1);
+    }
+    free(p);
+  } else {
+    unsigned long long t = tracebegin();
+    readlen = readfileref(r->answ, fileid, offset, len, &data, &(answer->payloadref));
+    traceend(TRACE_IO, t, NULL);
   }
-  /* find last slash or backslash and copy source into dir up to this last backslash */
-  lastbackslash = 0;
-  for (i = 0; i < sourcelen; i++) {
-    if ((source[i] == '\\') || (source[i] == '/')) lastbackslash = i;
+  if (readlen < 0) {
+    DBG("ERROR: invalid handle during read\n");
+    *(r->ax) = 5; /* "access denied" */
+    return(0);
+  }
+  /* data from a read-ahead buffer is sent from where it is */
+  if (answer->payloadref != NULL) answer->payload = data;
+  return((int)readlen);
+}
+
+static int dowritefil(struct sreq *r) {
+  uint16_t fileid;
+  uint32_t offset;
+  long writelen;
+  unsigned long long t;
+  offset = le32toh(((uint32_t *)r->req)[0]);
+  fileid = le16toh(r->wreq[2]);
+  DBG("Writing %u bytes into file #%u, starting offset %u\n", r->reqlen - 6, fileid, offset);
+  t = tracebegin();
+  writelen = writefile(r->req + 6, fileid, offset, r->reqlen - 6);
+  traceend(TRACE_IO, t, NULL);
+  if (writelen < 0) {
+    DBG("ERROR: Access denied during write\n");
+    *(r->ax) = 5; /* "access denied" */
+    return(0);
   }
-  memcpy(dir, source, lastbackslash + 1);
-  dir[lastbackslash + 1] = 0;
-  /* copy file/mask into file */
-  memcpy(file, source+lastbackslash+1, sourcelen - (lastbackslash + 1));
-  file[sourcelen - (lastbackslash + 1)] = 0;
+  r->wansw[0] = htole16(writelen);
+  return(2);
+}
+
+static int dolockfil(struct sreq *r) {
+  /* I do nothing, except lying that lock/unlock succeeded */
+  (void)r;
+  return(0);
 }
 
+static int dofindfirst(struct sreq *r) {
+  struct fileprops fprops;
+  char directory[DIR_MAX];
+  char host_directory[DIR_MAX];
+  unsigned short dirss;
+  char filemaskfcb[12];
+  unsigned fattr;
+  unsigned short fpos = 0;
+  int flags;
+  fattr = r->req[0];
+  /* the full "\DIR\FILE????.???" search path is made of directory and mask */
+  reqdir(directory, r);
+  filename2fcb(filemaskfcb, r->path + r->dirlen);
+  DBG("FindFirst in '%s'\nfilemask: '%s' (FCB '%s')\nattribs: 0x%2X\n", directory, r->path + r->dirlen, pfcb(filemaskfcb), fattr);
+  flags = 0;
+  if (isroot(r->root, directory) != 0) flags |= FFILE_ISROOT;
+  if (drivesfat[r->drv] != 0) flags |= FFILE_ISFAT;
+
+  /* try to get the host name for this string */
+  if (shorttolong(host_directory, directory, r->root) != 0) {
+    DBG("FINDFIRST Error (%s): Cannot obtain host path for directory.", directory);
+    /* Fail silently / let findfile fail naturally */
+  }
 
-/* replaces all rep chars in string s by repby */
-static void charreplace(char *s, char rep, char repby) {
-  while (*s != 0) {
-    if (*s == rep) *s = repby;
-    s++;
+  dirss = getitemss(host_directory);
+  if ((dirss == 0xffffu) || (findfile(&fprops, dirss, filemaskfcb, fattr, &fpos, flags) != 0)) {
+    DBG("No matching file found\n");
+    *(r->ax) = 0x12; /* "no more files" */
+    return(0);
   }
+  /* directory walks go on with the subdirectories, get them ready */
+  prefetchdir(directory, host_directory, drivesfat[r->drv]); /* found a file */
+  DBG("found file: FCB '%s' (attr %02Xh)\n", pfcb(fprops.fcbname), fprops.fattr);
+  return(answerfound(r, &fprops, dirss, fpos));
 }
 
-/* copies everything after last slash into dst */
-static void copy_after_last_slash(char *dst, const char *src) {
-    const char *last_slash = strrchr(src, '/');
-    if (last_slash)
-        strcpy(dst, last_slash + 1);
+static int dofindnext(struct sreq *r) {
+  unsigned short fpos;
+  struct fileprops fprops;
+  char *fcbmask;
+  unsigned char fattr;
+  unsigned short dirss;
+  char *dir;
+  int flags;
+  dirss = le16toh(r->wreq[0]);
+  fpos = le16toh(r->wreq[1]);
+  fattr = r->req[4];
+  fcbmask = (char *)r->req + 5;
+  DBG("FindNext looks for nth file %u in dir #%u\nfcbmask: '%s'\nattribs: 0x%2X\n", fpos, dirss, pfcb(fcbmask), fattr);
+  /* the dir id comes from the client, it may not name any directory */
+  dir = sstoitem(dirss);
+  if (dir == NULL) {
+    DBG("No such directory\n");
+    *(r->ax) = 0x12; /* "no more files" */
+    return(0);
+  }
+  flags = 0;
+  if (isroot(r->root, dir) != 0) flags |= FFILE_ISROOT;
+  if (drivesfat[r->drv] != 0) flags |= FFILE_ISFAT;
+  if (findfile(&fprops, dirss, fcbmask, fattr, &fpos, flags)) {
+    DBG("No more matching files found\n");
+    *(r->ax) = 0x12; /* "no more files" */
+    return(0);
+  }
+  DBG("found file: FCB '%s' (attr %02Xh)\n", pfcb(fprops.fcbname), fprops.fattr);
+  return(answerfound(r, &fprops, dirss, fpos));
+}
+
+static int domkrmdir(struct sreq *r) {
+  char host_directory[DIR_MAX];
+
+  if (shorttolong(host_directory, r->path, r->root) == 0) {
+    DBG("MKDIR/RMDIR Match fail: %s\n", r->path);
+  }
+
+  if (r->query == AL_MKDIR) {
+    DBG("MKDIR '%s'\n", host_directory);
+    if (makedir(host_directory) != 0) {
+      *(r->ax) = 29;
+      DBG("MKDIR Error: %s\n", strerror(errno));
+    }
+  } else {
+    DBG("RMDIR '%s'\n", host_directory);
+    if (remdir(host_directory) != 0) {
+      *(r->ax) = 29;
+      DBG("RMDIR Error: %s\n", strerror(errno));
+    }
+  }
+  return(0);
+}
+
+static int dochdir(struct sreq *r) {
+  char host_directory[DIR_MAX];
+  DBG("CHDIR '%s'\n", r->path);
+
+  /* try to get the host name for this string */
+  if (shorttolong(host_directory, r->path, r->root) != 0) {
+    DBG("CHDIR Error (%s): Cannot obtain host path.\n", r->path);
+    *(r->ax) = 3;
+  } else if (changedir(host_directory) != 0) {
+    DBG("CHDIR Error (%s): %s\n", host_directory, strerror(errno));
+    *(r->ax) = 3;
+  }
+  return(0);
+}
+
+static int doclsfil(struct sreq *r) {
+  DBG("CLOSE FILE\n");
+  if (r->reqlen >= 2) closefile(le16toh(r->wreq[0]));
+  return(0);
+}
+
+static int docmmtfil(struct sreq *r) {
+  DBG("COMMIT FILE\n");
+  if (r->reqlen >= 2) commitfile(le16toh(r->wreq[0]));
+  return(0);
+}
+
+static int dosetattr(struct sreq *r) {
+  char host_fullpathname[DIR_MAX];
+  unsigned char fattr = r->req[0];
+
+  DBG("SETATTR [file: '%s', attr: 0x%02X]\n", r->path, fattr);
+
+  if (shorttolong(host_fullpathname, r->path, r->root) != 0) {
+    DBG("SETATTR Error (%s)\n", r->path);
+    *(r->ax) = 2;
+  } else if (drivesfat[r->drv] != 0) {
+    if (setitemattr(host_fullpathname, fattr) != 0) *(r->ax) = 2;
+  }
+  return(0);
+}
+
+/* returns the attrcache slot of the path of r, or -1 if it is too long to
+ * be cached */
+static int attrslot(const struct sreq *r) {
+  const char *dos = r->path + strlen(r->root);
+  uint32_t h = 2166136261u;
+  if (strlen(dos) >= sizeof(attrcache[0].dos)) return(-1);
+  h = (h ^ (unsigned char)r->drv) * 16777619u;
+  for (; *dos != 0; dos++) h = (h ^ (unsigned char)*dos) * 16777619u;
+  return((int)((h ^ (h >> 16)) & (ATTRCACHESZ - 1)));
+}
+
+static int dogetattr(struct sreq *r) {
+  char host_fullpathname[DIR_MAX];
+  struct fileprops fprops;
+  int reslen = 0, slot, found;
+  unsigned long long now;
+
+  DBG("GETATTR on file: '%s' (fatflag=%d)\n", r->path, drivesfat[r->drv]);
+
+  /* programs polling for a file (or for its size) are answered from the
+   * cache, that remembers missing files as well */
+  now = metricsclock();
+  slot = attrslot(r);
+  if ((slot >= 0) && (attrcache[slot].due > now) && (attrcache[slot].gen == drivegen[r->drv])
+      && (attrcache[slot].drv == r->drv) && (strcmp(attrcache[slot].dos, r->path + strlen(r->root)) == 0)) {
+    METRICADD(MET_ATTRHITS, 1);
+    found = attrcache[slot].found;
+    fprops = attrcache[slot].fprops;
+  } else {
+    METRICADD(MET_ATTRMISSES, 1);
+    found = (shorttolong(host_fullpathname, r->path, r->root) == 0) && (getitemattr(host_fullpathname, &fprops, drivesfat[r->drv]) != 0xFF);
+    if ((slot >= 0) && (attrttl != 0)) {
+      strcpy(attrcache[slot].dos, r->path + strlen(r->root));
+      attrcache[slot].drv = (unsigned char)r->drv;
+      attrcache[slot].found = (unsigned char)found;
+      attrcache[slot].due = now + attrttl;
+      attrcache[slot].gen = drivegen[r->drv];
+      if (found) attrcache[slot].fprops = fprops;
+    }
+  }
+
+  if (!found) {
+    DBG("no file found\n");
+    *(r->ax) = 2;
+  } else {
+    DBG("found it (%lu bytes, attr 0x%02X)\n", fprops.fsize, fprops.fattr);
+    r->answ[reslen++] = fprops.ftime & 0xff;
+    r->answ[reslen++] = (fprops.ftime >> 8) & 0xff;
+    r->answ[reslen++] = (fprops.ftime >> 16) & 0xff;
+    r->answ[reslen++] = (fprops.ftime >> 24) & 0xff;
+    r->answ[reslen++] = fprops.fsize & 0xff;
+    r->answ[reslen++] = (fprops.fsize >> 8) & 0xff;
+    r->answ[reslen++] = (fprops.fsize >> 16) & 0xff;
+    r->answ[reslen++] = (fprops.fsize >> 24) & 0xff;
+    r->answ[reslen++] = fprops.fattr;
+  }
+  return(reslen);
+}
+
+static int dorename(struct sreq *r) {
+  char fn2[DIR_MAX];
+  char host_fn1[DIR_MAX];
+  char host_fn2[DIR_MAX];
+  char existing[DIR_MAX];
+  int fn1len = r->req[0];
+  int dirlen2;
+  /* RENAME carries two paths, the second one right after the first */
+  if ((r->reqlen <= fn1len) || ((r->dirlen = dospath(r->path, sizeof(r->path), NULL, r->root, r->req + 1, fn1len)) < 0)
+      || ((dirlen2 = dospath(fn2, sizeof(fn2), NULL, r->root, r->req + 1 + fn1len, r->reqlen - (1 + fn1len))) < 0)) {
+    *(r->ax) = 2;
+    return(0);
+  }
+
+  DBG("RENAME src='%s' dst='%s'\n", r->path, fn2);
+
+  /* the new name is created as given, in the host directory of fn2. DOS
+   * names are case-insensitive, a file taking it in another case counts */
+  if (wildtolong(host_fn1, r->path, r->dirlen, r->root) != 0) {
+    DBG("RENAME Error (%s): Cannot obtain host path.\n", r->path);
+    *(r->ax) = 2;
+  } else if (dirtolong(host_fn2, fn2, dirlen2, r->root) != 0) {
+    *(r->ax) = 3;
+  } else if ((strchr(fn2 + dirlen2, '?') == NULL) && (shorttolong(existing, fn2, r->root) == 0)) {
+    DBG("ERROR: '%s' exists already\n", fn2);
+    *(r->ax) = 5;
+  } else {
+    DBG("'%s' doesn't exist -> proceed with renaming\n", fn2);
+    if (renfile(host_fn1, host_fn2, drivesfat[r->drv]) != 0) *(r->ax) = (errno == ENOENT) ? 2 : 5;
+  }
+  return(0);
+}
+
+static int dodelete(struct sreq *r) {
+  char host_fullpathname[DIR_MAX];
+  DBG("DELETE '%s'\n", r->path);
+
+  if (wildtolong(host_fullpathname, r->path, r->dirlen, r->root) != 0) {
+    DBG("DELETE Error (%s)\n", r->path);
+    *(r->ax) = 2;
+  } else if ((strchr(r->path + r->dirlen, '?') == NULL) && (getitemattr(host_fullpathname, NULL, drivesfat[r->drv]) & 1)) { /* is it read-only? */
+    *(r->ax) = 5; /* "access denied" */
+  } else if (delfiles(host_fullpathname, drivesfat[r->drv]) < 0) {
+    *(r->ax) = (errno == EACCES) ? 5 : 2;
+  }
+  return(0);
+}
+
+/* OPEN, CREATE and SPOPNFIL */
+static int doopen(struct sreq *r) {
+  struct fileprops fprops;
+  char directory[DIR_MAX];
+  char host_directory[DIR_MAX];
+  char fnamefcb[12];
+  char host_fullpathname[DIR_MAX*2+1];
+  char *fname = r->name;
+  int fileres, reslen = 0;
+  unsigned short stackattr, actioncode, spopen_openmode, spopres = 0;
+  unsigned char resopenmode;
+  unsigned short fileid;
+
+  stackattr = le16toh(r->wreq[0]);
+  actioncode = le16toh(r->wreq[1]);
+  spopen_openmode = le16toh(r->wreq[2]);
+  reqdir(directory, r);
+
+  /* Check directory existence */
+  if ((shorttolong(host_directory, directory, r->root) != 0) || (changedir(host_directory) != 0)) {
+    DBG("open/create/spop failed because directory does not exist\n");
+    *(r->ax) = 3; /* "path not found" */
+    return(0);
+  }
+
+  /* Directory exists, attempt to get host version of the full path name */
+  if (shorttolong(host_fullpathname, r->path, r->root) == 0) {
+    DBG("Exists, pre:  fname '%s' host_fullpathname '%s'\n", fname, host_fullpathname);
+    copy_after_last_slash(fname, host_fullpathname);
+    DBG("Exists, post: fname '%s' host_fullpathname '%s'\n", fname, host_fullpathname);
+  } else {
+    sprintf(host_fullpathname, "%s/%s", host_directory, fname);
+  }
+
+  filename2fcb(fnamefcb, fname);
+
+  DBG("looking for file '%s' (FCB '%s') in '%s'\n", fname, pfcb(fnamefcb), directory);
+
+  if (r->query == AL_CREATE) {
+    DBG("CREATEFIL / stackattr (attribs)=%04Xh / fn='%s'\n", stackattr, r->path);
+    fileres = createfile(&fprops, host_directory, fname, stackattr & 0xff, drivesfat[r->drv]);
+    resopenmode = 2; /* read/write */
+  } else if (r->query == AL_SPOPNFIL) {
+    int attr;
+    DBG("SPOPNFIL / action=%04Xh / fn='%s'\n", actioncode, r->path);
+    attr = getitemattr(host_fullpathname, &fprops, drivesfat[r->drv]);
+    resopenmode = spopen_openmode & 0x7f;
+    if (attr == 0xff) { /* file not found */
+      if (drivesro[r->drv] != 0) {
+        fileres = 1; /* fail (read-only drive) */
+      } else if ((actioncode & 0xf0) == 16) { /* create */
+        fileres = createfile(&fprops, host_directory, fname, stackattr & 0xff, drivesfat[r->drv]);
+        if (fileres == 0) spopres = 2; /* created */
+      } else {
+        fileres = 1; /* fail */
+      }
+    } else if ((attr & (FAT_VOL | FAT_DIR)) != 0) {
+      fileres = 1; /* fail (is dir/vol) */
+    } else { /* file found */
+      if ((actioncode & 0x0f) == 1) { /* open */
+        fileres = 0;
+        spopres = 1; /* opened */
+      } else if (((actioncode & 0x0f) == 2) && (drivesro[r->drv] == 0)) { /* truncate */
+        fileres = createfile(&fprops, host_directory, fname, stackattr & 0xff, drivesfat[r->drv]);
+        if (fileres == 0) spopres = 3; /* truncated */
+      } else {
+        fileres = 1; /* fail */
+      }
+    }
+  } else { /* simple 'OPEN' */
+    int attr;
+    DBG("OPENFIL / fn='%s'\n", r->path);
+    resopenmode = stackattr & 0xff;
+    attr = getitemattr(host_fullpathname, &fprops, drivesfat[r->drv]);
+    if ((attr != 0xff) && ((attr & (FAT_VOL | FAT_DIR)) == 0)) {
+      fileres = 0;
+    } else {
+      fileres = 1;
+    }
+  }
+
+  if (fileres != 0) {
+    DBG("open/create/spop failed with fileres = %d\n", fileres);
+    *(r->ax) = 2;
+    return(0);
+  }
+
+  fileid = getitemss(host_fullpathname);
+  if (fileid == 0xffffu) {
+    DBG("ERROR: failed to get a proper fileid!\n");
+    return(-1);
+  }
+  r->answ[reslen++] = fprops.fattr;
+  memcpy(r->answ + reslen, fprops.fcbname, 11);
+  reslen += 11;
+  r->answ[reslen++] = fprops.ftime & 0xff;
+  r->answ[reslen++] = (fprops.ftime >> 8) & 0xff;
+  r->answ[reslen++] = (fprops.ftime >> 16) & 0xff;
+  r->answ[reslen++] = (fprops.ftime >> 24) & 0xff;
+  r->answ[reslen++] = fprops.fsize & 0xff;
+  r->answ[reslen++] = (fprops.fsize >> 8) & 0xff;
+  r->answ[reslen++] = (fprops.fsize >> 16) & 0xff;
+  r->answ[reslen++] = (fprops.fsize >> 24) & 0xff;
+  r->answ[reslen++] = fileid & 0xff;
+  r->answ[reslen++] = fileid >> 8;
+  /* CX result */
+  r->answ[reslen++] = spopres & 0xff;
+  r->answ[reslen++] = spopres >> 8;
+  r->answ[reslen++] = resopenmode;
+  return(reslen);
+}
+
+static int doskfmend(struct sreq *r) {
+  int32_t offs = le32toh(((uint32_t *)r->req)[0]);
+  long fsize;
+  unsigned short fss = le16toh(r->wreq[2]);
+  DBG("SKFMEND on file #%u at offset %d\n", fss, offs);
+  if (offs > 0) offs = 0;
+
+  fsize = getfopsize(fss);
+  if (fsize < 0) {
+    *(r->ax) = 2;
+    return(0);
+  }
+  offs += fsize;
+  if (offs < 0) offs = 0;
+  ((uint32_t *)r->answ)[0] = htole32(offs);
+  return(4);
 }
 
+/* what process() knows about each query it supports */
+struct sopcode {
+  unsigned char al;
+  int (*handler)(struct sreq *r);
+  int minlen, maxlen;      /* valid payload lengths, others are ignored */
+  int pathoff;             /* offset of the DOS path in the payload, -1 if none */
+  unsigned char modifies;  /* refused on read-only drives */
+  unsigned char changes;   /* may change items or free space of the drive */
+};
+
+#define OPLEN_ANY 0x7fff
+
+static const struct sopcode opcodes[] = {
+  {AL_RMDIR,     domkrmdir,    0, OPLEN_ANY,  0, 1, 1},
+  {AL_MKDIR,     domkrmdir,    0, OPLEN_ANY,  0, 1, 1},
+  {AL_CHDIR,     dochdir,      0, OPLEN_ANY,  0, 0, 0},
+  {AL_CLSFIL,    doclsfil,     0, OPLEN_ANY, -1, 0, 0},
+  {AL_CMMTFIL,   docmmtfil,    0, OPLEN_ANY, -1, 0, 0},
+  {AL_READFIL,   doreadfil,    8, 8,         -1, 0, 0},
+  {AL_WRITEFIL,  dowritefil,   6, OPLEN_ANY, -1, 1, 1},
+  {AL_LOCKFIL,   dolockfil,    0, OPLEN_ANY, -1, 0, 0},
+  {AL_UNLOCKFIL, dolockfil,    0, OPLEN_ANY, -1, 0, 0},
+  {AL_DISKSPACE, dodiskspace,  0, OPLEN_ANY, -1, 0, 0},
+  {AL_SETATTR,   dosetattr,    2, OPLEN_ANY,  1, 1, 1},
+  {AL_GETATTR,   dogetattr,    1, OPLEN_ANY,  0, 0, 0},
+  {AL_RENAME,    dorename,     3, OPLEN_ANY, -1, 1, 1},
+  {AL_DELETE,    dodelete,     0, OPLEN_ANY,  0, 1, 1},
+  {AL_OPEN,      doopen,       6, OPLEN_ANY,  6, 0, 0},
+  {AL_CREATE,    doopen,       6, OPLEN_ANY,  6, 1, 1},
+  {AL_FINDFIRST, dofindfirst,  1, OPLEN_ANY,  1, 0, 0},
+  {AL_FINDNEXT,  dofindnext,  16, OPLEN_ANY, -1, 0, 0},
+  {AL_SKFMEND,   doskfmend,    6, 6,         -1, 0, 0},
+  {AL_SPOPNFIL,  doopen,       6, OPLEN_ANY,  6, 0, 1}
+};
+
+/* opcodes[] entry of each AL subfunction, NULL if unsupported. filled on
+ * the first call of process(), that runs under fslock() */
+static const struct sopcode *optable[256];
+
 /* --- MAIN PROCESSING LOGIC --- */
 static int process(struct struct_answcache *answer, unsigned char *reqbuff, int reqbufflen, unsigned char *mymac, char **rootarray) {
-  int query, reqdrv; /* reqflags unused */
-  int reslen = 0;
-  unsigned short *ax;       /* pointer to store the value of AX after the query */
-  unsigned char *answ;      /* convenience pointer to answer->frame */
-  unsigned short *wreqbuff; /* same as query, but word-based (16 bits) */
-  unsigned short *wansw;    /* same as answer->frame, but word-based (16 bits) */
-  char *root;
-  
-  answ = answer->frame;
+  const struct sopcode *op;
+  struct sreq r;
+  int res;
+  unsigned int i;
+  unsigned long long t;
+
+  if (optable[opcodes[0].al] == NULL) {
+    for (i = 0; i < sizeof(opcodes) / sizeof(opcodes[0]); i++) optable[opcodes[i].al] = &(opcodes[i]);
+  }
+
   /* must be at least 60 bytes long */
   if (reqbufflen < 60) return(-1);
-  
-  /* cache check */
-  if ((answ[57] == reqbuff[57]) && (memcmp(answ, reqbuff + 6, 6) == 0) && (answer->len > 0)) {
-  #if SIMLOSS > 0
-    fprintf(stderr, "Cache HIT (seq %u)\n", answ[57]);
-  #endif
-    return(answer->len);
-  }
 
   /* copy all headers as-is */
-  memcpy(answ, reqbuff, 60);
+  memcpy(answer->frame, reqbuff, 60);
 
   /* switch src and dst addresses so the reply header is ready */
-  memcpy(answ, answ + 6, 6);  /* copy source mac into dst field */
-  memcpy(answ + 6, mymac, 6); /* copy my mac into source field */
-  
+  memcpy(answer->frame, answer->frame + 6, 6);  /* copy source mac into dst field */
+  memcpy(answer->frame + 6, mymac, 6); /* copy my mac into source field */
+
   /* remember the pointer to the AX result, and fetch reqdrv and AL query */
-  ax = (uint16_t *)answ + 29;
-  reqdrv = reqbuff[58] & 31; /* 5 lowest -> drive */
-  /* reqflags = reqbuff[58] >> 5; */ /* 3 highest bits -> flags (unused) */
-  
-  query = reqbuff[59];
-  
+  r.answer = answer;
+  r.ax = (uint16_t *)answer->frame + 29;
+  r.drv = reqbuff[58] & 31; /* 5 lowest -> drive */
+  /* 3 highest bits of reqbuff[58] are flags (unused) */
+  r.query = reqbuff[59];
+
   /* skip eth headers now, as well as padding, seq, reqdrv and AL */
-  reqbuff += 60;
-  answ += 60;
-  reqbufflen -= 60;
-  reslen = 0;
-  
-  /* set up wansw and wreqbuff */
-  wansw = (uint16_t *)answ;
-  wreqbuff = (uint16_t *)reqbuff;
+  r.req = reqbuff + 60;
+  r.reqlen = reqbufflen - 60;
+  r.wreq = (uint16_t *)r.req;
+  r.answ = answer->frame + 60;
+  r.wansw = (uint16_t *)r.answ;
 
   /* is the drive valid? (C: - Z:) */
-  if ((reqdrv < 2) || (reqdrv > 25)) { /* 0=A, 1=B, 2=C, etc */
-    DBG("invalid drive value: 0x%02Xh\n", reqdrv);
+  if ((r.drv < 2) || (r.drv > 25)) { /* 0=A, 1=B, 2=C, etc */
+    DBG("invalid drive value: 0x%02Xh\n", r.drv);
     return(-3);
   }
-  
+
   /* do I know this drive? */
-  root = rootarray[reqdrv];
-  if (root == NULL) {
-    DBG("unknown drive: %c: (%02Xh)\n", 'A' + reqdrv, reqdrv);
+  r.root = rootarray[r.drv];
+  if (r.root == NULL) {
+    DBG("unknown drive: %c: (%02Xh)\n", 'A' + r.drv, r.drv);
     /* Return -3 to ignore silenty to avoid log spam on client polls */
     return(-3);
   }
-  
+
   /* assume success (hence AX == 0 most of the time) */
-  *ax = 0;
-  
+  *(r.ax) = 0;
+
+  /* read-only drives refuse anything that would modify them */
+  op = optable[r.query];
+  if ((op != NULL) && (op->modifies != 0) && (drivesro[r.drv] != 0)) {
+    DBG("drive %c: is read-only, query %02Xh refused\n", 'A' + r.drv, r.query);
+    *(r.ax) = 5; /* "access denied" */
+    return(60);
+  }
+
   /* let's look at the exact query */
-  DBG("Got query: %02Xh [%02X %02X %02X %02X]\n", query, reqbuff[0], reqbuff[1], reqbuff[2], reqbuff[3]);
-  
-  if (query == AL_DISKSPACE) {
-    unsigned long long diskspace = 0, freespace = 0; /* INITIALIZED TO 0 */
-    DBG("DISKSPACE for drive '%c:'\n", 'A' + reqdrv);
-    diskspace = diskinfo(root, &freespace);
-    /* limit results to slightly under 2 GiB (otherwise MS-DOS is confused) */
-    if (diskspace >= 2147483647LU) diskspace = 2147483647LU;
-    if (freespace >= 2147483647LU) freespace = 2147483647LU;
-    
-    DBG("TOTAL: %llu KiB ; FREE: %llu KiB\n", diskspace >> 10, freespace >> 10);
-    *ax = 1; /* AX: media id (8 bits) | sectors per cluster (8 bits) -- MSDOS tolerates only 1 here! */
-    wansw[1] = htole16(32768);  /* CX: bytes per sector */
-    diskspace >>= 15; /* space to number of 32K clusters */
-    freespace >>= 15; /* space to number of 32K clusters */
-    wansw[0] = htole16(diskspace); /* BX: total clusters */
-    wansw[2] = htole16(freespace); /* DX: available clusters */
-    reslen += 6;
-    
-  } else if ((query == AL_READFIL) && (reqbufflen == 8)) {  /* AL=08h */
-    uint16_t len, fileid;
-    uint32_t offset;
-    long readlen;
-    offset = le32toh(((uint32_t *)reqbuff)[0]);
-    fileid = le16toh(wreqbuff[2]);
-    len = le16toh(wreqbuff[3]);
-    DBG("Asking for %u bytes of the file #%u, starting offset %u\n", len, fileid, offset);
-    readlen = readfile(answ, fileid, offset, len);
-    if (readlen < 0) {
-      DBG("ERROR: invalid handle during read\n");
-      *ax = 5; /* "access denied" */
-    } else {
-      reslen += readlen;
-    }
-    
-  } else if ((query == AL_WRITEFIL) && (reqbufflen >= 6)) {  /* AL=09h */
-    uint16_t fileid;
-    uint32_t offset;
-    long writelen;
-    offset = le32toh(((uint32_t *)reqbuff)[0]);
-    fileid = le16toh(wreqbuff[2]);
-    DBG("Writing %u bytes into file #%u, starting offset %u\n", reqbufflen - 6, fileid, offset);
-    writelen = writefile(reqbuff + 6, fileid, offset, reqbufflen - 6);
-    if (writelen < 0) {
-      DBG("ERROR: Access denied during write\n");
-      *ax = 5; /* "access denied" */
-    } else {
-      wansw[0] = htole16(writelen);
-      reslen += 2;
-    }
-    
-  } else if ((query == AL_LOCKFIL) || (query == AL_UNLOCKFIL)) { /* 0x0A / 0x0B */
-    /* I do nothing, except lying that lock/unlock succeeded */
-    
-  } else if (query == AL_FINDFIRST) { /* 0x1B */
-    struct fileprops fprops;
-    char directory[DIR_MAX];
-    char host_directory[DIR_MAX];
-    unsigned short dirss;
-    char filemask[16], filemaskfcb[12];
-    int offset;
-    unsigned fattr;
-    unsigned short fpos = 0;
-    int flags;
-    fattr = reqbuff[0];
-    offset = sprintf(directory, "%s/", root);
-    /* */
-    /* explode the full "\DIR\FILE????.???" search path into directory and mask */
-    explodepath(directory + offset, filemask, (char *)reqbuff + 1, reqbufflen - 1);
-    lostring(directory + offset, -1);
-    lostring(filemask, -1);
-    charreplace(directory, '\\', '/');
-    /* */
-    filename2fcb(filemaskfcb, filemask);
-    DBG("FindFirst in '%s'\nfilemask: '%s' (FCB '%s')\nattribs: 0x%2X\n", directory, filemask, pfcb(filemaskfcb), fattr);
-    flags = 0;
-    if (isroot(root, directory) != 0) flags |= FFILE_ISROOT;
-    if (drivesfat[reqdrv] != 0) flags |= FFILE_ISFAT;
-
-    /* try to get the host name for this string */
-    if (shorttolong(host_directory, directory, root) != 0) {
-      DBG("FINDFIRST Error (%s): Cannot obtain host path for directory.", directory);
-      /* Fail silently / let findfile fail naturally */
-    }
+  DBG("Got query: %02Xh [%02X %02X %02X %02X]\n", r.query, r.req[0], r.req[1], r.req[2], r.req[3]);
 
-    dirss = getitemss(host_directory);
-    if ((dirss == 0xffffu) || (findfile(&fprops, dirss, filemaskfcb, fattr, &fpos, flags) != 0)) {
-      DBG("No matching file found\n");
-      *ax = 0x12; /* "no more files" */
-    } else { /* found a file */
-      DBG("found file: FCB '%s' (attr %02Xh)\n", pfcb(fprops.fcbname), fprops.fattr);
-      answ[0] = fprops.fattr; /* fattr */
-      memcpy(answ + 1, fprops.fcbname, 11);
-      answ[12] = fprops.ftime & 0xff;
-      answ[13] = (fprops.ftime >> 8) & 0xff;
-      answ[14] = (fprops.ftime >> 16) & 0xff;
-      answ[15] = (fprops.ftime >> 24) & 0xff;
-      answ[16] = fprops.fsize & 0xff;         /* fsize */
-      answ[17] = (fprops.fsize >> 8) & 0xff;  /* fsize */
-      answ[18] = (fprops.fsize >> 16) & 0xff; /* fsize */
-      answ[19] = (fprops.fsize >> 24) & 0xff; /* fsize */
-      wansw[10] = htole16(dirss); /* dir id */
-      wansw[11] = htole16(fpos); /* file position in dir */
-      reslen = 24;
-    }
-    
-  } else if (query == AL_FINDNEXT) { /* 0x1C */
-    unsigned short fpos;
-    struct fileprops fprops;
-    char *fcbmask;
-    unsigned char fattr;
-    unsigned short dirss;
-    int flags;
-    dirss = le16toh(wreqbuff[0]);
-    fpos = le16toh(wreqbuff[1]);
-    fattr = reqbuff[4];
-    fcbmask = (char *)reqbuff + 5;
-    /* */
-    DBG("FindNext looks for nth file %u in dir #%u\nfcbmask: '%s'\nattribs: 0x%2X\n", fpos, dirss, pfcb(fcbmask), fattr);
-    flags = 0;
-    if (isroot(root, sstoitem(dirss)) != 0) flags |= FFILE_ISROOT;
-    if (drivesfat[reqdrv] != 0) flags |= FFILE_ISFAT;
-    if (findfile(&fprops, dirss, fcbmask, fattr, &fpos, flags)) {
-      DBG("No more matching files found\n");
-      *ax = 0x12; /* "no more files" */
-    } else { /* found a file */
-      DBG("found file: FCB '%s' (attr %02Xh)\n", pfcb(fprops.fcbname), fprops.fattr);
-      answ[0] = fprops.fattr; 
-      memcpy(answ + 1, fprops.fcbname, 11);
-      answ[12] = fprops.ftime & 0xff;
-      answ[13] = (fprops.ftime >> 8) & 0xff;
-      answ[14] = (fprops.ftime >> 16) & 0xff;
-      answ[15] = (fprops.ftime >> 24) & 0xff;
-      answ[16] = fprops.fsize & 0xff;         /* fsize */
-      answ[17] = (fprops.fsize >> 8) & 0xff;  /* fsize */
-      answ[18] = (fprops.fsize >> 16) & 0xff; /* fsize */
-      answ[19] = (fprops.fsize >> 24) & 0xff; /* fsize */
-      wansw[10] = htole16(dirss); /* dir id */
-      wansw[11] = htole16(fpos);  /* file position in dir */
-      reslen = 24;
-    }
-    
-  } else if ((query == AL_MKDIR) || (query == AL_RMDIR)) { /* MKDIR or RMDIR */
-    char directory[DIR_MAX];
-    char host_directory[DIR_MAX];
-    int offset;
-    offset = sprintf(directory, "%s/", root);
-    /* explode the full "\DIR\FILE????.???" search path into directory and mask */
-    memcpy(directory + offset, (char *)reqbuff, reqbufflen);
-    directory[offset + reqbufflen] = 0;
-    lostring(directory + offset, -1);
-    charreplace(directory, '\\', '/');
-
-    if (shorttolong(host_directory, directory, root) == 0) {
-      DBG("MKDIR/RMDIR Match fail: %s\n", directory);
-    }
+  /* unknown queries, or malformed ones, are ignored */
+  if ((op == NULL) || (r.reqlen < op->minlen) || (r.reqlen > op->maxlen)) return(-1);
 
-    if (query == AL_MKDIR) {
-      DBG("MKDIR '%s'\n", host_directory);
-      if (makedir(host_directory) != 0) {
-        *ax = 29;
-        DBG("MKDIR Error: %s\n", strerror(errno));
-      }
-    } else {
-      DBG("RMDIR '%s'\n", host_directory);
-      if (remdir(host_directory) != 0) {
-        *ax = 29;
-        DBG("RMDIR Error: %s\n", strerror(errno));
-      }
-    }
-    
-  } else if (query == AL_CHDIR) { 
-    char directory[DIR_MAX];
-    char host_directory[DIR_MAX];
-    int offset;
-    offset = sprintf(directory, "%s/", root);
-    memcpy(directory + offset, (char *)reqbuff, reqbufflen);
-    directory[offset + reqbufflen] = 0;
-    lostring(directory + offset, -1);
-    charreplace(directory, '\\', '/');
-    DBG("CHDIR '%s'\n", directory);
-
-    /* try to get the host name for this string */
-    if (shorttolong(host_directory, directory, root) != 0) {
-      DBG("CHDIR Error (%s): Cannot obtain host path.\n", directory);
-      *ax = 3;
-    } else if (changedir(host_directory) != 0) {
-      DBG("CHDIR Error (%s): %s\n", host_directory, strerror(errno));
-      *ax = 3;
+  if (op->pathoff >= 0) {
+    r.dirlen = dospath(r.path, sizeof(r.path), r.name, r.root, r.req + op->pathoff, r.reqlen - op->pathoff);
+    if (r.dirlen < 0) {
+      DBG("path too long\n");
+      *(r.ax) = 3; /* "path not found" */
+      return(60);
     }
-    
-  } else if (query == AL_CLSFIL) { /* AL_CLSFIL (0x06) */
-    DBG("CLOSE FILE\n");
-    *ax = 0;
-    
-  } else if ((query == AL_SETATTR) && (reqbufflen > 1)) { /* AL_SETATTR (0x0E) */
-    char fullpathname[DIR_MAX];
-    char host_fullpathname[DIR_MAX];
-    int offset;
-    unsigned char fattr;
-    fattr = reqbuff[0];
-    /* get full file path */
-    offset = sprintf(fullpathname, "%s/", root);
-    memcpy(fullpathname + offset, (char *)reqbuff + 1, reqbufflen - 1);
-    fullpathname[offset + reqbufflen - 1] = 0;
-    lostring(fullpathname + offset, -1);
-    charreplace(fullpathname, '\\', '/');
-
-    DBG("SETATTR [file: '%s', attr: 0x%02X]\n", fullpathname, fattr);
-
-    if (shorttolong(host_fullpathname, fullpathname, root) != 0) {
-      DBG("SETATTR Error (%s)\n", fullpathname);
-      *ax = 2;
-    } else if (drivesfat[reqdrv] != 0) {
-      if (setitemattr(host_fullpathname, fattr) != 0) *ax = 2;
-    }
-    
-  } else if ((query == AL_GETATTR) && (reqbufflen > 0)) { /* AL_GETATTR (0x0F) */
-    char fullpathname[DIR_MAX];
-    char host_fullpathname[DIR_MAX];
-    int offset;
-    struct fileprops fprops;
-    /* get full file path */
-    offset = sprintf(fullpathname, "%s/", root);
-    memcpy(fullpathname + offset, (char *)reqbuff, reqbufflen);
-    fullpathname[offset + reqbufflen] = 0;
-    lostring(fullpathname + offset, -1);
-    charreplace(fullpathname, '\\', '/');
-
-    DBG("GETATTR on file: '%s' (fatflag=%d)\n", fullpathname, drivesfat[reqdrv]);
-
-    if (shorttolong(host_fullpathname, fullpathname, root) != 0) {
-      DBG("GETATTR Error (%s)\n", fullpathname);
-      *ax = 2;
-    } else if (getitemattr(host_fullpathname, &fprops, drivesfat[reqdrv]) == 0xFF) {
-      DBG("no file found\n");
-      *ax = 2;
-    } else {
-      DBG("found it (%lu bytes, attr 0x%02X)\n", fprops.fsize, fprops.fattr);
-      answ[reslen++] = fprops.ftime & 0xff;
-      answ[reslen++] = (fprops.ftime >> 8) & 0xff;
-      answ[reslen++] = (fprops.ftime >> 16) & 0xff;
-      answ[reslen++] = (fprops.ftime >> 24) & 0xff;
-      answ[reslen++] = fprops.fsize & 0xff;
-      answ[reslen++] = (fprops.fsize >> 8) & 0xff;
-      answ[reslen++] = (fprops.fsize >> 16) & 0xff;
-      answ[reslen++] = (fprops.fsize >> 24) & 0xff;
-      answ[reslen++] = fprops.fattr;
-    }
-    
-  } else if ((query == AL_RENAME) && (reqbufflen > 2)) { /* AL_RENAME (0x11) */
-    char fn1[1024], fn2[1024];
-    char host_fn1[1024];
-    int fn1len, fn2len, offset;
-    offset = sprintf(fn1, "%s/", root);
-    sprintf(fn2, "%s/", root);
-    fn1len = reqbuff[0];
-    fn2len = reqbufflen - (1 + fn1len);
-    if (reqbufflen > fn1len) {
-      memcpy(fn1 + offset, reqbuff + 1, fn1len);
-      fn1[fn1len + offset] = 0;
-      lostring(fn1 + offset, -1);
-      charreplace(fn1, '\\', '/');
-      memcpy(fn2 + offset, reqbuff + 1 + fn1len, fn2len);
-      fn2[fn2len + offset] = 0;
-      lostring(fn2 + offset, -1);
-      charreplace(fn2, '\\', '/');
-
-      DBG("RENAME src='%s' dst='%s'\n", fn1, fn2);
-
-      if (shorttolong(host_fn1, fn1, root) != 0) {
-        DBG("RENAME Error (%s): Cannot obtain host path.\n", fn1);
-      } else {
-        if (getitemattr(fn2, NULL, 0) != 0xff) {
-            DBG("ERROR: '%s' exists already\n", fn2);
-            *ax = 5;
-          } else {
-            DBG("'%s' doesn't exist -> proceed with renaming\n", fn2);
-            if (renfile(host_fn1, fn2) != 0) *ax = 5;
-          }
-      }
-    } else {
-      *ax = 2;
-    }
-    
-  } else if (query == AL_DELETE) {
-    char fullpathname[DIR_MAX];
-    char host_fullpathname[DIR_MAX];
-    int offset;
-    offset = sprintf(fullpathname, "%s/", root);
-    memcpy(fullpathname + offset, reqbuff, reqbufflen);
-    fullpathname[reqbufflen + offset] = 0;
-    lostring(fullpathname + offset, -1);
-    charreplace(fullpathname, '\\', '/');
-    DBG("DELETE '%s'\n", fullpathname);
-
-    if (shorttolong(host_fullpathname, fullpathname, root) != 0) {
-      DBG("DELETE Error (%s)\n", fullpathname);
-      *ax = 2;
-    } else if (getitemattr(host_fullpathname, NULL, drivesfat[reqdrv]) & 1) { /* is it read-only? */
-      *ax = 5; /* "access denied" */
-    } else if (delfiles(host_fullpathname) < 0) {
-      *ax = 2;
-    }
-    
-  } else if ((query == AL_OPEN) || (query == AL_CREATE) || (query == AL_SPOPNFIL)) { 
-    /* Combined OPEN/CREATE/SPOPNFIL handler */
-    struct fileprops fprops;
-    char directory[DIR_MAX];
-    char host_directory[DIR_MAX];
-    char fname[DIR_MAX];
-    char fnamefcb[12];
-    char fullpathname[DIR_MAX];
-    char host_fullpathname[DIR_MAX*2+1];
-    int offset;
-    int fileres;
-    unsigned short stackattr, actioncode, spopen_openmode, spopres = 0;
-    unsigned char resopenmode;
-    
-    stackattr = le16toh(wreqbuff[0]);
-    actioncode = le16toh(wreqbuff[1]);
-    spopen_openmode = le16toh(wreqbuff[2]);
-    
-    offset = sprintf(fullpathname, "%s/", root);
-    memcpy(fullpathname + offset, reqbuff + 6, reqbufflen - 6);
-    fullpathname[reqbufflen + offset - 6] = 0;
-    lostring(fullpathname + offset, -1);
-    charreplace(fullpathname, '\\', '/');
-    
-    offset = sprintf(directory, "%s/", root);
-    explodepath(directory + offset, fname, (char *)reqbuff+6, reqbufflen-6);
+  }
 
-    lostring(directory + offset, -1);
-    charreplace(directory, '\\', '/');
+  t = tracebegin();
+  res = op->handler(&r);
+  traceend(TRACE_HANDLER, t, reqbuff);
+  if (op->changes != 0) drivegen[r.drv]++; /* cached GETATTR and DISKSPACE answers are stale */
+  if (res < 0) return(res);
+  return(res + 60);
+}
 
-    /* Check directory existence */
-    if ((shorttolong(host_directory, directory, root) != 0) || (changedir(host_directory) != 0)) {
-      DBG("open/create/spop failed because directory does not exist\n");
-      *ax = 3; /* "path not found" */
-    } else {
-      /* Directory exists, attempt to get host version of the full path name */
-      if (shorttolong(host_fullpathname, fullpathname, root) == 0) {
-        DBG("Exists, pre:  fname '%s' host_fullpathname '%s'\n", fname, host_fullpathname);
-        copy_after_last_slash(fname, host_fullpathname);
-        DBG("Exists, post: fname '%s' host_fullpathname '%s'\n", fname, host_fullpathname);
-      } else {
-        sprintf(host_fullpathname, "%s/%s", host_directory, fname);
-      }
 
-      filename2fcb(fnamefcb, fname);
-      
-      DBG("looking for file '%s' (FCB '%s') in '%s'\n", fname, pfcb(fnamefcb), directory);
-      
-      if (query == AL_CREATE) {
-        DBG("CREATEFIL / stackattr (attribs)=%04Xh / fn='%s'\n", stackattr, fullpathname);
-        fileres = createfile(&fprops, host_directory, fname, stackattr & 0xff, drivesfat[reqdrv]);
-        resopenmode = 2; /* read/write */
-      } else if (query == AL_SPOPNFIL) {
-        int attr;
-        DBG("SPOPNFIL / action=%04Xh / fn='%s'\n", actioncode, fullpathname);
-        attr = getitemattr(host_fullpathname, &fprops, drivesfat[reqdrv]);
-        resopenmode = spopen_openmode & 0x7f; 
-        if (attr == 0xff) { /* file not found */
-          if ((actioncode & 0xf0) == 16) { /* create */
-            fileres = createfile(&fprops, host_directory, fname, stackattr & 0xff, drivesfat[reqdrv]);
-            if (fileres == 0) spopres = 2; /* created */
-          } else { 
-            fileres = 1; /* fail */
-          }
-        } else if ((attr & (FAT_VOL | FAT_DIR)) != 0) {
-          fileres = 1; /* fail (is dir/vol) */
-        } else { /* file found */
-          if ((actioncode & 0x0f) == 1) { /* open */
-            fileres = 0;
-            spopres = 1; /* opened */
-          } else if ((actioncode & 0x0f) == 2) { /* truncate */
-            fileres = createfile(&fprops, host_directory, fname, stackattr & 0xff, drivesfat[reqdrv]);
-            if (fileres == 0) spopres = 3; /* truncated */
-          } else { 
-            fileres = 1; /* fail */
-          }
-        }
-      } else { /* simple 'OPEN' */
-        int attr;
-        DBG("OPENFIL / fn='%s'\n", fullpathname);
-        resopenmode = stackattr & 0xff;
-        attr = getitemattr(host_fullpathname, &fprops, drivesfat[reqdrv]);
-        if ((attr != 0xff) && ((attr & (FAT_VOL | FAT_DIR)) == 0)) {
-          fileres = 0;
-        } else {
-          fileres = 1;
-        }
-      }
-      
-      if (fileres != 0) {
-        DBG("open/create/spop failed with fileres = %d\n", fileres);
-        *ax = 2;
-      } else { /* success */
-        unsigned short fileid;
-        fileid = getitemss(host_fullpathname);
-        
-        if (fileid == 0xffffu) {
-          DBG("ERROR: failed to get a proper fileid!\n");
-          return(-1);
-        }
-        answ[reslen++] = fprops.fattr;
-        memcpy(answ + reslen, fprops.fcbname, 11);
-        reslen += 11;
-        answ[reslen++] = fprops.ftime & 0xff; 
-        answ[reslen++] = (fprops.ftime >> 8) & 0xff;
-        answ[reslen++] = (fprops.ftime >> 16) & 0xff;
-        answ[reslen++] = (fprops.ftime >> 24) & 0xff;
-        answ[reslen++] = fprops.fsize & 0xff;
-        answ[reslen++] = (fprops.fsize >> 8) & 0xff;
-        answ[reslen++] = (fprops.fsize >> 16) & 0xff;
-        answ[reslen++] = (fprops.fsize >> 24) & 0xff;
-        answ[reslen++] = fileid & 0xff;
-        answ[reslen++] = fileid >> 8;
-        /* CX result */
-        answ[reslen++] = spopres & 0xff;
-        answ[reslen++] = spopres >> 8;
-        answ[reslen++] = resopenmode;
-      }
-    }
-    
-  } else if ((query == AL_SKFMEND) && (reqbufflen == 6)) { /* SKFMEND (0x21) */
-    int32_t offs = le32toh(((uint32_t *)reqbuff)[0]);
-    long fsize;
-    unsigned short fss = le16toh(((unsigned short *)reqbuff)[2]);
-    DBG("SKFMEND on file #%u at offset %d\n", fss, offs);
-    if (offs > 0) offs = 0;
-    
-    fsize = getfopsize(fss);
-    if (fsize < 0) {
-      *ax = 2;
-    } else { 
-      offs += fsize;
-      if (offs < 0) offs = 0;
-      ((uint32_t *)answ)[0] = htole32(offs);
-      reslen = 4;
-    }
-    
-  } else { /* unknown query - ignore */
-    return(-1);
-  }
-  return(reslen + 60);
+/* attaches a BPF program to sock so the kernel only passes on EtherDFS
+ * frames of the protocol version I speak, sent to mac or to broadcast.
+ * returns 0 on success */
+static int attachfilter(int sock, const unsigned char *mac) {
+  struct sock_filter code[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_LEN, 0),
+    BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 60, 0, 13),            /* too short */
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_DFS, 0, 11), /* ethertype */
+    BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 56),
+    BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 127),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PROTOVER, 0, 8),       /* version */
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 2),              /* my mac? */
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 3, 4),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0xffffffffu, 0, 3),    /* broadcast? */
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0xffff, 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, 0xffff),                         /* accept */
+    BPF_STMT(BPF_RET | BPF_K, 0)                               /* drop */
+  };
+  struct sock_fprog prog;
+  /* BPF loads are big endian */
+  code[8].k = ((uint32_t)mac[0] << 24) | ((uint32_t)mac[1] << 16) | ((uint32_t)mac[2] << 8) | mac[3];
+  code[10].k = ((uint32_t)mac[4] << 8) | mac[5];
+  prog.len = sizeof(code) / sizeof(code[0]);
+  prog.filter = code;
+  return(setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)));
 }
 
-
-static int raw_sock(const char *const interface, void *const hwaddr) {
+/* opens a raw socket on interface for EtherDFS frames and fills hwaddr with
+ * the interface's MAC. the interface is put in promiscuous mode if promisc is
+ * non-zero. returns the socket, or -1 on error */
+static int raw_sock(const char *const interface, void *const hwaddr, int promisc) {
   struct ifreq iface;
   int socketfd, fl;
   struct sockaddr_ll addr;
@@ -753,14 +1222,17 @@ static int raw_sock(const char *const interface, void *const hwaddr) {
     if (result == -1) break;
     ifindex = iface.ifr_ifindex;
 
-    /* Set Promiscuous Mode (Optional, but often needed) */
-    memset(&iface, 0, sizeof(iface));
-    strncpy(iface.ifr_name, interface, sizeof iface.ifr_name - 1);
-    result = ioctl(socketfd, SIOCGIFFLAGS, &iface);
-    if (result == -1) break;
-    iface.ifr_flags |= IFF_PROMISC;
-    result = ioctl(socketfd, SIOCSIFFLAGS, &iface);
-    if (result == -1) break;
+    /* Set Promiscuous Mode, if asked for (only needed when queries may be
+     * addressed to a MAC that is not the interface's own) */
+    if (promisc != 0) {
+      memset(&iface, 0, sizeof(iface));
+      strncpy(iface.ifr_name, interface, sizeof iface.ifr_name - 1);
+      result = ioctl(socketfd, SIOCGIFFLAGS, &iface);
+      if (result == -1) break;
+      iface.ifr_flags |= IFF_PROMISC;
+      result = ioctl(socketfd, SIOCSIFFLAGS, &iface);
+      if (result == -1) break;
+    }
 
     /* Get Hardware Address */
     memset(&iface, 0, sizeof iface);
@@ -779,6 +1251,12 @@ static int raw_sock(const char *const interface, void *const hwaddr) {
     memcpy(&addr.sll_addr, &iface.ifr_hwaddr.sa_data, addr.sll_halen);
     if (hwaddr != NULL) memcpy(hwaddr, &iface.ifr_hwaddr.sa_data, ETH_ALEN);
 
+    /* let the kernel drop frames that are not for me, before they wake me up.
+     * frames are still checked in checkframe(), should this fail */
+    if (attachfilter(socketfd, (unsigned char *)iface.ifr_hwaddr.sa_data) != 0) {
+      fprintf(stderr, "WARNING: failed to attach socket filter (%s)\n", strerror(errno));
+    }
+
     if (bind(socketfd, (struct sockaddr *)&addr, sizeof addr)) break;
 
     errno = 0;
@@ -854,27 +1332,35 @@ static int cmpdata(unsigned char *d1, unsigned char *d2, int len) {
   return(0);
 }
 
-/* compute the BSD checksum of l bytes starting at ptr */
-static unsigned short bsdsum(unsigned char *ptr, unsigned short l) {
-  unsigned short res = 0;
-  for (; l > 0; l--) {
-    res = (res << 15) | (res >> 1);
-    res += *ptr;
-    ptr++;
-  }
-  return(res);
-}
-
 static void help(void) {
   printf("EtherDFS Server (ethersrv) version " PVER "\n"
          "(C) 2017-2018 M. Viste, 2020 M. Ortmann, 2023-2025 E. Voirin (oerg866), 2026 D. Flissinger (megapearl)\n"
          "http://etherdfs.sourceforge.net\n"
          "\n"
-         "usage: ethersrv [options] interface rootpath1 [rootpath2] ... [rootpathN]\n"
-         "\n"
-         "Options:\n"
+         "usage: ethersrv [options] interface[,interface2...] rootpath1 [rootpath2] ... [rootpathN]\n"
+         "\n");
+  printf("Options:\n"
          "  -f        Keep in foreground (do not daemonize)\n"
          "  -v        Verbose / Debug mode (logs to stderr)\n"
+         "  -p        Put the interface in promiscuous mode\n"
+         "  -t n      Process frames with n worker threads (default: none)\n"
+#if defined(__linux__)
+         "  -m        Exchange frames through PACKET_MMAP rings\n"
+         "  -q n      Spread each interface over n sockets, with a thread each\n"
+#endif
+  );
+  printf("  -a        Read files asynchronously (io_uring), unless -t or -q is used\n"
+         "  -c MiB    Keep up to MiB of hot files in memory (default: 0, disabled)\n"
+         "  -R drives Serve these drives read-only, their files never change (-R DE)\n"
+         "  -P d[:MiB] List subdirectories d levels ahead of clients (budget: 32 MiB)\n"
+         "  -S file   Keep known files and listings in file across restarts\n"
+         "  -d ms     Pace answers to clients that lose frames, up to ms apart\n"
+  );
+  printf("  -M file   Write metrics to file (Prometheus text format) every few seconds\n"
+         "  -T file   Trace queries, SIGUSR1 and exit dump the last ones to file\n"
+         "  -A ms[:ms] Reuse GETATTR answers for ms, DISKSPACE ones for the 2nd ms (or 1st)\n"
+         "  -b spec   Run a benchmark instead of serving (no interface is given):\n"
+         "            synth, cksum or a file of frames dumped by -v to replay\n"
          "  -h        Display this information\n"
   );
 }
@@ -901,35 +1387,977 @@ static char *printmac(unsigned char *b) {
 }
 
 
-int main(int argc, char **argv) {
-  int sock, len, i;
-  unsigned char *buff; /* pointer to global buffer */
-  unsigned char cksumflag;
+/* checks that a received frame is an EtherDFS query meant for me. returns
+ * its length (as announced by the frame itself, if it does) or -1 if the
+ * frame must be ignored */
+static int checkframe(unsigned char *buff, int len, unsigned char *mymac) {
   unsigned short edf5framelen;
-  unsigned char mymac[6];
-  char *intname, *root[26];
+
+  if (len < 60) return(-1); /* ignore too small or error */
+  
+  /* validate this is for me (or broadcast) */
+  if ((cmpdata(mymac, buff, 6) != 0) && (cmpdata((unsigned char *)"\xff\xff\xff\xff\xff\xff", buff, 6) != 0)) return(-1);
+  
+  /* is this ETHERTYPE_DFS? */
+  if (((unsigned short *)buff)[6] != htons(ETHERTYPE_DFS)) return(-1);
+  
+  /* validate protocol version matches what I expect */
+  if ((buff[56] & 127) != PROTOVER) {
+    METRICADD(MET_DROPPED, 1);
+    return(-1);
+  }
+  
+  edf5framelen = le16toh(((unsigned short *)buff)[26]);
+  
+  if (edf5framelen > 0) {
+      if (edf5framelen > len || edf5framelen < 60) { /* Malformed */
+        METRICADD(MET_DROPPED, 1);
+        return(-1);
+      }
+      len = edf5framelen;
+  }
+  METRICADD(MET_FRAMESIN, 1);
+  METRICADD(MET_BYTESIN, len);
+  
+  /* DUMP RECEIVED FRAME IF DEBUG IS ON */
+  if (debug_enabled) {
+      DBG("Received frame of %d bytes (cksum = %s)\n", len, (buff[56] & 128)?"ENABLED":"DISABLED");
+      dumpframe(buff, len);
+  }
+  return(len);
+}
+
+/* updates the flow statistics of client c with a new query, or with a
+ * retransmitted one if retrans is non-zero, and returns the time the
+ * answer is due at (0 for right away). a retransmission means the client
+ * missed an answer: slow (ISA) NICs drop frames that come too soon after
+ * the ones they just sent or got. must be called under fslock() */
+static unsigned long long pace(struct sclient *c, int retrans) {
+  unsigned long long now = metricsclock(), due;
+  if (retrans != 0) {
+    /* the answer is still held back, the client is only impatient */
+    if (c->lastdue > now) return(c->lastdue);
+    c->retrans++;
+    if (pacemax > 0) {
+      c->delay = c->delay * 2 + PACE_STEP;
+      if (c->delay > pacemax) c->delay = pacemax;
+      DBG("client %s: %lu of %lu queries retransmitted, %llu us apart, answers delayed by %llu us\n", printmac(c->mac), c->retrans, c->queries, c->gap / 1000, c->delay / 1000);
+    }
+  } else {
+    if (c->lastquery != 0) c->gap = c->gap - c->gap / 8 + (now - c->lastquery) / 8;
+    c->lastquery = now;
+    c->queries++;
+    c->delay -= (c->delay + 15) / 16;
+  }
+  if (c->delay == 0) return(0);
+  /* answers are also spaced by the delay */
+  due = now + c->delay;
+  if (due < c->lastdue + c->delay) due = c->lastdue + c->delay;
+  c->lastdue = due;
+  return(due);
+}
+
+/* completes answer cacheptr of len bytes (or none if len <= 0) with its
+ * length and checksum. returns it, or NULL if there is nothing to send */
+static struct struct_answcache *finishanswer(struct struct_answcache *cacheptr, int len, unsigned char cksumflag) {
+  /* update cache entry */
+  if (len >= 0) {
+    cacheptr->len = len;
+    cacheptr->timestamp = time(NULL);
+  } else {
+    cacheptr->len = 0;
+  }
+
+  if (len > 0) {
+    /* Prepare outgoing frame */
+    cacheptr->frame[52] = len & 0xff;
+    cacheptr->frame[53] = (len >> 8) & 0xff;
+    
+    /* checksum */
+    if (cksumflag != 0) {
+      unsigned short newcksum;
+      if (cacheptr->payload != NULL) {
+        newcksum = bsdsumcont(bsdsum(cacheptr->frame + 56, 4), cacheptr->payload, len - 60);
+      } else {
+        newcksum = bsdsum(cacheptr->frame + 56, len - 56);
+      }
+      cacheptr->frame[54] = newcksum & 0xff;
+      cacheptr->frame[55] = (newcksum >> 8) & 0xff;
+      cacheptr->frame[56] |= 128; 
+    } else {
+      cacheptr->frame[54] = 0;
+      cacheptr->frame[55] = 0;
+      cacheptr->frame[56] &= 127;
+    }
+
+    /* DUMP SENT FRAME IF DEBUG IS ON */
+    if (debug_enabled) {
+        DBG("Sending back an answer of %d bytes\n", len);
+        dumpframe(cacheptr->frame, (cacheptr->payload != NULL) ? 60 : len);
+    }
+
+    return(cacheptr);
+  }
+  DBG("Query ignored (result: %d)\n", len);
+  METRICADD(MET_IGNORED, 1);
+  return(NULL);
+}
+
+/* validates a received frame's checksum and processes it. t is the client
+ * table of the thread handling the client. returns the cache entry holding
+ * the answer to send back (len bytes of frame), or NULL if there is nothing
+ * to send */
+static struct struct_answcache *answerquery(unsigned char *buff, int len, struct sclients *t, unsigned char *mymac, char **root) {
+  struct struct_answcache *cacheptr;
+  struct sclient *client;
+  unsigned char cksumflag = buff[56] >> 7;
+
+  /* validate the CKSUM, if any */
+  if (cksumflag != 0) {
+    unsigned short cksum_remote, cksum_mine;
+    cksum_mine = bsdsum(buff + 56, len - 56);
+    cksum_remote = le16toh(((unsigned short *)buff)[27]);
+    if (cksum_mine != cksum_remote) {
+        DBG("CHECKSUM MISMATCH! Computed: 0x%02Xh Received: 0x%02Xh\n", cksum_mine, cksum_remote);
+        METRICADD(MET_CKSUMERR, 1);
+        return(NULL);
+    }
+  }
+  
+  fslock();
+  client = findclient(t, buff + 6);
+  if (client == NULL) {
+    fsunlock();
+    fprintf(stderr, "ERROR: out of memory\n");
+    return(NULL);
+  }
+  
+  /* a query I answered already: the client did not get my answer */
+  cacheptr = findanswer(client, buff[57]);
+  if (cacheptr != NULL) {
+    METRICADD(MET_ANSWHITS, 1);
+    /* its answer is still on the way */
+    if (cacheptr->pending != NULL) {
+      fsunlock();
+      return(NULL);
+    }
+    cacheptr->due = pace(client, 1);
+  #if SIMLOSS > 0
+    fprintf(stderr, "Cache HIT (seq %u)\n", buff[57]);
+  #endif
+    fsunlock();
+    /* the answer is ready to go, unless checksums got toggled meanwhile */
+    if ((cacheptr->frame[56] >> 7) == cksumflag) {
+      cacheptr->timestamp = time(NULL);
+      return(cacheptr);
+    }
+    len = cacheptr->len;
+  } else {
+    /* process frame */
+    METRICADD(MET_ANSWMISSES, 1);
+    cacheptr = &(client->answers[client->nextansw]);
+    client->nextansw = (client->nextansw + 1) % CLIENTANSWERS;
+    unpend(cacheptr);
+    readfileunref(cacheptr->payloadref);
+    cacheptr->payloadref = NULL;
+    cacheptr->payload = NULL;
+    cacheptr->due = pace(client, 0);
+    len = process(cacheptr, buff, len, mymac, root);
+    if (len == ANSW_PENDING) {
+      cacheptr->len = 0;
+      cacheptr->timestamp = time(NULL);
+      fsunlock();
+      return(NULL);
+    }
+    fsunlock();
+  }
+  return(finishanswer(cacheptr, len, cksumflag));
+}
+
+/* answerquery() along with the accounting of metrics */
+static struct struct_answcache *answerframe(unsigned char *buff, int len, struct sclients *t, unsigned char *mymac, char **root) {
+  struct struct_answcache *cacheptr;
+  unsigned long long t0 = 0, span = tracebegin();
+  if (metricson != 0) t0 = metricsclock();
+  cacheptr = answerquery(buff, len, t, mymac, root);
+  if (metricson != 0) metricsquery(buff[59], (unsigned long)(metricsclock() - t0));
+  traceend(TRACE_QUERY, span, buff);
+  if (cacheptr != NULL) {
+    METRICADD(MET_FRAMESOUT, 1);
+    METRICADD(MET_BYTESOUT, cacheptr->len);
+  }
+  return(cacheptr);
+}
+
+/* describes answer a in iov (1 or 2 entries), returns the amount of entries */
+static int answeriov(struct struct_answcache *a, struct iovec *iov) {
+  iov[0].iov_base = a->frame;
+  if (a->payload == NULL) {
+    iov[0].iov_len = a->len;
+    return(1);
+  }
+  iov[0].iov_len = 60;
+  iov[1].iov_base = (void *)a->payload;
+  iov[1].iov_len = a->len - 60;
+  return(2);
+}
+
+#if defined(__linux__)
+static int ringqueue(struct sport *p, struct struct_answcache *a);
+
+/* has the kernel transmit the answers queued in the TX ring of p */
+static void ringkick(struct sport *p) {
+  unsigned long long t = tracebegin();
+  send(p->sock, NULL, 0, 0);
+  traceend(TRACE_SEND, t, NULL);
+}
+#endif
+
+/* sends answer a on p right away */
+static void sendanswer(struct sport *p, struct struct_answcache *a) {
+  struct iovec iov[2];
+  struct msghdr msg;
+  unsigned long long t = tracebegin();
+#if defined(__linux__)
+  if (p->ring.txframes > 0) {
+    if (ringqueue(p, a) == 0) {
+      send(p->sock, NULL, 0, 0);
+    } else {
+      DBG("TX ring full, answer dropped\n");
+    }
+    traceend(TRACE_SEND, t, NULL);
+    return;
+  }
+#endif
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = answeriov(a, iov);
+  sendmsg(p->sock, &msg, 0);
+  traceend(TRACE_SEND, t, NULL);
+}
+
+/* holds answer a (to be sent on p) back in pc if it is not due yet. an
+ * answer to a query whose answer is held back already is dropped, sending
+ * both would make the burst pacing is meant to avoid. returns non-zero if
+ * the answer is taken care of, 0 if it is to be sent right away */
+static int paced(struct spacer *pc, struct sport *p, struct struct_answcache *a) {
+  struct spaced *e;
+  struct iovec iov[2];
+  unsigned char *dst;
+  int i, n;
+  if ((a->due == 0) || (a->due <= metricsclock())) return(0);
+  for (i = 0; i < pc->count; i++) {
+    e = &(pc->q[i]);
+    if ((e->port == p) && (memcmp(e->a.frame, a->frame, 6) == 0) && (e->a.frame[57] == a->frame[57])) return(1);
+  }
+  if (pc->count == PACEQ) return(0);
+  e = &(pc->q[pc->count++]);
+  e->port = p;
+  e->a.len = a->len;
+  e->a.due = a->due;
+  e->a.payload = NULL;
+  e->a.payloadref = NULL;
+  e->a.pending = NULL;
+  dst = e->a.frame;
+  n = answeriov(a, iov);
+  for (i = 0; i < n; i++) {
+    memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+    dst += iov[i].iov_len;
+  }
+  METRICADD(MET_PACED, 1);
+  return(1);
+}
+
+/* sends the answers held back in pc that are due. returns the time until
+ * the next one is (ns), or PACE_IDLE if none is left */
+static unsigned long long paceflush(struct spacer *pc) {
+  unsigned long long now, next = PACE_IDLE;
+  int i = 0;
+  if (pc->count == 0) return(PACE_IDLE);
+  now = metricsclock();
+  while (i < pc->count) {
+    if (pc->q[i].a.due > now) {
+      if (pc->q[i].a.due - now < next) next = pc->q[i].a.due - now;
+      i++;
+      continue;
+    }
+    sendanswer(pc->q[i].port, &(pc->q[i].a));
+    pc->count--;
+    if (i < pc->count) pc->q[i] = pc->q[pc->count];
+  }
+  return(next);
+}
+
+/* processes a received frame and sends the answer back on p, if any. pc
+ * holds it back if pacing says so */
+static void handleframe(struct sport *p, unsigned char *buff, int len, struct sclients *t, struct spacer *pc) {
+  struct struct_answcache *cacheptr;
+  cacheptr = answerframe(buff, len, t, p->mac, p->root);
+  if (cacheptr == NULL) return;
+  if (paced(pc, p, cacheptr) != 0) return;
+  sendanswer(p, cacheptr);
+}
+
+
+/* starts a thread running fn(arg). termination signals are for the main
+ * thread only, the new thread gets them blocked. returns 0 on success */
+static int spawn(pthread_t *thread, void *(*fn)(void *), void *arg) {
+  sigset_t sigs, oldsigs;
+  int res;
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGTERM);
+  sigaddset(&sigs, SIGQUIT);
+  sigaddset(&sigs, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+  res = pthread_create(thread, NULL, fn, arg);
+  pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+  return(res);
+}
+
+/* main function of worker threads: processes queued frames until told to stop */
+static void *workerloop(void *arg) {
+  struct sworker *w = arg;
+  unsigned long long next;
+  struct timespec ts;
+  int stop;
+  for (;;) {
+    next = paceflush(&(w->pacer));
+    pthread_mutex_lock(&(w->mutex));
+    /* answers held back wake the worker up when they are due */
+    if ((w->count == 0) && (w->stop == 0)) {
+      if (next == PACE_IDLE) {
+        pthread_cond_wait(&(w->cond), &(w->mutex));
+      } else {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += (time_t)(next / 1000000000ull);
+        ts.tv_nsec += (long)(next % 1000000000ull);
+        if (ts.tv_nsec >= 1000000000l) {
+          ts.tv_sec++;
+          ts.tv_nsec -= 1000000000l;
+        }
+        pthread_cond_timedwait(&(w->cond), &(w->mutex), &ts);
+      }
+    }
+    if (w->count == 0) {
+      stop = w->stop;
+      pthread_mutex_unlock(&(w->mutex));
+      if (stop != 0) break;
+      continue;
+    }
+    pthread_mutex_unlock(&(w->mutex));
+    /* the receiving thread never touches the head entry, no need to lock */
+    handleframe(w->queue[w->head].port, w->queue[w->head].frame, w->queue[w->head].len, &(w->clients), &(w->pacer));
+    pthread_mutex_lock(&(w->mutex));
+    w->head = (w->head + 1) % WORKQLEN;
+    w->count--;
+    pthread_mutex_unlock(&(w->mutex));
+  }
+  return(NULL);
+}
+
+/* queues a frame received on p for the worker in charge of its sender.
+ * frames are dropped if the worker is too far behind, the client will retry */
+static void dispatch(struct sport *p, unsigned char *buff, int len) {
+  struct sworker *w;
+  unsigned int h;
+  /* the last bytes of the MAC vary the most between clients */
+  h = ((unsigned int)buff[9] << 16) | ((unsigned int)buff[10] << 8) | buff[11];
+  h ^= h >> 7;
+  w = &(workers[h % workerscount]);
+  pthread_mutex_lock(&(w->mutex));
+  if (w->count < WORKQLEN) {
+    unsigned int tail = (w->head + w->count) % WORKQLEN;
+    memcpy(w->queue[tail].frame, buff, len);
+    w->queue[tail].len = len;
+    w->queue[tail].port = p;
+    w->count++;
+    pthread_cond_signal(&(w->cond));
+  } else {
+    DBG("worker queue full, frame dropped\n");
+  }
+  pthread_mutex_unlock(&(w->mutex));
+}
+
+/* starts count worker threads. returns 0 on success */
+static int startworkers(int count) {
+  int i;
+  workers = calloc(count, sizeof(struct sworker));
+  if (workers == NULL) return(-1);
+  for (i = 0; i < count; i++) {
+    pthread_mutex_init(&(workers[i].mutex), NULL);
+    pthread_cond_init(&(workers[i].cond), NULL);
+    if (spawn(&(workers[i].thread), workerloop, &(workers[i])) != 0) break;
+  }
+  workerscount = i;
+  if (i < count) return(-1);
+  fsthreaded(1);
+  return(0);
+}
+
+/* lets workers finish their queued frames and waits for them to quit */
+static void stopworkers(void) {
+  int i;
+  for (i = 0; i < workerscount; i++) {
+    pthread_mutex_lock(&(workers[i].mutex));
+    workers[i].stop = 1;
+    pthread_cond_signal(&(workers[i].cond));
+    pthread_mutex_unlock(&(workers[i].mutex));
+  }
+  for (i = 0; i < workerscount; i++) pthread_join(workers[i].thread, NULL);
+  workerscount = 0;
+  fsthreaded(0);
+}
+
+
+#if defined(__linux__)
+/* sends count frames described by msgs, with as few syscalls as possible */
+static void sendbatch(int sock, struct mmsghdr *msgs, int count) {
+  int done = 0, res;
+  unsigned long long t = tracebegin();
+  while (done < count) {
+    res = sendmmsg(sock, msgs + done, count - done, 0);
+    if (res <= 0) {
+      if ((res < 0) && (errno == EINTR)) continue;
+      DBG("ERROR: sendmmsg(): %s\n", strerror(errno));
+      break;
+    }
+    done += res;
+  }
+  traceend(TRACE_SEND, t, NULL);
+}
+
+/* sets up a PACKET_MMAP receive ring on the socket of p, and a transmit ring
+ * too if withtx is non-zero. returns 0 on success */
+static int setupring(struct sport *p, int withtx) {
+  struct tpacket_req req;
+  int ver = TPACKET_V2;
+  size_t rxsz, txsz = 0;
+
+  if (setsockopt(p->sock, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver)) != 0) return(-1);
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = RINGBLOCKSZ;
+  req.tp_frame_size = RINGFRAMESZ;
+  req.tp_block_nr = RXRINGBLOCKS;
+  req.tp_frame_nr = RXRINGBLOCKS * (RINGBLOCKSZ / RINGFRAMESZ);
+  if (setsockopt(p->sock, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0) return(-1);
+  p->ring.rxframes = req.tp_frame_nr;
+  rxsz = (size_t)RXRINGBLOCKS * RINGBLOCKSZ;
+  if (withtx != 0) {
+    req.tp_block_nr = TXRINGBLOCKS;
+    req.tp_frame_nr = TXRINGBLOCKS * (RINGBLOCKSZ / RINGFRAMESZ);
+    if (setsockopt(p->sock, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) != 0) return(-1);
+    p->ring.txframes = req.tp_frame_nr;
+    txsz = (size_t)TXRINGBLOCKS * RINGBLOCKSZ;
+  }
+  p->ring.map = mmap(NULL, rxsz + txsz, PROT_READ | PROT_WRITE, MAP_SHARED, p->sock, 0);
+  if (p->ring.map == MAP_FAILED) {
+    p->ring.map = NULL;
+    return(-1);
+  }
+  p->ring.mapsz = rxsz + txsz;
+  return(0);
+}
+
+/* makes sock a member of fanout group id, along with the other sockets of
+ * its interface. frames are spread over them by the sender's MAC, so every
+ * client always ends up on the same socket, where its answer cache is.
+ * returns 0 on success */
+static int joinfanout(int sock, unsigned short id) {
+  struct sock_filter code[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_LL_OFF + 8), /* MAC bytes 2..5 */
+    BPF_STMT(BPF_RET | BPF_A, 0)  /* the kernel takes it modulo the group size */
+  };
+  struct sock_fprog prog;
+  int arg = id | (PACKET_FANOUT_CBPF << 16);
+  if (setsockopt(sock, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) != 0) return(-1);
+  prog.len = sizeof(code) / sizeof(code[0]);
+  prog.filter = code;
+  return(setsockopt(sock, SOL_PACKET, PACKET_FANOUT_DATA, &prog, sizeof(prog)));
+}
+
+/* returns the n-th frame of the RX ring of p, or of its TX ring if tx != 0.
+ * the rings are made of whole blocks so frames are contiguous */
+static struct tpacket2_hdr *ringframe(struct sport *p, unsigned int n, int tx) {
+  unsigned char *base = p->ring.map;
+  if (tx != 0) base += (size_t)p->ring.rxframes * RINGFRAMESZ;
+  return((struct tpacket2_hdr *)(base + (size_t)n * RINGFRAMESZ));
+}
+
+/* copies an answer into the next free TX ring slot of p. returns 0 on
+ * success, or -1 if the ring is full (the client will retransmit) */
+static int ringqueue(struct sport *p, struct struct_answcache *a) {
+  struct tpacket2_hdr *hdr = ringframe(p, p->ring.txhead, 1);
+  struct iovec iov[2];
+  unsigned char *dst = (unsigned char *)hdr + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+  int i, n;
+  /* a frame the kernel refused is left as is, the slot never comes back
+   * by itself: it is counted and reused */
+  if (hdr->tp_status == TP_STATUS_WRONG_FORMAT) {
+    METRICADD(MET_TXREJECTED, 1);
+  } else if (hdr->tp_status != TP_STATUS_AVAILABLE) {
+    return(-1);
+  }
+  n = answeriov(a, iov);
+  for (i = 0; i < n; i++) {
+    memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+    dst += iov[i].iov_len;
+  }
+  hdr->tp_len = a->len;
+  __sync_synchronize();
+  hdr->tp_status = TP_STATUS_SEND_REQUEST;
+  p->ring.txhead = (p->ring.txhead + 1) % p->ring.txframes;
+  return(0);
+}
+
+/* processes frames waiting in the RX ring of p, right where the kernel put
+ * them. answers go to the TX ring if there is one, and are all sent at once.
+ * returns the amount of frames looked at */
+static int handlering(struct sport *p) {
+  struct tpacket2_hdr *hdr;
+  struct struct_answcache *cacheptr;
+  unsigned char *buff;
+  int n, len, tx = 0;
+
+  for (n = 0; n < RXBATCH; n++) {
+    hdr = ringframe(p, p->ring.rxhead, 0);
+    if ((hdr->tp_status & TP_STATUS_USER) == 0) break;
+    __sync_synchronize();
+    buff = (unsigned char *)hdr + hdr->tp_mac;
+    len = checkframe(buff, hdr->tp_snaplen, p->mac);
+    if (len < 0) {
+      /* not for me */
+    } else if (workerscount > 0) {
+      dispatch(p, buff, len);
+    } else {
+      cacheptr = answerframe(buff, len, &(p->clients), p->mac, p->root);
+      if ((cacheptr != NULL) && (paced(&(p->pacer), p, cacheptr) == 0)) {
+        if (p->ring.txframes == 0) {
+          struct iovec iov[2];
+          struct msghdr msg;
+          memset(&msg, 0, sizeof(msg));
+          msg.msg_iov = iov;
+          msg.msg_iovlen = answeriov(cacheptr, iov);
+          sendmsg(p->sock, &msg, 0);
+        } else if (ringqueue(p, cacheptr) == 0) {
+          tx++;
+        } else {
+          DBG("TX ring full, answer dropped\n");
+        }
+      }
+    }
+    /* give the slot back to the kernel */
+    __sync_synchronize();
+    hdr->tp_status = TP_STATUS_KERNEL;
+    p->ring.rxhead = (p->ring.rxhead + 1) % p->ring.rxframes;
+  }
+  if (tx > 0) ringkick(p); /* transmit what was queued in the ring */
+  return(n);
+}
+
+/* receives all pending frames of p and processes them, sending all answers
+ * at once. returns the amount of frames received, or -1 on error */
+static int handlebatch(struct sport *p) {
+  struct mmsghdr rxmsgs[RXBATCH], txmsgs[RXBATCH];
+  struct iovec rxiov[RXBATCH], txiov[RXBATCH][2];
+  struct struct_answcache *cacheptr;
+  int i, j, n, len, tx = 0;
+
+  memset(rxmsgs, 0, sizeof(rxmsgs));
+  memset(txmsgs, 0, sizeof(txmsgs));
+  for (i = 0; i < RXBATCH; i++) {
+    rxiov[i].iov_base = p->rx[i];
+    rxiov[i].iov_len = BUFF_LEN;
+    rxmsgs[i].msg_hdr.msg_iov = &(rxiov[i]);
+    rxmsgs[i].msg_hdr.msg_iovlen = 1;
+    txmsgs[i].msg_hdr.msg_iov = txiov[i];
+  }
+
+  n = recvmmsg(p->sock, rxmsgs, RXBATCH, MSG_DONTWAIT, NULL);
+  if (n < 0) return(((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) ? 0 : -1);
+
+  for (i = 0; i < n; i++) {
+    len = checkframe(p->rx[i], rxmsgs[i].msg_len, p->mac);
+    if (len < 0) continue;
+    if (workerscount > 0) {
+      dispatch(p, p->rx[i], len);
+      continue;
+    }
+    /* answers are sent straight from the clients' answer caches. should
+     * this one overwrite an answer waiting in the batch, send them first */
+    if (tx >= CLIENTANSWERS) {
+      struct sclient *client = getclient(&(p->clients), p->rx[i] + 6);
+      if (client != NULL) {
+        for (j = 0; j < tx; j++) {
+          if (txiov[j][0].iov_base == client->answers[client->nextansw].frame) break;
+        }
+        if (j < tx) {
+          sendbatch(p->sock, txmsgs, tx);
+          tx = 0;
+        }
+      }
+    }
+    cacheptr = answerframe(p->rx[i], len, &(p->clients), p->mac, p->root);
+    if ((cacheptr == NULL) || (paced(&(p->pacer), p, cacheptr) != 0)) continue;
+    txmsgs[tx].msg_hdr.msg_iovlen = answeriov(cacheptr, txiov[tx]);
+    tx++;
+  }
+  if (tx > 0) sendbatch(p->sock, txmsgs, tx);
+  return(n);
+}
+#endif
+
+
+/* receives the frames pending on p and answers them. returns the amount of
+ * frames received, or -1 on error */
+static int handleport(struct sport *p) {
+#if defined(__linux__)
+  if (p->ring.map != NULL) return(handlering(p));
+  return(handlebatch(p));
+#else
+  int len;
+  len = recv(p->sock, p->rx[0], BUFF_LEN, MSG_DONTWAIT);
+  if (len < 0) return(((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) ? 0 : -1);
+  len = checkframe(p->rx[0], len, p->mac);
+  if (len < 0) return(1);
+  if (workerscount > 0) {
+    dispatch(p, p->rx[0], len);
+  } else {
+    handleframe(p, p->rx[0], len, &(p->clients), &(p->pacer));
+  }
+  return(1);
+#endif
+}
+
+/* waits for fd1 or fd2 (each -1 if none) to be readable, for wait ns (the
+ * next answer held back being due) and a second at most, so buffered writes
+ * get flushed even when the network is quiet. returns the amount of
+ * readable fds, or -1 on error */
+static int waitfds(int fd1, int fd2, unsigned long long wait) {
+  fd_set fdset;
+  struct timeval tv;
+  int res;
+  FD_ZERO(&fdset);
+  if (fd1 >= 0) FD_SET(fd1, &fdset);
+  if (fd2 >= 0) FD_SET(fd2, &fdset);
+  tv.tv_sec = 1;
+  tv.tv_usec = 0;
+  if (wait < 1000000000ull) {
+    tv.tv_sec = 0;
+    tv.tv_usec = (long)(wait / 1000) + 1;
+  }
+  res = select(((fd1 > fd2) ? fd1 : fd2) + 1, &fdset, NULL, NULL, &tv);
+  if ((res < 0) && (errno == EINTR)) return(0); /* signals interrupt select() */
+  return(res);
+}
+
+/* main function of the threads serving a socket each, when there are
+ * several: serves frames until ethersrv is told to terminate */
+static void *portloop(void *arg) {
+  struct sport *p = arg;
+  unsigned long long next;
+  int n = 0;
+  while (!terminationflag) {
+    next = paceflush(&(p->pacer));
+
+    /* a full batch means more frames are likely pending, skip select() */
+    if (n < RXBATCH) {
+      n = waitfds(p->sock, -1, next);
+      if (n < 0) {
+        fprintf(stderr, "ERROR: select() failed on '%s' (%s)\n", p->intname, strerror(errno));
+        break;
+      }
+      if (n == 0) continue;
+    }
+    n = handleport(p);
+    if (n < 0) {
+      fprintf(stderr, "ERROR: failed to receive frames on '%s' (%s)\n", p->intname, strerror(errno));
+      break;
+    }
+  }
+  return(NULL);
+}
+
+/* starts a thread for each socket. returns 0 on success */
+static int startports(void) {
+  int i;
+  for (i = 0; i < portscount; i++) {
+    if (spawn(&(ports[i].thread), portloop, &(ports[i])) != 0) break;
+  }
+  if (i < portscount) {
+    portscount = i;
+    return(-1);
+  }
+  fsthreaded(1);
+  return(0);
+}
+
+/* waits for the threads of all sockets to quit */
+static void stopports(void) {
+  int i;
+  for (i = 0; i < portscount; i++) pthread_join(ports[i].thread, NULL);
+  if (workerscount == 0) fsthreaded(0);
+}
+
+/* ageanswers() on the client tables of all sockets and workers */
+static void agetables(time_t now) {
+  int i;
+  fslock();
+  for (i = 0; i < portscount; i++) ageanswers(&(ports[i].clients), now);
+  for (i = 0; i < workerscount; i++) ageanswers(&(workers[i].clients), now);
+  fsunlock();
+}
+
+
+/* sends the answers of the asynchronous reads that completed on p */
+static void asyncanswers(struct sport *p) {
+  struct struct_answcache *a;
+  struct spending *pend;
+  const unsigned char *data;
+  void *cookie, *ref;
+  long res;
+  int len;
+#if defined(__linux__)
+  int tx = 0;
+#endif
+
+  for (;;) {
+    fslock();
+    if (readasyncdone(&cookie, &res, &data, &ref) == 0) {
+      fsunlock();
+      break;
+    }
+    pend = cookie;
+    a = pend->answer;
+    free(pend);
+    if (a == NULL) { /* nobody waits for it anymore */
+      readfileunref(ref);
+      fsunlock();
+      continue;
+    }
+    a->pending = NULL;
+    a->payloadref = ref;
+    if (res < 0) {
+      DBG("ERROR: asynchronous read failed (%s)\n", strerror(-res));
+      ((unsigned short *)a->frame)[29] = 5; /* "access denied" */
+      len = 60;
+    } else {
+      a->payload = data;
+      len = 60 + res;
+    }
+    fsunlock();
+
+    a = finishanswer(a, len, a->frame[56] >> 7);
+    if (a == NULL) continue;
+    METRICADD(MET_FRAMESOUT, 1);
+    METRICADD(MET_BYTESOUT, a->len);
+    if (paced(&(p->pacer), p, a) != 0) continue;
+#if defined(__linux__)
+    if (p->ring.txframes > 0) {
+      if (ringqueue(p, a) == 0) {
+        tx++;
+      } else {
+        DBG("TX ring full, answer dropped\n");
+      }
+      continue;
+    }
+#endif
+    {
+      struct iovec iov[2];
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = answeriov(a, iov);
+      sendmsg(p->sock, &msg, 0);
+    }
+  }
+#if defined(__linux__)
+  if (tx > 0) ringkick(p); /* transmit what was queued in the ring */
+#endif
+}
+
+/* returns a malloc'ed absolute form of fname, or NULL. output files must
+ * not follow the cwd, which changedir() moves around the shared drives */
+static char *abspath(const char *fname) {
+  char cwd[PATH_MAX];
+  char *res;
+  if (fname[0] == '/') return(strdup(fname));
+  if (getcwd(cwd, sizeof(cwd)) == NULL) return(NULL);
+  res = malloc(strlen(cwd) + strlen(fname) + 2);
+  if (res == NULL) return(NULL);
+  sprintf(res, "%s/%s", cwd, fname);
+  return(res);
+}
+
+/* writes the metrics file, reporting failures only once */
+static void writemetrics(const char *fname) {
+  static int failed;
+  struct fscachestats fs;
+  struct fsmemstats mem;
+  fslock();
+  fscachestats(&fs);
+  fsmemstats(&mem);
+  fsunlock();
+  if (metricswrite(fname, &fs, &mem) == 0) {
+    failed = 0;
+  } else if (failed == 0) {
+    fprintf(stderr, "ERROR: failed to write metrics to %s (%s)\n", fname, strerror(errno));
+    failed = 1;
+  }
+}
+
+/* drives, MAC and clients the benchmark frame handler works with */
+static char **benchroot;
+static unsigned char benchmac[6] = {0x02, 0x00, 0x00, 0x00, 0xbe, 0x00};
+static struct sclients benchclients;
+
+/* benchmark frame handler: answers a query like handleframe() would, but
+ * copies the answer to answer instead of sending it */
+static int benchframe(unsigned char *query, int len, unsigned char *answer) {
   struct struct_answcache *cacheptr;
+  struct iovec iov[2];
+  int i, n, off = 0;
+  len = checkframe(query, len, benchmac);
+  if (len < 0) return(0);
+  cacheptr = answerframe(query, len, &benchclients, benchmac, benchroot);
+  if (cacheptr == NULL) return(0);
+  n = answeriov(cacheptr, iov);
+  for (i = 0; i < n; i++) {
+    memcpy(answer + off, iov[i].iov_base, iov[i].iov_len);
+    off += iov[i].iov_len;
+  }
+  return(off);
+}
+
+int main(int argc, char **argv) {
+  int i, j;
+  char *intname, *root[26], *s;
   int opt;
+  int threads = 0; /* frames are processed by the main thread by default */
+  int promisc = 0;
+#if defined(__linux__)
+  int mmapring = 0;
+#endif
+  int fanout = 1; /* sockets per interface */
+  int maxports = 0;
   int daemon = 1; /* daemonize self by default */
+  char *benchspec = NULL;
+  char *metricsfile = NULL;
+  char *tracefile = NULL;
+  char *rodrives = "";
+  char *snapfile = NULL;
+  long hotmb = 0;
+  int pfdepth = 0;
+  long pfmb = 32; /* memory budget of the readdir-ahead thread */
+  int asyncfd = -1;
+  unsigned long long next;
+  long pacems;
+  long attrms, diskms;
+  time_t metricstime = 0, agetime = 0;
   #define lockfile "/var/run/ethersrv.lock"
 
   /* Process command line arguments */
-  while ((opt = getopt(argc, argv, "fhv")) != -1) {
+  while ((opt = getopt(argc, argv, "aA:b:c:d:fhmpP:q:R:S:T:vt:M:")) != -1) {
     switch (opt) {
+      case 'a': asyncreads = 1; break;
+      case 'A':
+        i = sscanf(optarg, "%ld:%ld", &attrms, &diskms);
+        if (i == 1) diskms = attrms;
+        if ((i < 1) || (attrms < 0) || (attrms > 60000) || (diskms < 0) || (diskms > 60000)) {
+          fprintf(stderr, "ERROR: -A wants a GETATTR cache time between 0 and 60000 ms, optionally followed by :ms for DISKSPACE\n");
+          return(1);
+        }
+        attrttl = (unsigned long long)attrms * 1000000ull;
+        diskttl = (unsigned long long)diskms * 1000000ull;
+        break;
+      case 'b': benchspec = optarg; break;
+      case 'c':
+        hotmb = atol(optarg);
+        if ((hotmb < 0) || (hotmb > 65536)) {
+          fprintf(stderr, "ERROR: the hot file cache size must be between 0 and 65536 MiB\n");
+          return(1);
+        }
+        break;
+      case 'd':
+        pacems = atol(optarg);
+        if ((pacems < 1) || (pacems > 1000)) {
+          fprintf(stderr, "ERROR: the pacing delay must be between 1 and 1000 ms\n");
+          return(1);
+        }
+        pacemax = (unsigned long long)pacems * 1000000ull;
+        break;
       case 'f': daemon = 0; break;
+      case 'M':
+        metricsfile = abspath(optarg);
+        if (metricsfile == NULL) {
+          fprintf(stderr, "ERROR: failed to resolve path '%s'\n", optarg);
+          return(1);
+        }
+        metricson = 1;
+        break;
+      case 'T':
+        tracefile = abspath(optarg);
+        if (tracefile == NULL) {
+          fprintf(stderr, "ERROR: failed to resolve path '%s'\n", optarg);
+          return(1);
+        }
+        traceon = 1;
+        break;
+      case 'p': promisc = 1; break;
+      case 'P':
+        if ((sscanf(optarg, "%d:%ld", &pfdepth, &pfmb) < 1) || (pfdepth < 1) || (pfdepth > 16) || (pfmb < 1)) {
+          fprintf(stderr, "ERROR: -P wants a depth between 1 and 16, optionally followed by :MiB\n");
+          return(1);
+        }
+        break;
+      case 'R': rodrives = optarg; break;
+      case 'S':
+        snapfile = abspath(optarg);
+        if (snapfile == NULL) {
+          fprintf(stderr, "ERROR: failed to resolve path '%s'\n", optarg);
+          return(1);
+        }
+        break;
+#if defined(__linux__)
+      case 'm': mmapring = 1; break;
+      case 'q':
+        fanout = atoi(optarg);
+        if ((fanout < 1) || (fanout > MAXPORTS)) {
+          fprintf(stderr, "ERROR: the amount of sockets per interface must be between 1 and %d\n", MAXPORTS);
+          return(1);
+        }
+        break;
+#endif
+      case 't':
+        threads = atoi(optarg);
+        if ((threads < 1) || (threads > MAXWORKERS)) {
+          fprintf(stderr, "ERROR: the amount of worker threads must be between 1 and %d\n", MAXWORKERS);
+          return(1);
+        }
+        break;
       case 'v': debug_enabled = 1; break; /* ENABLE DEBUG */
       case 'h': help(); return(0);
       case '?': help(); return(1);
     }
   }
 
-  if (argc - optind < 2 || argc - optind > 26) {
+  if (argc - optind < ((benchspec == NULL) ? 2 : 0) || argc - optind > 26) {
     help();
     return(1);
   }
   
-  intname = argv[optind++];
+  intname = (benchspec == NULL) ? argv[optind++] : NULL;
   
+  /* several interfaces may be given, separated by commas */
+  if (intname != NULL) {
+    for (i = 0; intname[i] != 0; i++) {
+      if ((intname[i] != ',') && ((i == 0) || (intname[i - 1] == ','))) maxports += fanout;
+    }
+    if ((maxports == 0) || (maxports > MAXPORTS)) {
+      fprintf(stderr, "ERROR: between 1 and %d sockets can be served, interfaces times -q\n", MAXPORTS);
+      return(1);
+    }
+  }
+
   /* load all "virtual drive" paths */
   for (i = 0; i < 26; i++) root[i] = NULL;
   
@@ -952,16 +2380,82 @@ int main(int argc, char **argv) {
     }
   }
 
-  sock = raw_sock(intname, mymac);
-  if (sock == -1) {
-    fprintf(stderr, "Error: failed to open socket (%s). Are you root?\n", strerror(errno));
+  /* read-only drives are also immutable for the hot file cache */
+  for (s = rodrives; *s != 0; s++) {
+    i = toupper((unsigned char)*s) - 'A';
+    if ((i < 2) || (i > 25) || (root[i] == NULL)) {
+      fprintf(stderr, "ERROR: drive %c: given to -R is not mapped\n", *s);
+      return(1);
+    }
+    drivesro[i] = 1;
+    fsimmutable(root[i]);
+  }
+  hotcachesize((unsigned long)hotmb << 20);
+
+  /* worker threads (or threads serving sockets) keep a slow disk from
+   * holding up other clients already */
+  if ((asyncreads != 0) && ((threads > 0) || (benchspec != NULL) || (maxports > 1))) asyncreads = 0;
+  if (asyncreads != 0) {
+    asyncfd = readasyncinit();
+    if (asyncfd < 0) {
+      fprintf(stderr, "WARNING: io_uring is not available, files are read synchronously\n");
+      asyncreads = 0;
+    }
+  }
+
+  /* benchmarks talk to the frame handler directly, without any network */
+  if (benchspec != NULL) {
+    benchroot = root;
+    if ((pfdepth > 0) && (prefetchstart(pfdepth, (unsigned long)pfmb << 20) != 0)) {
+      fprintf(stderr, "ERROR: failed to start the readdir-ahead thread\n");
+      return(1);
+    }
+    i = benchrun(benchspec, benchframe, benchmac, PROTOVER);
+    prefetchstop();
+    flushwrites(1);
+    if ((tracefile != NULL) && (tracedump(tracefile) != 0)) {
+      fprintf(stderr, "ERROR: failed to write trace %s (%s)\n", tracefile, strerror(errno));
+    }
+    return(i != 0);
+  }
+
+  ports = calloc(maxports, sizeof(struct sport));
+  if (ports == NULL) {
+    fprintf(stderr, "ERROR: out of memory\n");
     return(1);
   }
+  for (s = strtok(intname, ","), i = 0; s != NULL; s = strtok(NULL, ","), i++) {
+    for (j = 0; j < fanout; j++) {
+      struct sport *p = &(ports[portscount]);
+      p->intname = s;
+      p->root = root;
+      p->sock = raw_sock(s, p->mac, promisc);
+      if (p->sock == -1) {
+        fprintf(stderr, "Error: failed to open socket on '%s' (%s). Are you root?\n", s, strerror(errno));
+        return(1);
+      }
+      portscount++;
+#if defined(__linux__)
+      /* worker threads send answers on their own, which a TX ring would not
+       * allow, so they only get the RX ring */
+      if ((mmapring != 0) && (setupring(p, threads == 0) != 0)) {
+        fprintf(stderr, "ERROR: failed to set up PACKET_MMAP rings (%s)\n", strerror(errno));
+        return(1);
+      }
+      /* group ids are shared by the whole system */
+      if ((fanout > 1) && (joinfanout(p->sock, (getpid() + i) & 0xffff) != 0)) {
+        fprintf(stderr, "ERROR: failed to spread frames of '%s' over %d sockets (%s)\n", s, fanout, strerror(errno));
+        return(1);
+      }
+#endif
+    }
+  }
 
   /* setup signals catcher */
   signal(SIGTERM, sigcatcher);
   signal(SIGQUIT, sigcatcher);
   signal(SIGINT, sigcatcher);
+  if (tracefile != NULL) signal(SIGUSR1, sigdump);
 
   /* acquire the lock file */
   if (lockme(lockfile) != 0) {
@@ -969,12 +2463,26 @@ int main(int argc, char **argv) {
     return(1);
   }
   
-  printf("Listening on '%s' [%s]\n", intname, printmac(mymac));
+  for (i = 0; i < portscount; i += fanout) {
+    printf("Listening on '%s' [%s]", ports[i].intname, printmac(ports[i].mac));
+    if (fanout > 1) printf(" with %d sockets", fanout);
+    printf("\n");
+  }
   for (i = 2; i < 26; i++) {
     if (root[i] == NULL) break;
     printf("Drive %c: mapped to %s\n", 'A' + i, root[i]);
   }
 
+  /* a missing snapshot is fine, there is none before the first run */
+  if (snapfile != NULL) {
+    i = snapshotload(snapfile, root, 26);
+    if (i >= 0) {
+      printf("Restored %d items from %s\n", i, snapfile);
+    } else if (errno != ENOENT) {
+      fprintf(stderr, "WARNING: snapshot %s cannot be used, starting with empty caches\n", snapfile);
+    }
+  }
+
   if (daemon != 0) {
     if (daemonize() != 0) {
       fprintf(stderr, "Error: failed to daemonize!\n");
@@ -982,105 +2490,104 @@ int main(int argc, char **argv) {
     }
   }
   
-  /* Use the static global buffer instead of malloc */
-  buff = rx_buffer;
+  if (threads > 0) {
+    if (startworkers(threads) != 0) {
+      fprintf(stderr, "ERROR: failed to start worker threads\n");
+      stopworkers();
+      return(1);
+    }
+  }
+
+  if ((pfdepth > 0) && (prefetchstart(pfdepth, (unsigned long)pfmb << 20) != 0)) {
+    fprintf(stderr, "ERROR: failed to start the readdir-ahead thread\n");
+    stopworkers();
+    return(1);
+  }
+
+  /* a single socket is served by the main thread, several get a thread
+   * each and the main thread only takes care of timed duties */
+  if ((portscount > 1) && (startports() != 0)) {
+    fprintf(stderr, "ERROR: failed to start socket threads\n");
+    terminationflag = 1;
+    stopports();
+    stopworkers();
+    return(1);
+  }
 
   /* main loop */
+  i = 0;
   while (!terminationflag) {
-    fd_set fdset;
-    FD_ZERO(&fdset);
-    FD_SET(sock, &fdset);
-
-    /* Wait for packet, but with a timeout to check for signals */
-    /* No timeout needed really, signals interrupt select() */
-    if (select(sock + 1, &fdset, NULL, NULL, NULL) < 0) {
-      if (errno == EINTR) continue;
-      DBG("ERROR: select(): %s\n", strerror(errno));
-      break;
-    }
+    /* write out data that sits in write-behind buffers for too long */
+    fslock();
+    flushwrites(0);
+    fsunlock();
 
-    len = recv(sock, buff, BUFF_LEN, MSG_DONTWAIT);
-    
-    if (len < 60) continue; /* ignore too small or error */
-    
-    /* validate this is for me (or broadcast) */
-    if ((cmpdata(mymac, buff, 6) != 0) && (cmpdata((unsigned char *)"\xff\xff\xff\xff\xff\xff", buff, 6) != 0)) continue; 
-    
-    /* is this ETHERTYPE_DFS? */
-    if (((unsigned short *)buff)[6] != htons(ETHERTYPE_DFS)) continue;
-    
-    /* validate protocol version matches what I expect */
-    if ((buff[56] & 127) != PROTOVER) continue;
-    
-    cksumflag = buff[56] >> 7;
-    edf5framelen = le16toh(((unsigned short *)buff)[26]);
-    
-    if (edf5framelen > 0) {
-        if (edf5framelen > len || edf5framelen < 60) continue; /* Malformed */
-        len = edf5framelen;
+    if (asyncfd >= 0) asyncanswers(&(ports[0]));
+
+    if (time(NULL) - agetime >= ANSW_MAXAGE) {
+      agetables(time(NULL));
+      agetime = time(NULL);
     }
-    
-    /* DUMP RECEIVED FRAME IF DEBUG IS ON */
-    if (debug_enabled) {
-        DBG("Received frame of %d bytes (cksum = %s)\n", len, (cksumflag != 0)?"ENABLED":"DISABLED");
-        dumpframe(buff, len);
+
+    if ((metricsfile != NULL) && (time(NULL) - metricstime >= METRICS_PERIOD)) {
+      writemetrics(metricsfile);
+      metricstime = time(NULL);
     }
-    
-    /* validate the CKSUM, if any */
-    if (cksumflag != 0) {
-      unsigned short cksum_remote, cksum_mine;
-      cksum_mine = bsdsum(buff + 56, len - 56);
-      cksum_remote = le16toh(((unsigned short *)buff)[27]);
-      if (cksum_mine != cksum_remote) {
-          DBG("CHECKSUM MISMATCH! Computed: 0x%02Xh Received: 0x%02Xh\n", cksum_mine, cksum_remote);
-          continue;
-      }
+
+    if (dumpflag != 0) {
+      dumpflag = 0;
+      if (tracedump(tracefile) != 0) fprintf(stderr, "ERROR: failed to write trace %s (%s)\n", tracefile, strerror(errno));
     }
-    
-    /* Cache lookup */
-    cacheptr = findcacheentry(buff + 6);
-    
-    /* process frame */
-    len = process(cacheptr, buff, len, mymac, root);
-    
-    /* update cache entry */
-    if (len >= 0) {
-      cacheptr->len = len;
-      cacheptr->timestamp = time(NULL);
-    } else {
-      cacheptr->len = 0;
+
+    if (portscount > 1) {
+      waitfds(-1, -1, PACE_IDLE);
+      continue;
     }
 
-    if (len > 0) {
-      /* Prepare outgoing frame */
-      cacheptr->frame[52] = len & 0xff;
-      cacheptr->frame[53] = (len >> 8) & 0xff;
-      
-      /* checksum */
-      if (cksumflag != 0) {
-        unsigned short newcksum = bsdsum(cacheptr->frame + 56, len - 56);
-        cacheptr->frame[54] = newcksum & 0xff;
-        cacheptr->frame[55] = (newcksum >> 8) & 0xff;
-        cacheptr->frame[56] |= 128; 
-      } else {
-        cacheptr->frame[54] = 0;
-        cacheptr->frame[55] = 0;
-        cacheptr->frame[56] &= 127;
-      }
+    next = paceflush(&(ports[0].pacer));
 
-      /* DUMP SENT FRAME IF DEBUG IS ON */
-      if (debug_enabled) {
-          DBG("Sending back an answer of %d bytes\n", len);
-          dumpframe(cacheptr->frame, len);
+    /* a full batch means more frames are likely pending, skip select() */
+    if (i < RXBATCH) {
+      i = waitfds(ports[0].sock, asyncfd, next);
+      if (i < 0) {
+        DBG("ERROR: select(): %s\n", strerror(errno));
+        break;
       }
+      if (i == 0) continue; /* timeout */
+    }
 
-      /* Send packet */
-      send(sock, cacheptr->frame, len, 0);
-    } else {
-        DBG("Query ignored (result: %d)\n", len);
+    i = handleport(&(ports[0]));
+    if (i < 0) {
+      DBG("ERROR: failed to receive frames (%s)\n", strerror(errno));
+      break;
     }
   }
   
+  /* write out anything still buffered */
+  if (portscount > 1) stopports();
+  stopworkers();
+  prefetchstop();
+  flushwrites(1);
+
+  if ((snapfile != NULL) && (snapshotsave(snapfile) != 0)) {
+    fprintf(stderr, "ERROR: failed to write snapshot %s (%s)\n", snapfile, strerror(errno));
+  }
+
+  if (metricsfile != NULL) writemetrics(metricsfile);
+  if ((tracefile != NULL) && (tracedump(tracefile) != 0)) {
+    fprintf(stderr, "ERROR: failed to write trace %s (%s)\n", tracefile, strerror(errno));
+  }
+
+  {
+    struct fscachestats fs;
+    struct fsmemstats mem;
+    fscachestats(&fs);
+    fsmemstats(&mem);
+    printf("Read-ahead cache: %lu hits, %lu misses\n", fs.rahits, fs.ramisses);
+    if (hotmb > 0) printf("Hot file cache: %lu hits, %lu misses, %lu KiB held\n", fs.hothits, fs.hotmisses, mem.hotbytes / 1024);
+    printf("Memory: %lu fsdb slots in %lu KiB, %lu of %lu KiB of pools in use\n", mem.slots, mem.slotbytes / 1024, mem.poolused / 1024, mem.poolbytes / 1024);
+  }
+
   /* remove the lock file and quit */
   unlockme(lockfile);
   return(0);
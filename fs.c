@@ -13,6 +13,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <sys/mman.h>    /* mmap() */
 #include <sys/statvfs.h> /* statvfs() for diskfree calls */
 #include <sys/stat.h>    /* stat() */
 #include <sys/types.h>
@@ -30,6 +31,12 @@
 #endif
 #include <sys/ioctl.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <signal.h>
+#if defined(__linux__)
+  #include <sys/resource.h> /* setpriority() */
+  #include <sys/syscall.h>  /* SYS_gettid, SYS_ioprio_set */
+#endif
 
 /* NOTE: Use DBG macro from main file context if linked properly, 
    but since this is a separate unit, we rely on stderr prints guarded by #ifdef DEBUG
@@ -41,6 +48,13 @@
 /* #define DBG(...) fprintf(stderr, __VA_ARGS__) */
 #define DBG(...) /* disabled by default for speed */
 
+/* nanoseconds of a struct stat timestamp (m or c) */
+#ifdef __APPLE__
+  #define STNSEC(st, t) ((st)->st_##t##timespec.tv_nsec)
+#else
+  #define STNSEC(st, t) ((st)->st_##t##tim.tv_nsec)
+#endif
+
 /* macOS doesn't have all the FreeBSD file flags, define missing ones */
 #ifdef __APPLE__
   #ifndef UF_READONLY
@@ -55,73 +69,1336 @@
 #endif
 
 #include "fs.h" 
-
-/* database containing file/dir identifiers */
+#include "pool.h"
+#include "trace.h"
+#include "uring.h"
+
+/* number of usable fsdb slots - 0xffff is the "error" start sector */
+#define FSDB_SLOTS 0xffffu
+#define FSDB_NONE 0xffffu
+
+/* amount of hash buckets used to index fsdb names (must be a power of 2) */
+#define FSDB_HASHSZ 65536u
+
+/* fsdb slots are allocated by shards of FSDB_SHARDSZ, as they get used */
+#define FSDB_SHARDSZ 256u
+#define FSDB_SHARDS (65536u / FSDB_SHARDSZ)
+#define FSDB(i) (fsdbshards[(i) / FSDB_SHARDSZ][(i) % FSDB_SHARDSZ])
+
+/* max depth of a path known to fsdb */
+#define FSDB_MAXDEPTH 512
+
+/* entries not used for this many seconds are purged from the cache */
+#define FSDB_MAXAGE 3600
+
+/* max amount of expired entries purged by a single getitemss() call */
+#define FSDB_PURGEMAX 8
+
+/* what a directory looked like when it was scanned */
+struct sdirstamp {
+  time_t scantime; /* time the scan started */
+  time_t mtime;    /* directory's mtime, ctime and inode at scan time */
+  time_t ctime;
+  long mnsec, cnsec; /* sub-second parts of mtime and ctime */
+  ino_t ino;
+  unsigned char exact; /* taken right after a change ethersrv made itself */
+};
+
+/* FCB name index of a directory: finds entries by their 8.3 name */
+struct snameidx {
+  unsigned long count;     /* amount of entries */
+  unsigned long gen;       /* DIRNAMEGEN() of its directory at scan time */
+  struct sdirstamp stamp;
+  unsigned long hashmask;  /* amount of hash buckets - 1 */
+  unsigned long *buckets;  /* first entry of each bucket */
+  struct snameent {
+    char fcbname[11];
+    unsigned char isdir;
+    unsigned long nameoff; /* offset of the host name in names */
+    unsigned long hnext;   /* next entry in the same bucket */
+  } *ents;
+  char *names;             /* host names of all entries, NUL-separated */
+  unsigned long namesused;
+  unsigned long cap;       /* allocated ents */
+  unsigned long namescap;  /* allocated names bytes */
+};
+
+#define NAMEIDX_NONE (~0ul)
+
+/* database containing file/dir identifiers. an item only knows its own
+ * name: the path of its directory is given by its parent, which stays
+ * registered as long as it has children */
 static struct sfsdb {
-  char *name;
+  char *leaf;             /* last path component (pool block), NULL if unused */
   time_t lastused;
-  struct sdirlist { /* pointer to dir listing */
-    struct fileprops fprops;
-    struct sdirlist *next;
+  struct sdirlist { /* dir listing snapshot, followed by its entries */
+    unsigned long count;    /* amount of struct fileprops entries */
+    unsigned long gen;      /* fsgen value at scan time */
+    struct sdirstamp stamp;
+    unsigned char prefetched; /* subdirectories were queued for prefetch */
+    time_t since;           /* time of its scan */
   } *dirlist;
-} fsdb[65536];
+  struct snameidx *nameidx; /* FCB name index of a directory */
+  unsigned short parent;  /* slot of the directory holding it, FSDB_NONE for "/" */
+  unsigned short kids;    /* amount of slots this one is the parent of */
+  unsigned short hnext;   /* next slot in the same hash bucket */
+  unsigned short lruprev; /* LRU links, most recently used at lruhead */
+  unsigned short lrunext; /* also links the free list for unused slots */
+  unsigned char fdc;      /* fdcache entry + 1 holding the item open, 0 if none */
+  unsigned char rac;      /* racache entry + 1 holding read-ahead data, 0 if none */
+  unsigned char wbc;      /* wbcache entry + 1 holding unwritten data, 0 if none */
+  unsigned short hot;     /* hotcache entry + 1 holding its content, 0 if none */
+  unsigned long id;       /* unique among all items ever registered */
+  unsigned long dirgen;   /* bumped as ethersrv begins and ends a change of it */
+  unsigned long namegen;  /* bumped as the names of its items change */
+} *fsdbshards[FSDB_SHARDS];
+
+static unsigned short fsdbhash[FSDB_HASHSZ]; /* hash buckets (first slot) */
+static unsigned short lruhead, lrutail;      /* used slots, MRU to LRU */
+static unsigned short freehead;              /* first unused slot */
+static unsigned long fsdbnext;               /* slots never used start here */
+static unsigned long fsdbused;               /* slots in use */
+
+static int fsdbvalid(unsigned short i);
+static char *fsdbpath(unsigned short i, char *buf, size_t bufsz);
+static unsigned short diritems(unsigned short dss);
+static void fcbtodos(char *d, const char *fcb);
+static int fsdbready;
+static unsigned long fsdbids; /* last id given to an fsdb item */
+
+/* all the state above and below is guarded by fsmutex. when fsworkers is
+ * set, it is released while waiting for the disk */
+static pthread_mutex_t fsmutex = PTHREAD_MUTEX_INITIALIZER;
+static int fsworkers;
+
+/* lets other workers go on while this one waits for the disk. whatever was
+ * looked up before must be checked again after fsresume(), usually with the
+ * slot's id and fsgen */
+static void fsyield(void) {
+  if (fsworkers != 0) pthread_mutex_unlock(&fsmutex);
+}
 
-/* frees a sdirlist linked list */
-static void freedirlist(struct sdirlist *d) {
-  while (d != NULL) {
-    struct sdirlist *victim = d;
-    d = d->next;
-    free(victim);
+static void fsresume(void) {
+  if (fsworkers != 0) pthread_mutex_lock(&fsmutex);
+}
+
+/* entries of a dir listing snapshot are stored right after its header */
+#define DIRLISTENTS(d) ((struct fileprops *)((d) + 1))
+
+/* attributes of a listing entry removed by ethersrv after the scan. it is
+ * kept so the FindNext positions of the entries after it do not move */
+#define DIRENT_GONE 0xff
+
+/* listings are reused by FindFirst for at most this many seconds - file
+ * sizes and times may change without the directory's mtime changing */
+#define DIRLIST_MAXAGE 10
+
+/* incremented each time ethersrv itself modifies the filesystem */
+static unsigned long fsgen;
+
+/* generation of the names of directory slot dss, bumped by dirnamesbump()
+ * as ethersrv creates, removes or renames something in it */
+#define DIRNAMEGEN(dss) (FSDB(diritems(dss)).namegen)
+
+/* amount of DOS paths whose host path is remembered by shorttolong() (must
+ * be a power of 2), and for how many seconds such a translation is trusted */
+#define PATHCACHESZ 4096
+#define PATHCACHE_MAXAGE 10
+
+/* the directory whose names a path translation was found in. it holds as
+ * long as they do not change */
+struct spathdir {
+  unsigned short dss; /* items slot of the directory, FSDB_NONE for a root */
+  unsigned long id;   /* FSDB(dss).id */
+  unsigned long gen;  /* FSDB(dss).namegen */
+};
+
+/* direct-mapped cache of DOS path to host path translations */
+static struct spathcache {
+  char *dos;          /* lower-case DOS path, slashes squeezed */
+  char *host;         /* matching host path */
+  struct spathdir in; /* directory of its last component */
+  time_t when;
+} pathcache[PATHCACHESZ];
+
+/* amount of file descriptors kept open for readfile() and writefile() */
+#define FDCACHESZ 64
+
+/* cache of open file descriptors, keyed by fsdb slot */
+static struct sfdcache {
+  int fd;
+  unsigned short fss;     /* fsdb slot this descriptor belongs to */
+  unsigned char used;
+  unsigned char writable; /* opened with O_RDWR */
+  unsigned long lastused; /* fdtick value of last access */
+  unsigned long nextoff;  /* offset that a sequential read would start at */
+  unsigned long wrnext;   /* offset that a sequential write would start at */
+  unsigned long seqbytes; /* bytes written sequentially up to wrnext */
+  unsigned long allocend; /* end of the space allocated for the file, 0 if unknown */
+  unsigned char noprealloc; /* the filesystem cannot preallocate */
+} fdcache[FDCACHESZ];
+
+/* files written sequentially by more than PREALLOC_MIN bytes at their end
+ * get their space allocated ahead, by as much as they hold already, within
+ * PREALLOC_CHUNK bounds. this keeps them contiguous and spares a metadata
+ * update for each write */
+#define PREALLOC_MIN (64ul * 1024ul)
+#define PREALLOC_CHUNKMIN (1024ul * 1024ul)
+#define PREALLOC_CHUNKMAX (16ul * 1024ul * 1024ul)
+
+static unsigned long fdtick;
+
+/* amount and size of read-ahead windows used for sequential READFIL streams */
+#define RACACHESZ 8
+#define RAWINDOW (256ul * 1024ul)
+
+/* max amount of asynchronous reads in flight */
+#define ASYNCREADS 32
+
+/* a RAWINDOW-sized buffer of read-ahead data, shared by the window it was
+ * read for and by answers that still point to it (see readfileref()). its
+ * content never changes once read, it is only reused when nobody holds
+ * a reference to it anymore */
+struct srabuf {
+  unsigned long refs;
+  size_t mapsz; /* size of the mapping it starts (hot file cache), 0 if malloc'd */
+};
+
+/* data of a struct srabuf follows its header */
+#define RABUFDATA(b) ((unsigned char *)((b) + 1))
+
+/* max amount of read-ahead buffers allocated at any time */
+#define RABUFMAX 64
+
+/* seconds a read-ahead window is trusted for: the file may be changed by
+ * others meanwhile */
+#define RA_MAXAGE 1
+
+/* read-ahead windows, keyed by fsdb slot */
+static struct sracache {
+  struct srabuf *buf;     /* RAWINDOW bytes of file data */
+  unsigned long start;    /* file offset of the first byte of buf */
+  unsigned long len;      /* amount of valid bytes in buf */
+  unsigned short fss;     /* fsdb slot this window belongs to */
+  unsigned char used;
+  unsigned long lastused; /* fdtick value of last access */
+  time_t filled;          /* time its data was read */
+} racache[RACACHESZ];
+
+/* hit and miss counters, see fscachestats() */
+static struct fscachestats stats;
+
+/* read-ahead buffers nobody holds a reference to */
+static struct srabuf *raspare[RACACHESZ];
+static int raspares;
+static int rabufs; /* amount of allocated buffers, spare or not */
+
+/* amount of files the hot file cache may hold, the largest part of the
+ * cache a single file may take (1/HOTFILEDIV), and for how many seconds
+ * a cached file is trusted before checking it did not change (unless it
+ * is immutable) */
+#define HOTCACHESZ 1024
+#define HOTFILEDIV 8
+#define HOT_MAXAGE 1
+
+/* whole contents of files, keyed by the identity and mtime of the file.
+ * entries are evicted by CLOCK: the hand spares (and clears) an entry hit
+ * since it last passed, and evicts it otherwise */
+static struct shotcache {
+  struct srabuf *buf;      /* content, in a mapping of its own. NULL if unused */
+  unsigned long size;
+  dev_t dev;
+  ino_t ino;
+  time_t mtime;
+  time_t checked;          /* last time the file was found unchanged */
+  unsigned long id;        /* FSDB(fss).id of the slot it is attached to */
+  unsigned short fss;
+  unsigned char refbit;    /* hit since the hand last passed */
+  unsigned char immutable; /* below a root given to fsimmutable() */
+} hotcache[HOTCACHESZ];
+
+static unsigned int hothand;
+static unsigned long hotlimit, hotbytes; /* hotbytes: content held */
+
+/* roots whose files never change, see fsimmutable() */
+static char *immroots[26];
+static int immcount;
+
+/* amount and size of write-behind buffers used to coalesce WRITEFIL frames,
+ * and how many seconds buffered data may wait before being written out */
+#define WBCACHESZ 8
+#define WBSIZE (64ul * 1024ul)
+#define WBMAXAGE 1
+
+/* write-behind buffers, keyed by fsdb slot */
+static struct swbcache {
+  unsigned char *buf;     /* WBSIZE bytes, allocated on first use */
+  unsigned long start;    /* file offset of buf[0] */
+  unsigned long len;      /* amount of buffered bytes */
+  unsigned short fss;     /* fsdb slot this buffer belongs to */
+  unsigned char used;
+  unsigned char flushing; /* detached from fss, being written out */
+  time_t since;           /* time the first byte was buffered */
+} wbcache[WBCACHESZ];
+
+static int wbpending; /* amount of wbcache entries in use */
+
+/* signaled each time a buffer was written out without fsmutex held */
+static pthread_cond_t wbcond = PTHREAD_COND_INITIALIZER;
+
+/* returns non-zero if data of fsdb slot fss is being written out by another
+ * worker. lruvictim() leaves such slots alone */
+static int wbflying(unsigned short fss) {
+  int i;
+  for (i = 0; i < WBCACHESZ; i++) {
+    if ((wbcache[i].flushing != 0) && (wbcache[i].fss == fss)) return(1);
   }
+  return(0);
 }
 
-/* returns the "start sector" of a filesystem item */
-unsigned short getitemss(char *f) {
-  unsigned short i, firstfree = 0xffffu, oldest = 0;
-  time_t now = time(NULL);
-  
-  /* see if not already in cache */
-  for (i = 0; i < 0xffffu; i++) {
-    /* is it what I am looking after? */
-    if ((fsdb[i].name != NULL) && (strcmp(fsdb[i].name, f) == 0)) {
-      fsdb[i].lastused = now;
-      return(i);
+/* waits until the data of fss other workers write out is on disk */
+static void wbwait(unsigned short fss) {
+  while (wbflying(fss) != 0) pthread_cond_wait(&wbcond, &fsmutex);
+}
+
+/* writes out the buffered data of fsdb slot fss, if any. the descriptor of
+ * an item with pending data is always cached and writable. unless yield is
+ * 0, other workers go on while the data is written, and the data of fss
+ * another worker writes out is waited for */
+static void wbflush(unsigned short fss, int yield) {
+  struct swbcache *w;
+  unsigned long done = 0;
+  ssize_t res;
+  int fd, dupfd = -1, err = 0;
+  if (FSDB(fss).wbc != 0) {
+    w = &(wbcache[FSDB(fss).wbc - 1]);
+    fd = fdcache[FSDB(fss).fdc - 1].fd;
+    /* the buffer is detached so nothing gets added to it meanwhile, and the
+     * descriptor is duplicated since the cached one may get closed */
+    FSDB(fss).wbc = 0;
+    w->flushing = 1;
+    if ((yield != 0) && (fsworkers != 0)) dupfd = dup(fd);
+    if (dupfd >= 0) {
+      fd = dupfd;
+      pthread_mutex_unlock(&fsmutex);
+    }
+    while (done < w->len) {
+      res = pwrite(fd, w->buf + done, w->len - done, (off_t)(w->start + done));
+      if (res <= 0) {
+        err = errno;
+        break;
+      }
+      done += res;
     }
-    /* check last usage and remove if older than one hour */
-    if ((fsdb[i].name != NULL) && ((now - fsdb[i].lastused) > 3600)) {
-      free(fsdb[i].name);
-      freedirlist(fsdb[i].dirlist);
-      memset(&(fsdb[i]), 0, sizeof(struct sfsdb));
+    if (dupfd >= 0) {
+      close(dupfd);
+      pthread_mutex_lock(&fsmutex);
     }
-    /* remember free slot */
-    if ((firstfree == 0xffffu) && (fsdb[i].name == NULL)) {
-      firstfree = i;
-    } else if (fsdb[oldest].lastused > fsdb[i].lastused) { 
-      oldest = i;
+    if (done < w->len) {
+      char path[1024];
+      fprintf(stderr, "ERROR: delayed write of %lu bytes to '%s' failed (%s)\n", w->len - done, fsdbpath(fss, path, sizeof(path)), strerror(err));
     }
+    w->flushing = 0;
+    w->used = 0;
+    wbpending--;
+    if (dupfd >= 0) pthread_cond_broadcast(&wbcond);
   }
-  
-  /* not found - if no free slot, replace oldest */
-  if (firstfree == 0xffffu) {
-    firstfree = oldest;
-    free(fsdb[oldest].name);
-    freedirlist(fsdb[oldest].dirlist);
-    memset(&(fsdb[oldest]), 0, sizeof(struct sfsdb));
+  if (yield != 0) wbwait(fss);
+}
+
+/* writes out all buffered data, letting other workers go on meanwhile */
+static void wbflushall(void) {
+  int i;
+  for (i = 0; (i < WBCACHESZ) && (wbpending > 0); i++) {
+    if (wbcache[i].used != 0) wbflush(wbcache[i].fss, 1);
   }
-  
-  /* register it */
-  fsdb[firstfree].name = strdup(f);
+}
+
+/* buffers len bytes of data to be written to fss at offset, merging them with
+ * already buffered data if they directly follow it. returns 0 on success, or
+ * -1 if the data could not be buffered and must be written directly. */
+static int wbappend(unsigned short fss, unsigned char *buff, unsigned long offset, unsigned short len) {
+  struct swbcache *w;
+  int i, victim;
+  /* writing out data lets other workers go on: all is looked at again after */
+  for (;;) {
+    if ((FSDB(fss).fdc == 0) || (fdcache[FSDB(fss).fdc - 1].writable == 0)) return(-1);
+    if (FSDB(fss).wbc != 0) {
+      w = &(wbcache[FSDB(fss).wbc - 1]);
+      if ((offset == w->start + w->len) && (w->len + len <= WBSIZE)) {
+        memcpy(w->buf + w->len, buff, len);
+        w->len += len;
+        if (w->len == WBSIZE) wbflush(fss, 1);
+        return(0);
+      }
+      wbflush(fss, 1); /* not contiguous, or full: start over */
+      continue;
+    }
+    /* data of fss written out by another worker must land first */
+    if (wbflying(fss) != 0) {
+      wbwait(fss);
+      continue;
+    }
+    /* pick a free buffer, or the one holding the oldest data */
+    victim = -1;
+    for (i = 0; i < WBCACHESZ; i++) {
+      if (wbcache[i].flushing != 0) continue;
+      if (wbcache[i].used == 0) {
+        victim = i;
+        break;
+      }
+      if ((victim < 0) || (wbcache[i].since < wbcache[victim].since)) victim = i;
+    }
+    if (victim < 0) { /* all are being written out */
+      pthread_cond_wait(&wbcond, &fsmutex);
+      continue;
+    }
+    w = &(wbcache[victim]);
+    if (w->used == 0) break;
+    wbflush(w->fss, 1);
+  }
+  if (w->buf == NULL) w->buf = malloc(WBSIZE);
+  if (w->buf == NULL) return(-1);
+  memcpy(w->buf, buff, len);
+  w->start = offset;
+  w->len = len;
+  w->fss = fss;
+  w->used = 1;
+  w->since = time(NULL);
+  FSDB(fss).wbc = (unsigned char)(victim + 1);
+  wbpending++;
+  return(0);
+}
+
+/* drops a reference to read-ahead buffer b */
+static void rabufput(struct srabuf *b) {
+  if ((b == NULL) || (--(b->refs) > 0)) return;
+  if (b->mapsz != 0) {
+    munmap(b, b->mapsz);
+  } else if (raspares < RACACHESZ) {
+    raspare[raspares++] = b;
+  } else {
+    free(b);
+    rabufs--;
+  }
+}
+
+/* returns an unused read-ahead buffer the caller holds a reference to, or
+ * NULL if too many are in use or out of memory */
+static struct srabuf *rabufget(void) {
+  struct srabuf *b;
+  if (raspares > 0) {
+    b = raspare[--raspares];
+  } else {
+    if (rabufs >= RABUFMAX) return(NULL);
+    b = malloc(sizeof(struct srabuf) + RAWINDOW);
+    if (b == NULL) return(NULL);
+    b->mapsz = 0;
+    rabufs++;
+  }
+  b->refs = 1;
+  return(b);
+}
+
+/* forgets the read-ahead window of fsdb slot fss, if any */
+static void radrop(unsigned short fss) {
+  struct sracache *w;
+  if (FSDB(fss).rac == 0) return;
+  w = &(racache[FSDB(fss).rac - 1]);
+  rabufput(w->buf);
+  w->buf = NULL;
+  w->used = 0;
+  FSDB(fss).rac = 0;
+}
+
+/* attaches read-ahead data to fss: the window holds got bytes read from
+ * offset into b. the caller's reference to b goes to the window */
+static void rastore(unsigned short fss, struct srabuf *b, unsigned long offset, unsigned long got) {
+  struct sracache *w;
+  int i, victim = 0;
+  if (FSDB(fss).rac != 0) {
+    w = &(racache[FSDB(fss).rac - 1]);
+  } else {
+    /* pick a free window, or the least recently used one */
+    for (i = 0; i < RACACHESZ; i++) {
+      if (racache[i].used == 0) {
+        victim = i;
+        break;
+      }
+      if (racache[i].lastused < racache[victim].lastused) victim = i;
+    }
+    w = &(racache[victim]);
+    if (w->used != 0) radrop(w->fss);
+    w->fss = fss;
+    w->used = 1;
+    FSDB(fss).rac = (unsigned char)(victim + 1);
+  }
+  rabufput(w->buf);
+  w->buf = b;
+  w->start = offset;
+  w->len = got;
+  w->lastused = fdtick;
+  w->filled = time(NULL);
+}
+
+/* releases the space allocated past the end of the file open as c, if any.
+ * buffered data must be written out first */
+static void preallocdrop(struct sfdcache *c) {
+#if defined(__linux__)
+  struct stat st;
+  if (c->allocend == 0) return;
+  /* truncating to the current size frees the blocks past it, unlike
+   * punching a hole there, which ext4 ignores */
+  if ((fstat(c->fd, &st) == 0) && ((unsigned long)st.st_size < c->allocend)) {
+    if (ftruncate(c->fd, st.st_size) != 0) { /* the space stays allocated */ }
+  }
+#endif
+  c->allocend = 0;
+}
+
+/* notes that len bytes are about to be written at offset to the file open as
+ * c, and allocates space ahead if it is being appended to. the file's size
+ * is left alone, as all its readers expect */
+static void prealloc(struct sfdcache *c, unsigned long offset, unsigned short len) {
+#if defined(__linux__)
+  unsigned long end = offset + len, chunk;
+  struct stat st;
+  if (offset != c->wrnext) c->seqbytes = 0;
+  c->wrnext = end;
+  c->seqbytes += len;
+  if ((c->noprealloc != 0) || (c->seqbytes < PREALLOC_MIN) || (end <= c->allocend)) return;
+  if (c->allocend == 0) {
+    if (fstat(c->fd, &st) != 0) return;
+    c->allocend = st.st_size;
+    if (end <= c->allocend) return; /* overwrites data, nothing to allocate */
+  }
+  chunk = c->allocend;
+  if (chunk < PREALLOC_CHUNKMIN) chunk = PREALLOC_CHUNKMIN;
+  if (chunk > PREALLOC_CHUNKMAX) chunk = PREALLOC_CHUNKMAX;
+  if (fallocate(c->fd, FALLOC_FL_KEEP_SIZE, (off_t)c->allocend, (off_t)(end + chunk - c->allocend)) != 0) {
+    c->noprealloc = 1; /* not supported, or the disk is full */
+    return;
+  }
+  stats.prealloced += end + chunk - c->allocend;
+  c->allocend = end + chunk;
+#else
+  (void)c;
+  (void)offset;
+  (void)len;
+#endif
+}
+
+/* closes the cached file descriptor of fsdb slot fss, if any */
+static void fdclose(unsigned short fss) {
+  struct sfdcache *c;
+  radrop(fss);
+  wbflush(fss, 0);
+  if (FSDB(fss).fdc == 0) return;
+  c = &(fdcache[FSDB(fss).fdc - 1]);
+  preallocdrop(c);
+  close(c->fd);
+  c->used = 0;
+  FSDB(fss).fdc = 0;
+}
+
+/* returns an open file descriptor for fsdb slot fss, reusing a cached one
+ * when possible. if wr is non-zero the descriptor is opened read/write.
+ * other workers go on while the file is opened. returns -1 on error. */
+static int fdget(unsigned short fss, int wr) {
+  struct sfdcache *c;
+  char path[1024];
+  unsigned long id;
+  int i, fd, victim = 0;
+  if (!fsdbvalid(fss)) return(-1);
+  if (FSDB(fss).fdc != 0) {
+    c = &(fdcache[FSDB(fss).fdc - 1]);
+    if ((wr == 0) || (c->writable != 0)) {
+      c->lastused = ++fdtick;
+      return(c->fd);
+    }
+    fdclose(fss); /* read-only descriptor, reopen it for writing */
+  }
+  id = FSDB(fss).id;
+  fsdbpath(fss, path, sizeof(path));
+  fsyield();
+  fd = open(path, (wr != 0) ? O_RDWR : O_RDONLY);
+  fsresume();
+  if (fd < 0) return(-1);
+  /* the item may be gone meanwhile, or opened by another worker */
+  if (FSDB(fss).id != id) {
+    close(fd);
+    return(-1);
+  }
+  if (FSDB(fss).fdc != 0) {
+    c = &(fdcache[FSDB(fss).fdc - 1]);
+    if ((wr == 0) || (c->writable != 0)) {
+      close(fd);
+      c->lastused = ++fdtick;
+      return(c->fd);
+    }
+    fdclose(fss);
+  }
+  /* pick a free cache entry, or the least recently used one */
+  for (i = 0; i < FDCACHESZ; i++) {
+    if (fdcache[i].used == 0) {
+      victim = i;
+      break;
+    }
+    if (fdcache[i].lastused < fdcache[victim].lastused) victim = i;
+  }
+  c = &(fdcache[victim]);
+  if (c->used != 0) fdclose(c->fss);
+  c->fd = fd;
+  c->fss = fss;
+  c->used = 1;
+  c->writable = (wr != 0);
+  c->lastused = ++fdtick;
+  c->nextoff = ~0ul; /* nothing read yet */
+  c->wrnext = ~0ul;
+  c->seqbytes = 0;
+  c->allocend = 0;
+  c->noprealloc = 0;
+  FSDB(fss).fdc = (unsigned char)(victim + 1);
+  return(fd);
+}
+
+/* returns the hot file cache entry holding the content of fss, or NULL */
+static struct shotcache *hotof(unsigned short fss) {
+  struct shotcache *h;
+  if (FSDB(fss).hot == 0) return(NULL);
+  h = &(hotcache[FSDB(fss).hot - 1]);
+  /* the entry may have been evicted, or moved to another slot since */
+  if ((h->buf == NULL) || (h->fss != fss) || (h->id != FSDB(fss).id)) {
+    FSDB(fss).hot = 0;
+    return(NULL);
+  }
+  return(h);
+}
+
+/* returns non-zero if h holds the content of the file described by st */
+static int hotsame(const struct shotcache *h, const struct stat *st) {
+  return((h->dev == st->st_dev) && (h->ino == st->st_ino) && (h->mtime == st->st_mtime) && (h->size == (unsigned long)st->st_size));
+}
+
+/* evicts hot file cache entry h. answers still pointing to its content
+ * keep the mapping alive until they are done with it */
+static void hotfree(struct shotcache *h) {
+  hotbytes -= h->size;
+  rabufput(h->buf);
+  h->buf = NULL;
+}
+
+/* forgets the cached content of fss, if any */
+static void hotdrop(unsigned short fss) {
+  struct shotcache *h = hotof(fss);
+  if (h != NULL) hotfree(h);
+}
+
+/* serves a read of len bytes at offset of fss from the hot file cache, like
+ * readhit() does. returns -1 if the file is not cached, or changed */
+static long hothit(unsigned char *buff, unsigned short fss, unsigned long offset, unsigned short len, const unsigned char **data, void **ref) {
+  struct shotcache *h;
+  struct stat st;
+  char path[1024];
+  unsigned long id;
+  time_t now;
+  long res;
+  int err;
+  if (!fsdbvalid(fss)) return(-1);
+  h = hotof(fss);
+  if (h == NULL) return(-1);
+  if (h->immutable == 0) {
+    now = time(NULL);
+    if (now - h->checked >= HOT_MAXAGE) {
+      id = FSDB(fss).id;
+      fsdbpath(fss, path, sizeof(path));
+      fsyield();
+      err = stat(path, &st);
+      fsresume();
+      /* the entry may have been evicted meanwhile */
+      h = hotof(fss);
+      if ((h == NULL) || (FSDB(fss).id != id)) return(-1);
+      if ((err != 0) || !hotsame(h, &st)) {
+        hotfree(h);
+        return(-1);
+      }
+      h->checked = now;
+    }
+  }
+  stats.hothits++;
+  h->refbit = 1;
+  res = 0;
+  if (offset < h->size) res = h->size - offset;
+  if (res > len) res = len;
+  if (data != NULL) {
+    *data = RABUFDATA(h->buf) + offset;
+    *ref = h->buf;
+    h->buf->refs++;
+  } else {
+    memcpy(buff, RABUFDATA(h->buf) + offset, res);
+  }
+  return(res);
+}
+
+/* attaches to fss the entry holding the content of the file described by
+ * st, if there is one (the file may have been cached through another slot,
+ * or a slot since evicted). returns it, or NULL */
+static struct shotcache *hotfind(unsigned short fss, const struct stat *st) {
+  int i;
+  for (i = 0; i < HOTCACHESZ; i++) {
+    if ((hotcache[i].buf == NULL) || !hotsame(&(hotcache[i]), st)) continue;
+    hotcache[i].fss = fss;
+    hotcache[i].id = FSDB(fss).id;
+    FSDB(fss).hot = (unsigned short)(i + 1);
+    return(&(hotcache[i]));
+  }
+  return(NULL);
+}
+
+/* moves the CLOCK hand until there is room for size more bytes and a free
+ * entry to hold them, which is returned */
+static struct shotcache *hotroom(unsigned long size) {
+  struct shotcache *h, *room = NULL;
+  while ((room == NULL) || (hotbytes + size > hotlimit)) {
+    h = &(hotcache[hothand]);
+    hothand = (hothand + 1) % HOTCACHESZ;
+    if (h->buf != NULL) {
+      if (h->refbit != 0) {
+        h->refbit = 0;
+        continue;
+      }
+      hotfree(h);
+    }
+    if (room == NULL) room = h;
+  }
+  return(room);
+}
+
+/* returns non-zero if path is below a root given to fsimmutable() */
+static int hotimmutable(const char *path) {
+  size_t l;
+  int i;
+  for (i = 0; i < immcount; i++) {
+    l = strlen(immroots[i]);
+    if ((strncmp(path, immroots[i], l) == 0) && ((path[l] == '/') || (path[l] == 0))) return(1);
+  }
+  return(0);
+}
+
+/* loads the whole content of fss in the hot file cache, if the cache is
+ * enabled and the file is small enough. returns 0 if fss is cached then */
+static int hotload(unsigned short fss) {
+  struct shotcache *h;
+  struct srabuf *b;
+  struct stat st;
+  char path[1024];
+  unsigned long id, gen, done = 0;
+  ssize_t got;
+  int fd;
+
+  if (hotlimit == 0) return(-1);
+  /* other workers may go on meanwhile, like in readfileref() */
+  id = FSDB(fss).id;
+  gen = fsgen;
+  fsdbpath(fss, path, sizeof(path));
+  fsyield();
+  fd = open(path, O_RDONLY);
+  if ((fd >= 0) && (fstat(fd, &st) != 0)) {
+    close(fd);
+    fd = -1;
+  }
+  fsresume();
+  if (fd < 0) return(-1);
+  if ((FSDB(fss).id != id) || !S_ISREG(st.st_mode) || (st.st_size == 0) || ((unsigned long)st.st_size > hotlimit / HOTFILEDIV)) {
+    close(fd);
+    return(-1);
+  }
+  if (hotfind(fss, &st) != NULL) {
+    close(fd);
+    return(0);
+  }
+  b = mmap(NULL, sizeof(struct srabuf) + st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (b == MAP_FAILED) {
+    close(fd);
+    return(-1);
+  }
+  b->refs = 1;
+  b->mapsz = sizeof(struct srabuf) + st.st_size;
+
+  fsyield();
+  while (done < (unsigned long)st.st_size) {
+    got = pread(fd, RABUFDATA(b) + done, st.st_size - done, (off_t)done);
+    if (got <= 0) break;
+    done += got;
+  }
+  fsresume();
+  close(fd);
+  if ((done != (unsigned long)st.st_size) || (FSDB(fss).id != id) || (fsgen != gen)) {
+    rabufput(b);
+    return(-1);
+  }
+  /* another worker may have loaded it meanwhile */
+  if (hotfind(fss, &st) != NULL) {
+    rabufput(b);
+    return(0);
+  }
+
+  h = hotroom(st.st_size);
+  h->buf = b;
+  h->size = st.st_size;
+  h->dev = st.st_dev;
+  h->ino = st.st_ino;
+  h->mtime = st.st_mtime;
+  h->checked = time(NULL);
+  h->id = id;
+  h->fss = fss;
+  h->refbit = 0;
+  h->immutable = (unsigned char)hotimmutable(path);
+  hotbytes += h->size;
+  FSDB(fss).hot = (unsigned short)(h - hotcache + 1);
+  return(0);
+}
+
+/* copies path s into d (of size dsz), squeezing repeated slashes so the same
+ * item always maps to the same fsdb name. returns d, or s if it doesn't fit */
+static const char *fsdbnorm(char *d, size_t dsz, const char *s) {
+  size_t i, j = 0;
+  for (i = 0; s[i] != 0; i++) {
+    if ((s[i] == '/') && (s[i + 1] == '/')) continue;
+    if (j + 1 >= dsz) return(s);
+    d[j++] = s[i];
+  }
+  d[j] = 0;
+  return(d);
+}
+
+/* frees a FCB name index */
+static void nameidxfree(struct snameidx *x) {
+  if (x == NULL) return;
+  poolfree(x->buckets);
+  poolfree(x->ents);
+  poolfree(x->names);
+  poolfree(x);
+}
+
+/* frees the dir listing snapshot and name index of fsdb slot i */
+static void freedirlist(struct sfsdb *d) {
+  poolfree(d->dirlist);
+  d->dirlist = NULL;
+  nameidxfree(d->nameidx);
+  d->nameidx = NULL;
+}
+
+/* allocates an empty FCB name index, returns NULL if out of memory */
+static struct snameidx *nameidxnew(void) {
+  struct snameidx *x;
+  x = poolalloc(sizeof(struct snameidx));
+  if (x == NULL) return(NULL);
+  memset(x, 0, sizeof(struct snameidx));
+  x->cap = 64;
+  x->namescap = 1024;
+  x->ents = poolalloc(x->cap * sizeof(struct snameent));
+  x->names = poolalloc(x->namescap);
+  if ((x->ents == NULL) || (x->names == NULL)) {
+    nameidxfree(x);
+    return(NULL);
+  }
+  return(x);
+}
+
+/* adds host name name to index x. returns 0 on success */
+static int nameidxadd(struct snameidx *x, char *name, int isdir) {
+  unsigned long namelen = strlen(name) + 1;
+  struct snameent *newents;
+  char *newnames;
+  if (x->count == x->cap) {
+    newents = poolrealloc(x->ents, x->cap * 2 * sizeof(struct snameent));
+    if (newents == NULL) return(-1);
+    x->ents = newents;
+    x->cap *= 2;
+  }
+  if (x->namesused + namelen > x->namescap) {
+    newnames = poolrealloc(x->names, x->namescap * 2 + namelen);
+    if (newnames == NULL) return(-1);
+    x->names = newnames;
+    x->namescap = x->namescap * 2 + namelen;
+  }
+  filename2fcb(x->ents[x->count].fcbname, name);
+  x->ents[x->count].isdir = (isdir != 0);
+  x->ents[x->count].nameoff = x->namesused;
+  memcpy(x->names + x->namesused, name, namelen);
+  x->namesused += namelen;
+  x->count++;
+  return(0);
+}
+
+/* hash of a FCB name */
+static unsigned long fcbhash(const char *fcb) {
+  uint32_t h = 2166136261u;
+  int i;
+  for (i = 0; i < 11; i++) {
+    h ^= (unsigned char)fcb[i];
+    h *= 16777619u;
+  }
+  return(h ^ (h >> 16));
+}
+
+/* builds the hash buckets of index x once all entries are added. entries of
+ * a bucket are chained in directory order. returns 0 on success */
+static int nameidxfinish(struct snameidx *x) {
+  unsigned long n, b, sz = 16;
+  while (sz < x->count) sz <<= 1;
+  x->buckets = poolalloc(sz * sizeof(unsigned long));
+  if (x->buckets == NULL) return(-1);
+  x->hashmask = sz - 1;
+  for (b = 0; b < sz; b++) x->buckets[b] = NAMEIDX_NONE;
+  for (n = x->count; n-- > 0;) {
+    b = fcbhash(x->ents[n].fcbname) & x->hashmask;
+    x->ents[n].hnext = x->buckets[b];
+    x->buckets[b] = n;
+  }
+  return(0);
+}
+
+/* returns the first entry of index x named fcb (a directory if isdir is
+ * non-zero), or NAMEIDX_NONE */
+static unsigned long nameidxfind(struct snameidx *x, const char *fcb, int isdir) {
+  unsigned long n;
+  for (n = x->buckets[fcbhash(fcb) & x->hashmask]; n != NAMEIDX_NONE; n = x->ents[n].hnext) {
+    if (memcmp(x->ents[n].fcbname, fcb, 11) != 0) continue;
+    if ((isdir != 0) && (x->ents[n].isdir == 0)) continue;
+    return(n);
+  }
+  return(NAMEIDX_NONE);
+}
+
+/* returns the entry of index x with host name name, or NAMEIDX_NONE */
+static unsigned long nameidxhost(struct snameidx *x, char *name) {
+  char fcb[12];
+  unsigned long n;
+  filename2fcb(fcb, name);
+  for (n = x->buckets[fcbhash(fcb) & x->hashmask]; n != NAMEIDX_NONE; n = x->ents[n].hnext) {
+    if ((memcmp(x->ents[n].fcbname, fcb, 11) == 0) && (strcmp(x->names + x->ents[n].nameoff, name) == 0)) return(n);
+  }
+  return(NAMEIDX_NONE);
+}
+
+/* adds host name name to the finished index x, after the entries already in
+ * its bucket. returns 0 on success */
+static int nameidxinsert(struct snameidx *x, char *name, int isdir) {
+  unsigned long *link;
+  if (nameidxadd(x, name, isdir) != 0) return(-1);
+  link = &(x->buckets[fcbhash(x->ents[x->count - 1].fcbname) & x->hashmask]);
+  while (*link != NAMEIDX_NONE) link = &(x->ents[*link].hnext);
+  *link = x->count - 1;
+  x->ents[x->count - 1].hnext = NAMEIDX_NONE;
+  return(0);
+}
+
+/* builds a name index from count names, namesz bytes of NUL-terminated
+ * host names at names, along with their isdir bytes. returns NULL if they
+ * are corrupt or memory ran out */
+static struct snameidx *nameidxof(const unsigned char *isdir, const char *names, unsigned long count, unsigned long namesz) {
+  const char *name = names, *end = names + namesz;
+  char leaf[256];
+  struct snameidx *x = nameidxnew();
+  unsigned long n, len;
+  if (x == NULL) return(NULL);
+  for (n = 0; n < count; n++) {
+    len = (end > name) ? strnlen(name, end - name) : 0;
+    if ((len == 0) || (name + len >= end) || (len >= sizeof(leaf)) || (memchr(name, '/', len) != NULL) || (isdir[n] > 1)) break;
+    memcpy(leaf, name, len + 1);
+    if (nameidxadd(x, leaf, isdir[n]) != 0) break;
+    name += len + 1;
+  }
+  if ((n < count) || (name != end) || (nameidxfinish(x) != 0)) {
+    nameidxfree(x);
+    return(NULL);
+  }
+  return(x);
+}
+
+/* names read from a directory without fsmutex held, when the pool cannot be
+ * used: they make a name index with nameidxof() once it is held again. flags
+ * holds a byte per name */
+struct snamelist {
+  unsigned char *flags;
+  char *names;
+  unsigned long count, cap, namesz, namescap;
+};
+
+/* appends name, along with byte flag, to list l. returns 0 on success */
+static int namelistadd(struct snamelist *l, const char *name, unsigned char flag) {
+  unsigned long len = strlen(name) + 1;
+  unsigned char *newflags;
+  char *newnames;
+  if (l->count == l->cap) {
+    newflags = realloc(l->flags, l->cap * 2 + 64);
+    if (newflags == NULL) return(-1);
+    l->flags = newflags;
+    l->cap = l->cap * 2 + 64;
+  }
+  if (l->namesz + len > l->namescap) {
+    newnames = realloc(l->names, l->namescap * 2 + len + 1024);
+    if (newnames == NULL) return(-1);
+    l->names = newnames;
+    l->namescap = l->namescap * 2 + len + 1024;
+  }
+  l->flags[l->count++] = flag;
+  memcpy(l->names + l->namesz, name, len);
+  l->namesz += len;
+  return(0);
+}
+
+/* frees what list l holds */
+static void namelistfree(struct snamelist *l) {
+  free(l->flags);
+  free(l->names);
+  memset(l, 0, sizeof(*l));
+}
+
+/* FNV-1a hash of the len bytes long name of an item in directory slot
+ * parent, reduced to a fsdb bucket index */
+static unsigned short fsdbhashof(unsigned short parent, const char *s, size_t len) {
+  uint32_t h = 2166136261u;
+  h = (h ^ (parent & 0xff)) * 16777619u;
+  h = (h ^ (parent >> 8)) * 16777619u;
+  while (len-- > 0) {
+    h ^= (unsigned char)*s;
+    h *= 16777619u;
+    s++;
+  }
+  return((unsigned short)((h ^ (h >> 16)) & (FSDB_HASHSZ - 1)));
+}
+
+/* sets up empty hash buckets */
+static void fsdbinit(void) {
+  unsigned long i;
+  for (i = 0; i < FSDB_HASHSZ; i++) fsdbhash[i] = FSDB_NONE;
+  freehead = FSDB_NONE;
+  lruhead = FSDB_NONE;
+  lrutail = FSDB_NONE;
+  fsdbready = 1;
+}
+
+/* returns non-zero if i is a slot in use */
+static int fsdbvalid(unsigned short i) {
+  return((i < fsdbnext) && (FSDB(i).leaf != NULL));
+}
+
+/* writes the host path of slot i to buf (of size bufsz). returns buf, that
+ * is left empty if the path does not fit */
+static char *fsdbpath(unsigned short i, char *buf, size_t bufsz) {
+  unsigned short chain[FSDB_MAXDEPTH];
+  size_t len = 0, l;
+  int n = 0;
+  char *p = buf;
+  buf[0] = 0;
+  for (; i != FSDB_NONE; i = FSDB(i).parent) {
+    if (n == FSDB_MAXDEPTH) return(buf);
+    chain[n++] = i;
+    len += strlen(FSDB(i).leaf) + 1;
+  }
+  if (len >= bufsz) return(buf);
+  while (n-- > 0) {
+    *(p++) = '/';
+    l = strlen(FSDB(chain[n]).leaf);
+    memcpy(p, FSDB(chain[n]).leaf, l);
+    p += l;
+  }
+  *p = 0;
+  return(buf);
+}
+
+/* detaches slot i from the LRU list */
+static void lruunlink(unsigned short i) {
+  if (FSDB(i).lruprev != FSDB_NONE) {
+    FSDB(FSDB(i).lruprev).lrunext = FSDB(i).lrunext;
+  } else {
+    lruhead = FSDB(i).lrunext;
+  }
+  if (FSDB(i).lrunext != FSDB_NONE) {
+    FSDB(FSDB(i).lrunext).lruprev = FSDB(i).lruprev;
+  } else {
+    lrutail = FSDB(i).lruprev;
+  }
+}
+
+/* puts slot i at the head (most recently used end) of the LRU list */
+static void lrupush(unsigned short i) {
+  FSDB(i).lruprev = FSDB_NONE;
+  FSDB(i).lrunext = lruhead;
+  if (lruhead != FSDB_NONE) FSDB(lruhead).lruprev = i;
+  lruhead = i;
+  if (lrutail == FSDB_NONE) lrutail = i;
+}
+
+/* drops slot i from the hash index, the LRU list and returns it to the
+ * free list. i must not have children */
+static void fsdbdrop(unsigned short i) {
+  unsigned short *link = &(fsdbhash[fsdbhashof(FSDB(i).parent, FSDB(i).leaf, strlen(FSDB(i).leaf))]);
+  assert(FSDB(i).kids == 0);
+  while (*link != i) link = &(FSDB(*link).hnext);
+  *link = FSDB(i).hnext;
+  lruunlink(i);
+  fdclose(i);
+  if (FSDB(i).parent != FSDB_NONE) FSDB(FSDB(i).parent).kids--;
+  poolfree(FSDB(i).leaf);
+  freedirlist(&(FSDB(i)));
+  memset(&(FSDB(i)), 0, sizeof(struct sfsdb));
+  FSDB(i).lrunext = freehead;
+  freehead = i;
+  fsdbused--;
+}
+
+/* returns the least recently used slot without children. parents are
+ * always used more recently than their children (see fsdbtouch()), so
+ * this is the LRU tail most of the time. a slot whose data another worker
+ * writes out stays too, so that data lands before the file is used again */
+static unsigned short lruvictim(void) {
+  unsigned short i;
+  for (i = lrutail; (i != FSDB_NONE) && ((FSDB(i).kids != 0) || (wbflying(i) != 0)); i = FSDB(i).lruprev);
+  return(i);
+}
+
+/* returns a free slot, allocating a new shard or dropping the least
+ * recently used slot if needed. returns FSDB_NONE if out of memory */
+static unsigned short fsdbnew(void) {
+  unsigned short i;
+  if ((freehead == FSDB_NONE) && (fsdbnext < FSDB_SLOTS)) {
+    if ((fsdbnext % FSDB_SHARDSZ == 0) && (fsdbshards[fsdbnext / FSDB_SHARDSZ] == NULL)) {
+      fsdbshards[fsdbnext / FSDB_SHARDSZ] = calloc(FSDB_SHARDSZ, sizeof(struct sfsdb));
+    }
+    if (fsdbshards[fsdbnext / FSDB_SHARDSZ] != NULL) return((unsigned short)(fsdbnext++));
+  }
+  if (freehead == FSDB_NONE) {
+    i = lruvictim();
+    if (i == FSDB_NONE) return(FSDB_NONE);
+    fsdbdrop(i);
+  }
+  i = freehead;
+  freehead = FSDB(i).lrunext;
+  return(i);
+}
+
+/* returns the slot of the item named by the first len bytes of leaf in
+ * directory slot parent, or FSDB_NONE if not cached */
+static unsigned short fsdbfindin(unsigned short parent, const char *leaf, size_t len) {
+  unsigned short i;
+  for (i = fsdbhash[fsdbhashof(parent, leaf, len)]; i != FSDB_NONE; i = FSDB(i).hnext) {
+    if ((FSDB(i).parent == parent) && (strncmp(FSDB(i).leaf, leaf, len) == 0) && (FSDB(i).leaf[len] == 0)) return(i);
+  }
+  return(FSDB_NONE);
+}
+
+/* returns the fsdb slot of (absolute) path f, or FSDB_NONE if not cached */
+static unsigned short fsdbfind(const char *f) {
+  unsigned short i = FSDB_NONE;
+  const char *end;
+  if (*f != '/') return(FSDB_NONE);
+  for (;;) {
+    f++;
+    end = strchr(f, '/');
+    if (end == NULL) return(fsdbfindin(i, f, strlen(f)));
+    i = fsdbfindin(i, f, end - f);
+    if (i == FSDB_NONE) return(FSDB_NONE);
+    f = end;
+  }
+}
+
+/* closes the cached descriptor of the item at path f, if it is known, and
+ * forgets its cached content: it is being replaced or removed */
+static void fdclosepath(const char *f) {
+  char buf[1024];
+  unsigned short i;
+  if (fsdbready == 0) return;
+  i = fsdbfind(fsdbnorm(buf, sizeof(buf), f));
+  if (i == FSDB_NONE) return;
+  fdclose(i);
+  hotdrop(i);
+}
+
+/* bumps the name generation of directory slot dss, whose names ethersrv
+ * changed: its name index and the path translations found in it are no
+ * longer trusted */
+static void dirnamesbump(unsigned short dss) {
+  FSDB(diritems(dss)).namegen++;
+}
+
+/* dirnamesbump() for a change the name index of dss followed: the index
+ * stays current if it was. one that could not follow got spoiled (see
+ * dirspoil()) and is rescanned all the same */
+static void dirnamesfollowed(unsigned short dss) {
+  struct snameidx *x = FSDB(dss).nameidx;
+  int current = (x != NULL) && (x->gen == DIRNAMEGEN(dss));
+  dirnamesbump(dss);
+  if (current) x->gen = DIRNAMEGEN(dss);
+}
+
+/* notes that the items below directory slot dss may be known by other
+ * paths now, or went away along with it: the path translations found in
+ * dss and below are no longer trusted. name indexes stay current if they
+ * were, what they list did not change */
+static void dirmoved(unsigned short dss) {
+  unsigned short top = diritems(dss), i, j;
+  dirnamesfollowed(dss);
+  if (FSDB(top).kids == 0) return;
+  for (i = lruhead; i != FSDB_NONE; i = FSDB(i).lrunext) {
+    if (diritems(i) == top) continue; /* the "dir/" slot of a drive root */
+    for (j = FSDB(i).parent; (j != FSDB_NONE) && (j != top); j = FSDB(j).parent);
+    if (j != FSDB_NONE) dirnamesfollowed(i);
+  }
+}
+
+/* returns the fsdb slot of the item at host path p (a directory may be
+ * given with a trailing slash), or FSDB_NONE if not cached */
+static unsigned short fsdbfindpath(const char *p) {
+  char buf[1024];
+  size_t len;
+  if ((fsdbready == 0) || (fsdbnorm(buf, sizeof(buf), p) != buf)) return(FSDB_NONE);
+  len = strlen(buf);
+  while ((len > 1) && (buf[len - 1] == '/')) buf[--len] = 0;
+  return(fsdbfind(buf));
+}
+
+/* dirnamesbump() for host directory dir, if fsdb knows it */
+static void dirnamesbumpat(const char *dir) {
+  unsigned short i = fsdbfindpath(dir);
+  if (i != FSDB_NONE) dirnamesbump(i);
+}
+
+/* dirmoved() for the item at host path p, if fsdb knows it */
+static void dirmovedat(const char *p) {
+  unsigned short i = fsdbfindpath(p);
+  if (i != FSDB_NONE) dirmoved(i);
+}
+
+/* notes that ethersrv created, removed or renamed the item at host path p:
+ * the names of its directory changed, and what is below it moved if it is
+ * a directory that existed before */
+static void itemnamesbump(const char *p) {
+  char dir[1024];
+  const char *leaf = strrchr(p, '/');
+  if ((leaf != NULL) && (leaf != p) && ((size_t)(leaf - p) < sizeof(dir))) {
+    memcpy(dir, p, leaf - p);
+    dir[leaf - p] = 0;
+    dirnamesbumpat(dir);
+  }
+  dirmovedat(p);
+}
+
+/* gives slot i, an item of directory slot dir, the new name leaf. an item
+ * already known by that name (one that got removed, most likely) keeps it,
+ * then i is only closed like before a rename. returns 0 on success */
+static int fsdbrename(unsigned short i, unsigned short dir, char *leaf) {
+  unsigned short *link;
+  unsigned short h;
+  char *newleaf;
+  if (fsdbfindin(dir, leaf, strlen(leaf)) != FSDB_NONE) return(-1);
+  newleaf = poolstrndup(leaf, strlen(leaf));
+  if (newleaf == NULL) return(-1);
+  link = &(fsdbhash[fsdbhashof(dir, FSDB(i).leaf, strlen(FSDB(i).leaf))]);
+  while (*link != i) link = &(FSDB(*link).hnext);
+  *link = FSDB(i).hnext;
+  poolfree(FSDB(i).leaf);
+  FSDB(i).leaf = newleaf;
+  h = fsdbhashof(dir, leaf, strlen(leaf));
+  FSDB(i).hnext = fsdbhash[h];
+  fsdbhash[h] = i;
+  return(0);
+}
 
-  if (fsdb[firstfree].name == NULL) {
-    fprintf(stderr, "ERROR: OUT OF MEM!\n");
-    return(0xffffu);
+/* marks slot i and its parents as used at time now. parents go last, so
+ * they are always more recent than their children in the LRU list */
+static void fsdbtouch(unsigned short i, time_t now) {
+  for (; i != FSDB_NONE; i = FSDB(i).parent) {
+    FSDB(i).lastused = now;
+    lruunlink(i);
+    lrupush(i);
   }
-  fsdb[firstfree].lastused = now;
-  return(firstfree);
 }
 
+/* returns the "start sector" of a filesystem item, see getitemss() */
+static unsigned short lookupitem(char *path) {
+  unsigned short i = FSDB_NONE, j, h;
+  char buf[1024];
+  const char *f = fsdbnorm(buf, sizeof(buf), path), *end;
+  size_t len;
+  time_t now = time(NULL);
+
+  if (fsdbready == 0) fsdbinit();
+  if (*f != '/') return(0xffffu);
+
+  /* see if not already in cache */
+  i = fsdbfind(f);
+  if (i != FSDB_NONE) {
+    stats.fsdbhits++;
+    fsdbtouch(i, now);
+    return(i);
+  }
+
+  stats.fsdbmisses++;
+
+  /* purge a few entries that were not used for more than one hour, oldest
+   * first - this amortizes the cleanup over calls instead of scanning */
+  for (h = 0; h < FSDB_PURGEMAX; h++) {
+    j = lruvictim();
+    if ((j == FSDB_NONE) || ((now - FSDB(j).lastused) <= FSDB_MAXAGE)) break;
+    fsdbdrop(j);
+  }
+
+  /* register the item, along with any of its parents not known yet. the
+   * ones found are touched right away, so they cannot be dropped to make
+   * room for the others */
+  for (i = FSDB_NONE;;) {
+    f++;
+    end = strchr(f, '/');
+    len = (end != NULL) ? (size_t)(end - f) : strlen(f);
+    j = fsdbfindin(i, f, len);
+    if (j == FSDB_NONE) {
+      /* the parent counts its child already, so fsdbnew() leaves it alone */
+      if (i != FSDB_NONE) FSDB(i).kids++;
+      j = fsdbnew();
+      if ((j == FSDB_NONE) || ((FSDB(j).leaf = poolstrndup(f, len)) == NULL)) {
+        if (j != FSDB_NONE) {
+          FSDB(j).lrunext = freehead;
+          freehead = j;
+        }
+        if (i != FSDB_NONE) FSDB(i).kids--;
+        fprintf(stderr, "ERROR: OUT OF MEM!\n");
+        return(0xffffu);
+      }
+      FSDB(j).parent = i;
+      h = fsdbhashof(i, f, len);
+      FSDB(j).hnext = fsdbhash[h];
+      fsdbhash[h] = j;
+      FSDB(j).id = ++fsdbids;
+      FSDB(j).lastused = now;
+      lrupush(j);
+      fsdbused++;
+    } else {
+      fsdbtouch(j, now);
+    }
+    i = j;
+    if (end == NULL) break;
+    f = end;
+  }
+  fsdbtouch(i, now);
+  return(i);
+}
+
+unsigned short getitemss(char *path) {
+  unsigned long long t = tracebegin();
+  unsigned short res = lookupitem(path);
+  traceend(TRACE_ITEM, t, NULL);
+  return(res);
+}
+
+/* returns the host path of a filesystem item, valid until the next call */
 char *sstoitem(unsigned short ss) {
-  return(fsdb[ss].name);
+  static char buf[1024];
+  if (!fsdbvalid(ss)) return(NULL);
+  return(fsdbpath(ss, buf, sizeof(buf)));
 }
 
 /* turns a character c into its upper-case variant */
@@ -169,24 +1446,53 @@ void filename2fcb(char *d, char *s) {
   }
 }
 
-/* converts a time_t into a DWORD with DOS (FAT-style) timestamp bits */
+/* amount of minutes remembered by time2dos() (must be a power of 2) */
+#define TIME2DOSCACHESZ 64
+
+/* converts a time_t into a DWORD with DOS (FAT-style) timestamp bits.
+ * files in a directory tend to share timestamps, so the last few converted
+ * minutes are kept around to avoid calling localtime_r() over and over.
+ * this relies on UTC offsets being whole minutes, true for all dates that
+ * DOS can represent. directory scans run without fsmutex, so the cache has
+ * a lock of its own */
 static unsigned long time2dos(time_t t) {
+  static struct {
+    time_t minute;
+    unsigned long dostime; /* with seconds bits cleared */
+  } cache[TIME2DOSCACHESZ];
+  static pthread_mutex_t cachemutex = PTHREAD_MUTEX_INITIALIZER;
   unsigned long res;
-  struct tm *ltime;
-  ltime = localtime(&t);
-  if (ltime == NULL) return 0; /* Safety check */
+  unsigned int slot = 0;
+  struct tm ltime;
+
+  if (t >= 60) {
+    slot = (unsigned int)(t / 60) & (TIME2DOSCACHESZ - 1);
+    pthread_mutex_lock(&cachemutex);
+    res = (cache[slot].minute == t / 60) ? cache[slot].dostime : ~0ul;
+    pthread_mutex_unlock(&cachemutex);
+    if (res != ~0ul) return(res | ((t % 60) >> 1));
+  }
+
+  if (localtime_r(&t, &ltime) == NULL) return 0; /* Safety check */
   
-  res = ltime->tm_year - 80; /* tm_year is years from 1900 */
+  res = ltime.tm_year - 80; /* tm_year is years from 1900 */
   res <<= 4;
-  res |= ltime->tm_mon + 1; 
+  res |= ltime.tm_mon + 1; 
   res <<= 5;
-  res |= ltime->tm_mday;
+  res |= ltime.tm_mday;
   res <<= 5;
-  res |= ltime->tm_hour;
+  res |= ltime.tm_hour;
   res <<= 6;
-  res |= ltime->tm_min;
+  res |= ltime.tm_min;
   res <<= 5;
-  res |= (ltime->tm_sec >> 1); 
+
+  if (t >= 60) {
+    pthread_mutex_lock(&cachemutex);
+    cache[slot].minute = t / 60;
+    cache[slot].dostime = res;
+    pthread_mutex_unlock(&cachemutex);
+  }
+  res |= (ltime.tm_sec >> 1); 
   return(res);
 }
 
@@ -200,55 +1506,52 @@ static int matchfile2mask(char *msk, char *fil) {
 }
 
 
-/* provides DOS-like attributes for item i */
-unsigned char getitemattr(char *i, struct fileprops *fprops, unsigned char fatflag) {
+/* computes DOS-like attributes from the stat data of an item, filling fprops
+ * if not NULL. fname is the file name used for the FCB name, name is the
+ * item's path relative to the directory descriptor dfd (used for FAT
+ * attributes). */
+static unsigned char statattr(struct stat *statbuf, int dfd, const char *name, char *fname, struct fileprops *fprops, unsigned char fatflag) {
   uint32_t attr;
 #if !defined(__FreeBSD__) && !defined(__APPLE__)
   int fd;
 #endif
-  struct stat statbuf;
-  if (stat(i, &statbuf) != 0) return(0xff); /* error */
   
   /* zero out fprops and fill it out */
   if (fprops != NULL) {
-    char *fname = i;
-    char *ptr;
-    /* set fname to the file part of i */
-    for (ptr = i; *ptr != 0; ptr++) {
-      if (((*ptr == '/') || (*ptr == '\\')) && (*(ptr+1) != 0)) fname = ptr + 1;
-    }
     memset(fprops, 0, sizeof(struct fileprops));
-    fprops->ftime = time2dos(statbuf.st_mtime);
+    fprops->ftime = time2dos(statbuf->st_mtime);
     filename2fcb(fprops->fcbname, fname);
   }
   
   /* is this is a directory? */
-  if (S_ISDIR(statbuf.st_mode)) {
+  if (S_ISDIR(statbuf->st_mode)) {
     if (fprops != NULL) fprops->fattr = 16; /* ATTR_DIR */
     return(16);
   }
   
   /* not a directory, set size */
-  if (fprops != NULL) fprops->fsize = statbuf.st_size;
+  if (fprops != NULL) fprops->fsize = statbuf->st_size;
   
   /* if not a FAT drive, return a fake attribute of 0x20 (archive) */
   if (fatflag == 0) return(0x20);
   
 #if defined(__FreeBSD__) || defined(__APPLE__)
+  (void)dfd;
+  (void)name;
   {
     attr = 0;
-    if (statbuf.st_flags & UF_READONLY) attr |= 1;
-    if (statbuf.st_flags & UF_HIDDEN) attr |= 2;
-    if (statbuf.st_flags & UF_SYSTEM) attr |= 4;
-    if (statbuf.st_flags & UF_ARCHIVE) attr |= 32;
+    if (statbuf->st_flags & UF_READONLY) attr |= 1;
+    if (statbuf->st_flags & UF_HIDDEN) attr |= 2;
+    if (statbuf->st_flags & UF_SYSTEM) attr |= 4;
+    if (statbuf->st_flags & UF_ARCHIVE) attr |= 32;
 #else
   /* try to fetch DOS attributes by calling the FAT IOCTL API */
-  fd = open(i, O_RDONLY);
+  fd = openat(dfd, name, O_RDONLY);
   if (fd == -1) return(0xff);
   
   /* FIXED: Explicit cast to int to avoid overflow warning */
   if (ioctl(fd, (int)FAT_IOCTL_GET_ATTRIBUTES, &attr) < 0) {
-    /* fprintf(stderr, "Failed to fetch attributes of '%s'\n", i); */
+    /* fprintf(stderr, "Failed to fetch attributes of '%s'\n", name); */
     close(fd);
     return(0);
   } else {
@@ -259,6 +1562,23 @@ unsigned char getitemattr(char *i, struct fileprops *fprops, unsigned char fatfl
   }
 }
 
+/* provides DOS-like attributes for item i. other workers go on meanwhile */
+unsigned char getitemattr(char *i, struct fileprops *fprops, unsigned char fatflag) {
+  struct stat statbuf;
+  char *fname = i;
+  char *ptr;
+  unsigned char res = 0xff;
+  if (wbpending > 0) wbflushall(); /* so sizes are up to date */
+  /* set fname to the file part of i */
+  for (ptr = i; *ptr != 0; ptr++) {
+    if (((*ptr == '/') || (*ptr == '\\')) && (*(ptr+1) != 0)) fname = ptr + 1;
+  }
+  fsyield();
+  if (stat(i, &statbuf) == 0) res = statattr(&statbuf, AT_FDCWD, i, fname, fprops, fatflag);
+  fsresume();
+  return(res);
+}
+
 /* set attributes fattr on file i */
 int setitemattr(char *i, unsigned char fattr) {
   int res;
@@ -268,250 +1588,1172 @@ int setitemattr(char *i, unsigned char fattr) {
   if (fattr & 2)  flags |= UF_HIDDEN;
   if (fattr & 4)  flags |= UF_SYSTEM;
   if (fattr & 32) flags |= UF_ARCHIVE;
+  fsyield();
   res = chflags(i, flags);
+  fsresume();
 #else
-  int fd = open(i, O_RDONLY);
-  if (fd == -1) return(-1);
-  res = ioctl(fd, FAT_IOCTL_SET_ATTRIBUTES, &fattr);
-  close(fd);
+  int fd;
+  fsyield();
+  fd = open(i, O_RDONLY);
+  res = (fd == -1) ? -1 : ioctl(fd, FAT_IOCTL_SET_ATTRIBUTES, &fattr);
+  if (fd != -1) close(fd);
+  fsresume();
 #endif
+  fsgen++; /* once done, so what was read meanwhile is not kept */
   if (res < 0) return(-1);
   return(0);
 }
 
-/* generates a directory listing for *root */
-static long gendirlist(struct sfsdb *root, unsigned char fatflag) {
-  char fullpath[1024];
-  int fullpathoffset;
+/* fills stamp with the state st of a directory, at time now */
+static void dirstampof(struct sdirstamp *stamp, const struct stat *st, time_t now) {
+  stamp->scantime = now;
+  stamp->mtime = st->st_mtime;
+  stamp->ctime = st->st_ctime;
+  stamp->mnsec = STNSEC(st, m);
+  stamp->cnsec = STNSEC(st, c);
+  stamp->ino = st->st_ino;
+  stamp->exact = 0;
+}
+
+/* fills stamp with the state of the directory open as dfd */
+static int dirstampget(struct sdirstamp *stamp, int dfd, time_t now) {
+  struct stat statbuf;
+  if (fstat(dfd, &statbuf) != 0) return(-1);
+  dirstampof(stamp, &statbuf, now);
+  return(0);
+}
+
+/* tells whether a directory in state st looks the same as when stamp was
+ * taken */
+static int dirstampsame(const struct stat *st, const struct sdirstamp *stamp) {
+  if ((st->st_mtime != stamp->mtime) || (st->st_ctime != stamp->ctime) || (st->st_ino != stamp->ino)) return(0);
+  return((STNSEC(st, m) == stamp->mnsec) && (STNSEC(st, c) == stamp->cnsec));
+}
+
+/* tells whether directory dir looks the same as when stamp was taken. a scan
+ * taken within two seconds of the last change is not trusted, since another
+ * change in that time could leave the timestamps unchanged (FAT keeps mtimes
+ * with a 2s resolution). see dirrestamp() for exact stamps */
+static int dirstampok(const char *dir, struct sdirstamp *stamp) {
+  struct stat statbuf;
+  if (stat(dir, &statbuf) != 0) return(0);
+  if (dirstampsame(&statbuf, stamp) == 0) return(0);
+  if ((stamp->exact == 0) && ((stamp->scantime <= stamp->mtime + 1) || (stamp->scantime <= stamp->ctime + 1))) return(0);
+  return(1);
+}
+
+/* generates a directory listing for *root, stored as a single array of
+ * entries so FindNext can jump right to its position. the same pass also
+ * builds the directory's FCB name index. entries are looked up relative to
+ * the directory's descriptor, sparing a full path resolution. other workers
+ * go on during the scan: what it found is only kept if the slot still holds
+ * the same directory, and with the generations from before it */
+static long gendirlist(unsigned short dss, unsigned char fatflag) {
+  struct sfsdb *root = &(FSDB(dss));
+  char path[1024];
   struct dirent *diridx;
+  struct stat statbuf;
+  struct sdirstamp stamp;
+  struct snamelist names;
+  struct snameidx *nameidx = NULL;
+  struct fileprops *ents = NULL, *newents;
   DIR *dp;
-  struct sdirlist *lastnode = NULL, *newnode;
+  int dfd, opened = 0, noidx = 0;
+  unsigned long cap = 0, truncated = 0, id, gen, xgen;
   long res = 0;
+  time_t now = time(NULL);
+
+  if (wbpending > 0) wbflushall(); /* so sizes are up to date */
+  if (!fsdbvalid(dss)) return(-1);
+  memset(&names, 0, sizeof(names));
+  id = root->id;
+  gen = fsgen;
+  xgen = DIRNAMEGEN(dss);
+  fsdbpath(dss, path, sizeof(path));
+
+  fsyield();
+  dp = opendir(path);
+  if (dp != NULL) {
+    dfd = dirfd(dp);
+    opened = (dirstampget(&stamp, dfd, now) == 0);
+    /* FindNext positions are 16 bits, so is the listing size. entries past
+     * that still go to the name index, so they can be opened by name */
+    while ((opened != 0) && ((diridx = readdir(dp)) != NULL)) {
+      if (res >= 0xffff) {
+        if ((strcmp(diridx->d_name, ".") == 0) || (strcmp(diridx->d_name, "..") == 0)) continue;
+        if (truncated++ == 0) fprintf(stderr, "WARNING: '%s' holds more than 65535 entries, FindFirst does not list the others\n", path);
+        if ((noidx == 0) && (namelistadd(&names, diridx->d_name, (fstatat(dfd, diridx->d_name, &statbuf, 0) == 0) && S_ISDIR(statbuf.st_mode)) != 0)) noidx = 1;
+        continue;
+      }
+
+      /* grow the array when full */
+      if ((unsigned long)res == cap) {
+        newents = realloc(ents, (cap * 2 + 64) * sizeof(struct fileprops));
+        if (newents == NULL) {
+          fprintf(stderr, "ERROR: out of mem!");
+          break;
+        }
+        ents = newents;
+        cap = cap * 2 + 64;
+      }
+
+      /* skip entries that vanished meanwhile, or dangling links */
+      if (fstatat(dfd, diridx->d_name, &statbuf, 0) != 0) {
+        if ((noidx == 0) && (namelistadd(&names, diridx->d_name, 0) != 0)) noidx = 1;
+        continue;
+      }
+      statattr(&statbuf, dfd, diridx->d_name, diridx->d_name, &(ents[res]), fatflag);
+      res++;
+
+      /* '.' and '..' are not part of the name index */
+      if ((strcmp(diridx->d_name, ".") == 0) || (strcmp(diridx->d_name, "..") == 0)) continue;
+      if ((noidx == 0) && (namelistadd(&names, diridx->d_name, S_ISDIR(statbuf.st_mode)) != 0)) noidx = 1;
+    }
+    closedir(dp);
+  }
+  fsresume();
+
+  /* the slot may have been dropped meanwhile */
+  if ((opened == 0) || (root->id != id)) {
+    free(ents);
+    namelistfree(&names);
+    return(-1);
+  }
+  if (truncated != 0) stats.dirtrunc++;
+  freedirlist(root);
+  root->dirlist = poolalloc(sizeof(struct sdirlist) + res * sizeof(struct fileprops));
+  if (noidx == 0) nameidx = nameidxof(names.flags, names.names, names.count, names.namesz);
+  namelistfree(&names);
+  if (root->dirlist == NULL) {
+    fprintf(stderr, "ERROR: out of mem!");
+    nameidxfree(nameidx);
+    free(ents);
+    return(-1);
+  }
+  if (res > 0) memcpy(DIRLISTENTS(root->dirlist), ents, res * sizeof(struct fileprops));
+  free(ents);
+  root->dirlist->count = res;
+  root->dirlist->gen = gen;
+  root->dirlist->prefetched = 0;
+  root->dirlist->since = now;
+  root->dirlist->stamp = stamp;
+  if (nameidx != NULL) {
+    nameidx->gen = xgen;
+    nameidx->stamp = stamp;
+    root->nameidx = nameidx;
+  }
+  return(res);
+}
+
+/* tells whether the listing snapshot of *root still reflects the directory:
+ * ethersrv did not change anything since, the directory looks the same and
+ * the snapshot is not too old */
+static int dirlistfresh(unsigned short dss) {
+  struct sdirlist *d = FSDB(dss).dirlist;
+  char path[1024];
+  time_t now = time(NULL);
+  if (d->gen != fsgen) return(0);
+  if ((now < d->since) || (now - d->since > DIRLIST_MAXAGE)) return(0);
+  return(dirstampok(fsdbpath(dss, path, sizeof(path)), &(d->stamp)));
+}
+
+/* returns the FCB name index of directory *root, (re)building it from
+ * the directory's entries if needed. other workers go on during the scan,
+ * like in gendirlist(). returns NULL on error */
+static struct snameidx *getnameidx(unsigned short dss) {
+  struct sfsdb *root = &(FSDB(dss));
+  char path[1024];
+  struct snameidx *x = root->nameidx;
+  struct dirent *entry;
+  struct stat statbuf;
+  struct sdirstamp stamp;
+  struct snamelist names;
+  unsigned long id, gen;
+  DIR *dp;
+  int isdir, res = -1;
+
+  /* names only change along with the directory, no need for an age limit */
+  fsdbpath(dss, path, sizeof(path));
+  if ((x != NULL) && (x->gen == DIRNAMEGEN(dss)) && (dirstampok(path, &(x->stamp)) != 0)) return(x);
+
+  memset(&names, 0, sizeof(names));
+  id = root->id;
+  gen = DIRNAMEGEN(dss);
+  fsyield();
+  dp = opendir(path);
+  if (dp != NULL) {
+    res = dirstampget(&stamp, dirfd(dp), time(NULL));
+    while ((res == 0) && ((entry = readdir(dp)) != NULL)) {
+      if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0)) continue;
+      /* d_type spares a stat() most of the time */
+      if ((entry->d_type == DT_UNKNOWN) || (entry->d_type == DT_LNK)) {
+        isdir = (fstatat(dirfd(dp), entry->d_name, &statbuf, 0) == 0) && S_ISDIR(statbuf.st_mode);
+      } else {
+        isdir = (entry->d_type == DT_DIR);
+      }
+      res = namelistadd(&names, entry->d_name, (unsigned char)isdir);
+    }
+    closedir(dp);
+  }
+  fsresume();
+
+  /* the slot may have been dropped meanwhile */
+  x = NULL;
+  if ((res == 0) && (root->id == id)) x = nameidxof(names.flags, names.names, names.count, names.namesz);
+  namelistfree(&names);
+  if (x == NULL) return(NULL);
+  x->gen = gen;
+  x->stamp = stamp;
+  nameidxfree(root->nameidx);
+  root->nameidx = x;
+  return(x);
+}
+
+/* returns the fsdb slot of directory dir (given with or without a trailing
+ * slash), registering it if needed. returns FSDB_NONE on error */
+static unsigned short dirslot(const char *dir) {
+  char key[1024];
+  size_t len = strlen(dir);
+  unsigned short dss;
+  if (len >= sizeof(key)) return(FSDB_NONE);
+  memcpy(key, dir, len + 1);
+  /* fsdb knows directories without a trailing slash, except the root one */
+  if (fsdbready != 0) {
+    dss = fsdbfind(fsdbnorm(key, sizeof(key), key));
+    if (dss != FSDB_NONE) return(dss);
+  }
+  len = strlen(key);
+  if ((len > 1) && (key[len - 1] == '/')) {
+    key[len - 1] = 0;
+    if (fsdbready != 0) {
+      dss = fsdbfind(key);
+      if (dss != FSDB_NONE) return(dss);
+    }
+  }
+  return(getitemss(key));
+}
+
+/* searches for file matching the FCB-style template */
+int findfile(struct fileprops *f, unsigned short dss, char *fcbtmpl, unsigned char attr, unsigned short *nth, int flags) {
+  unsigned long n;
+  struct fileprops *ent;
+
+  if (!fsdbvalid(dss)) return(-1);
   
-  freedirlist(root->dirlist);
-  root->dirlist = NULL; /* Ensure root pointer is cleared */
-  
-  dp = opendir(root->name);
-  if (dp == NULL) return(-1);
-  
-  fullpathoffset = sprintf(fullpath, "%s/", root->name);
+  /* FindFirst rescans the directory unless its cached listing is still
+   * valid, FindNext always iterates over the listing FindFirst used */
+  if (((*nth == 0) && ((FSDB(dss).dirlist == NULL) || (dirlistfresh(dss) == 0))) || (FSDB(dss).dirlist == NULL)) {
+    time_t oldmtime = 0, oldctime = 0;
+    long count;
+    stats.dirmisses++;
+    if (FSDB(dss).dirlist != NULL) {
+      oldmtime = FSDB(dss).dirlist->stamp.mtime;
+      oldctime = FSDB(dss).dirlist->stamp.ctime;
+    }
+    count = gendirlist(dss, flags & FFILE_ISFAT);
+    if (count < 0) {
+      /* fprintf(stderr, "Error: failed to scan dir '%s'\n", sstoitem(dss)); */
+      return(-1);
+    }
+    /* if someone else changed the directory, remembered path translations
+     * in it and below may be stale as well */
+    if ((oldmtime != 0) && ((oldmtime != FSDB(dss).dirlist->stamp.mtime) || (oldctime != FSDB(dss).dirlist->stamp.ctime))) dirmoved(dss);
+  } else if (*nth == 0) {
+    stats.dirhits++;
+  }
   
-  for (;;) {
-    diridx = readdir(dp);
-    if (diridx == NULL) break;
+  /* *nth is the amount of entries already iterated over */
+  for (n = *nth; n < FSDB(dss).dirlist->count; n++) {
+    ent = &(DIRLISTENTS(FSDB(dss).dirlist)[n]);
     
-    newnode = calloc(1, sizeof(struct sdirlist));
-    if (newnode == NULL) {
-      fprintf(stderr, "ERROR: out of mem!");
-      break;
-    }
+    if (ent->fattr == DIRENT_GONE) continue;
+    if ((ent->fcbname[0] == '.') && (flags & FFILE_ISROOT)) continue;
+
+    if (matchfile2mask(fcbtmpl, ent->fcbname) != 0) continue;
     
-    /* Ensure we don't overflow the buffer */
-    if (fullpathoffset + strlen(diridx->d_name) < 1023) {
-        sprintf(fullpath + fullpathoffset, "%s", diridx->d_name);
-        getitemattr(fullpath, &(newnode->fprops), fatflag);
+    /* Attributes logic */
+    if (attr == 0x08) { /* I want VOL */
+      if ((ent->fattr & 0x08) == 0) continue;
+    } else { 
+      if ((attr | (ent->fattr & 0x16)) != attr) continue;
     }
     
-    /* add new node to linked list */
-    if (lastnode == NULL) {
-      root->dirlist = newnode;
+    *nth = (unsigned short)(n + 1);
+    memcpy(f, ent, sizeof(struct fileprops));
+    return(0);
+  }
+  return(-1);
+}
+
+
+/* creates or truncates a file f in directory d */
+int createfile(struct fileprops *f, char *d, char *fn, unsigned char attr, unsigned char fatflag) {
+  char fullpath[512];
+  FILE *fd;
+  sprintf(fullpath, "%s/%s", d, fn);
+  fdclosepath(fullpath);
+  /* try to create/truncate the file */
+  fsyield();
+  fd = fopen(fullpath, "wb");
+  if (fd != NULL) fclose(fd);
+  fsresume();
+  fsgen++;
+  itemnamesbump(fullpath);
+  if (fd == NULL) return(-1);
+  /* set attribs (only if FAT drive) */
+  if (fatflag != 0) {
+    if (setitemattr(fullpath, attr) != 0) {
+        /* fprintf(stderr, "Error: failed to set attribute %02Xh to '%s'\n", attr, fullpath); */
+    }
+  }
+  /* collect and set attributes */
+  getitemattr(fullpath, f, fatflag);
+  return(0);
+}
+
+
+/* returns disks total size in bytes */
+unsigned long long diskinfo(char *path, unsigned long long *dfree) {
+  struct statvfs buf;
+  unsigned long long res;
+  int err;
+  fsyield();
+  err = statvfs(path, &buf);
+  fsresume();
+  if (err != 0) return(0);
+  res = buf.f_blocks;
+  res *= buf.f_frsize;
+  *dfree = buf.f_bfree;
+  *dfree *= buf.f_bsize;
+  return(res);
+}
+
+/* try to create directory. the generations are bumped once it is done, so
+ * what other workers cached meanwhile is not trusted */
+int makedir(char *d) {
+  int res;
+  fsyield();
+  res = mkdir(d, 0);
+  fsresume();
+  fsgen++;
+  itemnamesbump(d);
+  return(res);
+}
+
+/* try to remove directory, see makedir() */
+int remdir(char *d) {
+  int res;
+  fsyield();
+  res = rmdir(d);
+  fsresume();
+  fsgen++;
+  itemnamesbump(d);
+  return(res);
+}
+
+/* change to directory d */
+int changedir(char *d) {
+  int res;
+  fsyield();
+  res = chdir(d);
+  fsresume();
+  return(res);
+}
+
+/* serves a read of len bytes at offset of fss from its read-ahead window,
+ * like readfileref() does. returns -1 if the window does not cover it */
+static long readhit(unsigned char *buff, unsigned short fss, unsigned long offset, unsigned short len, const unsigned char **data, void **ref) {
+  struct sracache *w;
+  time_t now;
+  long res = len;
+  if (FSDB(fss).rac == 0) return(-1);
+  w = &(racache[FSDB(fss).rac - 1]);
+  /* a window shorter than RAWINDOW ended at EOF when it was read, but the
+   * file may have grown since: reads reaching past it go to the file */
+  if ((offset < w->start) || (offset + len > w->start + w->len)) return(-1);
+  now = time(NULL);
+  if ((now < w->filled) || (now - w->filled >= RA_MAXAGE)) {
+    radrop(fss);
+    return(-1);
+  }
+  stats.rahits++;
+  if (data != NULL) {
+    *data = RABUFDATA(w->buf) + (offset - w->start);
+    *ref = w->buf;
+    w->buf->refs++;
+  } else {
+    memcpy(buff, RABUFDATA(w->buf) + (offset - w->start), res);
+  }
+  w->lastused = fdtick;
+  fdcache[FSDB(fss).fdc - 1].nextoff = offset + res;
+  return(res);
+}
+
+/* completes a read of len bytes at offset of fss, for which got bytes
+ * (or an error, if negative) were read into rabuf (if not NULL) or buff.
+ * rabuf holds RAWINDOW bytes if window is non-zero. id and gen are the
+ * slot's id and fsgen from when the read started: the data is only kept
+ * in the read-ahead cache if nothing changed meanwhile. the caller's
+ * reference to rabuf is consumed */
+static long readdone(unsigned char *buff, unsigned short fss, unsigned long offset, unsigned short len, const unsigned char **data, void **ref,
+                     struct srabuf *rabuf, int window, long got, unsigned long id, unsigned long gen) {
+  long res = got;
+  if (got < 0) {
+    rabufput(rabuf);
+    return(got);
+  }
+  if (rabuf != NULL) {
+    if (res > len) res = len;
+    if (data != NULL) {
+      *data = RABUFDATA(rabuf);
+      *ref = rabuf;
+      rabuf->refs++;
+    } else {
+      memcpy(buff, RABUFDATA(rabuf), res);
+    }
+    if ((window != 0) && (FSDB(fss).id == id) && (fsgen == gen)) {
+      rastore(fss, rabuf, offset, got);
     } else {
-      lastnode->next = newnode;
+      rabufput(rabuf);
     }
-    lastnode = newnode;
-    res++;
   }
-  closedir(dp);
+  if ((FSDB(fss).id == id) && (FSDB(fss).fdc != 0)) fdcache[FSDB(fss).fdc - 1].nextoff = offset + res;
+  return(res);
+}
+
+/* reads len bytes from file. if data is not NULL and the bytes sit in a
+ * read-ahead buffer, they are not copied to buff: *data points to them and
+ * *ref gets a reference to the buffer. otherwise *data is set to buff and
+ * *ref to NULL */
+long readfileref(unsigned char *buff, unsigned short fss, unsigned long offset, unsigned short len, const unsigned char **data, void **ref) {
+  struct srabuf *rabuf = NULL;
+  unsigned long id, gen;
+  long res;
+  int fd;
+  if (data != NULL) {
+    *data = buff;
+    *ref = NULL;
+  }
+  res = hothit(buff, fss, offset, len, data, ref);
+  if (res >= 0) return(res);
+  if (!fsdbvalid(fss)) return(-1);
+  wbflush(fss, 1);
+  fd = fdget(fss, 0);
+  if (fd < 0) return(-1);
+  /* files get into the hot file cache when read from their start, which
+   * is what loading a program or opening a data file does */
+  if (hotlimit != 0) {
+    stats.hotmisses++;
+    if ((offset == 0) && (hotload(fss) == 0)) {
+      res = hothit(buff, fss, offset, len, data, ref);
+      if (res >= 0) return(res);
+    }
+    fd = fdget(fss, 0); /* may have been closed meanwhile */
+    if (fd < 0) return(-1);
+  }
+  res = readhit(buff, fss, offset, len, data, ref);
+  if (res >= 0) return(res);
+  stats.ramisses++;
+
+  /* a read that continues where the previous one stopped is treated as a
+   * sequential stream: prefetch a whole window for the next frames */
+  if (offset == fdcache[FSDB(fss).fdc - 1].nextoff) rabuf = rabufget();
+
+  /* other workers may go on while this one waits for the disk. the
+   * descriptor is duplicated since the cached one may get closed meanwhile,
+   * and results are only kept if nothing changed in between */
+  id = FSDB(fss).id;
+  gen = fsgen;
+  if (fsworkers != 0) {
+    fd = dup(fd);
+    if (fd < 0) {
+      rabufput(rabuf);
+      return(-1);
+    }
+    pthread_mutex_unlock(&fsmutex);
+  }
+  if (rabuf != NULL) {
+    res = pread(fd, RABUFDATA(rabuf), RAWINDOW, (off_t)offset);
+  } else {
+    res = pread(fd, buff, len, (off_t)offset);
+  }
+  if (fsworkers != 0) {
+    close(fd);
+    pthread_mutex_lock(&fsmutex);
+  }
+  return(readdone(buff, fss, offset, len, data, ref, rabuf, 1, res, id, gen));
+}
+
+
+/* an asynchronous read in flight (see readfileasync()) */
+struct sasyncread {
+  struct srabuf *rabuf;  /* where data is read to */
+  void *cookie;
+  unsigned long offset;
+  unsigned long id, gen; /* FSDB(fss).id and fsgen at submission */
+  unsigned short fss;
+  unsigned short len;
+  int fd;                /* duplicate of the cached descriptor */
+  int window;            /* non-zero for a whole read-ahead window */
+};
+
+/* io_uring descriptor, or -1 when reads are synchronous */
+static int asyncfd = -1;
+static int inflight; /* amount of asynchronous reads submitted */
+
+int readasyncinit(void) {
+  asyncfd = uringinit(ASYNCREADS);
+  return(asyncfd);
+}
+
+long readfileasync(unsigned char *buff, unsigned short fss, unsigned long offset, unsigned short len, const unsigned char **data, void **ref, void *cookie) {
+  struct sasyncread *r;
+  long res;
+  int fd;
+  if ((asyncfd < 0) || (inflight >= ASYNCREADS)) return(readfileref(buff, fss, offset, len, data, ref));
+  *data = buff;
+  *ref = NULL;
+  res = hothit(buff, fss, offset, len, data, ref);
+  if (res >= 0) return(res);
+  /* loading a file in the hot file cache is synchronous */
+  if ((hotlimit != 0) && (offset == 0)) return(readfileref(buff, fss, offset, len, data, ref));
+  if (!fsdbvalid(fss)) return(-1);
+  wbflush(fss, 1);
+  fd = fdget(fss, 0);
+  if (fd < 0) return(-1);
+  res = readhit(buff, fss, offset, len, data, ref);
+  if (res >= 0) return(res);
+  if (hotlimit != 0) stats.hotmisses++;
+
+  /* the data goes to a read-ahead buffer: buff may be gone by the time the
+   * read completes */
+  r = malloc(sizeof(struct sasyncread));
+  if (r == NULL) return(readfileref(buff, fss, offset, len, data, ref));
+  r->rabuf = rabufget();
+  r->fd = (r->rabuf != NULL) ? dup(fd) : -1;
+  r->window = (offset == fdcache[FSDB(fss).fdc - 1].nextoff);
+  if ((r->fd < 0) || (uringread(r->fd, RABUFDATA(r->rabuf), (r->window != 0) ? RAWINDOW : len, offset, r) != 0)) {
+    if (r->fd >= 0) close(r->fd);
+    rabufput(r->rabuf);
+    free(r);
+    return(readfileref(buff, fss, offset, len, data, ref));
+  }
+  stats.ramisses++;
+  r->cookie = cookie;
+  r->offset = offset;
+  r->id = FSDB(fss).id;
+  r->gen = fsgen;
+  r->fss = fss;
+  r->len = len;
+  inflight++;
+  return(FS_PENDING);
+}
+
+int readasyncdone(void **cookie, long *res, const unsigned char **data, void **ref) {
+  struct sasyncread *r;
+  void *ptr;
+  long got;
+  if (uringreap(&ptr, &got) == 0) return(0);
+  r = ptr;
+  inflight--;
+  close(r->fd);
+  *cookie = r->cookie;
+  *data = NULL;
+  *ref = NULL;
+  *res = readdone(NULL, r->fss, r->offset, r->len, data, ref, r->rabuf, r->window, got, r->id, r->gen);
+  free(r);
+  return(1);
+}
+
+/* drops a reference obtained from readfileref() */
+void readfileunref(void *ref) {
+  rabufput(ref);
+}
+
+
+/* reads len bytes from file */
+long readfile(unsigned char *buff, unsigned short fss, unsigned long offset, unsigned short len) {
+  return(readfileref(buff, fss, offset, len, NULL, NULL));
+}
+
+
+/* forgets the read-ahead and hot cached data of fss, stale after a write.
+ * done once the data is buffered or written: a read that started before
+ * notices the fsgen change */
+static void wrdone(unsigned short fss) {
+  radrop(fss);
+  hotdrop(fss);
+  fsgen++;
+}
+
+/* writes len bytes from buff to file */
+long writefile(unsigned char *buff, unsigned short fss, unsigned long offset, unsigned short len) {
+  struct sfdcache *c;
+#if defined(__linux__)
+  struct stat st;
+#endif
+  unsigned long id;
+  long res;
+  int fd;
+  /* if len is 0, then it means "truncate" or "extend" ! */
+  if (len == 0) {
+    /* DBG("truncate '%s' to %lu bytes\n", fname, offset); */
+    if (!fsdbvalid(fss)) return(-1);
+    wbflush(fss, 1);
+    fd = fdget(fss, 1);
+    if (fd < 0) return(-1);
+    wrdone(fss);
+    c = &(fdcache[FSDB(fss).fdc - 1]);
+    c->wrnext = ~0ul;
+#if defined(__linux__)
+    /* space for an extension is allocated for real, so the client learns
+     * right away if the disk is full and the file is not left sparse */
+    if ((fstat(fd, &st) == 0) && (offset > (unsigned long)st.st_size)) {
+      if (fallocate(fd, 0, st.st_size, (off_t)(offset - st.st_size)) == 0) {
+        if (offset > c->allocend) c->allocend = 0;
+        return(0);
+      }
+    }
+#endif
+    if (ftruncate(fd, (off_t)offset) != 0) { /* fprintf(stderr, "Error: truncate() failed\n"); */ }
+    /* a truncation frees everything past the new end */
+    if (offset < c->allocend) c->allocend = 0;
+    return(0);
+  }
+  /* otherwise do a regular write, buffered if possible. the client is told
+   * all went fine right away, errors of delayed writes are only logged */
+  /* DBG("write %u bytes into file '%s' at offset %lu\n", len, fname, offset); */
+  fd = fdget(fss, 1);
+  if (fd < 0) return(-1);
+  prealloc(&(fdcache[FSDB(fss).fdc - 1]), offset, len);
+  if (wbappend(fss, buff, offset, len) == 0) {
+    wrdone(fss);
+    return(len);
+  }
+  /* written right away then, after the data already buffered. other
+   * workers go on meanwhile, like in readfileref() */
+  wbflush(fss, 1);
+  fd = fdget(fss, 1);
+  if (fd < 0) return(-1);
+  id = FSDB(fss).id;
+  if (fsworkers != 0) {
+    fd = dup(fd);
+    if (fd < 0) return(-1);
+    pthread_mutex_unlock(&fsmutex);
+  }
+  res = pwrite(fd, buff, len, (off_t)offset);
+  if (fsworkers != 0) {
+    close(fd);
+    pthread_mutex_lock(&fsmutex);
+  }
+  if (FSDB(fss).id == id) wrdone(fss);
   return(res);
 }
 
-/* searches for file matching the FCB-style template */
-int findfile(struct fileprops *f, unsigned short dss, char *fcbtmpl, unsigned char attr, unsigned short *nth, int flags) {
-  int n = 0;
-  struct sdirlist *dirlist;
-  
-  if ((*nth == 0) || (fsdb[dss].dirlist == NULL)) {
-    long count = gendirlist(&(fsdb[dss]), flags & FFILE_ISFAT);
-    if (count < 0) {
-      /* fprintf(stderr, "Error: failed to scan dir '%s'\n", fsdb[dss].name); */
-      return(-1);
-    }
-  }
-  
-  for (dirlist = fsdb[dss].dirlist; dirlist != NULL; dirlist = dirlist->next) {
-    n++;
-    if (n <= *nth) continue;
-    
-    if ((dirlist->fprops.fcbname[0] == '.') && (flags & FFILE_ISROOT)) continue;
 
-    if (matchfile2mask(fcbtmpl, dirlist->fprops.fcbname) != 0) continue;
-    
-    /* Attributes logic */
-    if (attr == 0x08) { /* I want VOL */
-      if ((dirlist->fprops.fattr & 0x08) == 0) continue;
-    } else { 
-      if ((attr | (dirlist->fprops.fattr & 0x16)) != attr) continue;
-    }
-    break;
-  }
-  
-  if (dirlist != NULL) {
-    *nth = n;
-    memcpy(f, &(dirlist->fprops), sizeof(struct sdirlist));
-    return(0);
+/* writes out buffered data of file fss */
+void commitfile(unsigned short fss) {
+  if (!fsdbvalid(fss)) return;
+  wbflush(fss, 1);
+  /* the file is likely complete, give back what was allocated ahead */
+  if (FSDB(fss).fdc != 0) preallocdrop(&(fdcache[FSDB(fss).fdc - 1]));
+}
+
+
+/* writes out buffered data that waited for too long (or all if all != 0) */
+void flushwrites(int all) {
+  time_t now;
+  int i;
+  if (wbpending == 0) return;
+  now = time(NULL);
+  for (i = 0; i < WBCACHESZ; i++) {
+    /* those another worker writes out are on their way */
+    if ((wbcache[i].used == 0) || (wbcache[i].flushing != 0)) continue;
+    if ((all != 0) || (now - wbcache[i].since >= WBMAXAGE)) wbflush(wbcache[i].fss, 1);
+  }
+}
+
+
+/* drops any cached state (open descriptor...) of an open file */
+void closefile(unsigned short fss) {
+  if (!fsdbvalid(fss)) return;
+  fdclose(fss);
+}
+
+
+/* sets the memory limit of the hot file cache, evicting what does not fit */
+void hotcachesize(unsigned long bytes) {
+  int i;
+  hotlimit = bytes;
+  for (i = 0; (i < HOTCACHESZ) && (hotbytes > hotlimit); i++) {
+    if (hotcache[i].buf != NULL) hotfree(&(hotcache[i]));
   }
-  return(-1);
 }
 
 
-/* creates or truncates a file f in directory d */
-int createfile(struct fileprops *f, char *d, char *fn, unsigned char attr, unsigned char fatflag) {
-  char fullpath[512];
-  FILE *fd;
-  sprintf(fullpath, "%s/%s", d, fn);
-  /* try to create/truncate the file */
-  fd = fopen(fullpath, "wb");
-  if (fd == NULL) return(-1);
-  fclose(fd);
-  /* set attribs (only if FAT drive) */
-  if (fatflag != 0) {
-    if (setitemattr(fullpath, attr) != 0) {
-        /* fprintf(stderr, "Error: failed to set attribute %02Xh to '%s'\n", attr, fullpath); */
-    }
-  }
-  /* collect and set attributes */
-  getitemattr(fullpath, f, fatflag);
-  return(0);
+void fsimmutable(const char *root) {
+  if (immcount < 26) immroots[immcount++] = strdup(root);
 }
 
 
-/* returns disks total size in bytes */
-unsigned long long diskinfo(char *path, unsigned long long *dfree) {
-  struct statvfs buf;
-  unsigned long long res;
-  if (statvfs(path, &buf) != 0) return(0);
-  res = buf.f_blocks;
-  res *= buf.f_frsize;
-  *dfree = buf.f_bfree;
-  *dfree *= buf.f_bsize;
-  return(res);
+/* reports read-ahead cache statistics */
+void fscachestats(struct fscachestats *s) {
+  memcpy(s, &stats, sizeof(stats));
 }
 
-/* try to create directory */
-int makedir(char *d) {
-  return(mkdir(d, 0));
+void fsmemstats(struct fsmemstats *m) {
+  struct poolstats p;
+  poolstats(&p);
+  m->slots = fsdbused;
+  m->slotbytes = ((fsdbnext + FSDB_SHARDSZ - 1) / FSDB_SHARDSZ) * FSDB_SHARDSZ * sizeof(struct sfsdb) + sizeof(fsdbhash) + sizeof(fsdbshards);
+  m->poolbytes = p.chunkbytes + p.largebytes;
+  m->poolused = p.usedbytes;
+  m->hotbytes = hotbytes;
 }
 
-/* try to remove directory */
-int remdir(char *d) {
-  return(rmdir(d));
+
+/* serializes access to the fs layer */
+void fslock(void) {
+  pthread_mutex_lock(&fsmutex);
 }
 
-/* change to directory d */
-int changedir(char *d) {
-  return(chdir(d));
+void fsunlock(void) {
+  pthread_mutex_unlock(&fsmutex);
 }
 
-/* reads len bytes from file */
-long readfile(unsigned char *buff, unsigned short fss, unsigned long offset, unsigned short len) {
-  long res;
-  char *fname;
-  FILE *fd;
-  fname = fsdb[fss].name;
-  if (fname == NULL) return(-1);
-  fd = fopen(fname, "rb");
-  if (fd == NULL) return(-1);
-  if (fseek(fd, offset, SEEK_SET) != 0) {
-    fclose(fd);
-    return(-1);
+
+/* tells the fs layer whether it is used by several threads at once */
+void fsthreaded(int on) {
+  fsworkers = on;
+}
+
+
+/* returns the first entry of the listing of directory slot dss named fcb,
+ * a directory if isdir is non-zero or else a file, or NULL */
+static struct fileprops *dirlistent(unsigned short dss, const char *fcb, int isdir) {
+  struct fileprops *ent;
+  unsigned long n;
+  if (FSDB(dss).dirlist == NULL) return(NULL);
+  for (n = 0; n < FSDB(dss).dirlist->count; n++) {
+    ent = &(DIRLISTENTS(FSDB(dss).dirlist)[n]);
+    if ((ent->fattr == DIRENT_GONE) || (((ent->fattr & FAT_DIR) != 0) != (isdir != 0))) continue;
+    if (memcmp(ent->fcbname, fcb, 11) == 0) return(ent);
   }
-  res = fread(buff, 1, len, fd);
-  fclose(fd);
-  return(res);
+  return(NULL);
 }
 
+/* the slot the items of directory slot dss are registered under. drive
+ * roots are listed as "dir/", a slot of its own below the directory one */
+static unsigned short diritems(unsigned short dss) {
+  if ((FSDB(dss).leaf[0] == 0) && (FSDB(dss).parent != FSDB_NONE)) return(FSDB(dss).parent);
+  return(dss);
+}
 
-/* writes len bytes from buff to file */
-long writefile(unsigned char *buff, unsigned short fss, unsigned long offset, unsigned short len) {
-  long res;
-  char *fname;
-  FILE *fd;
-  fname = fsdb[fss].name;
-  if (fname == NULL) return(-1);
-  /* if len is 0, then it means "truncate" or "extend" ! */
-  if (len == 0) {
-    /* DBG("truncate '%s' to %lu bytes\n", fname, offset); */
-    if (truncate(fname, offset) != 0) { /* fprintf(stderr, "Error: truncate() failed\n"); */ }
-    return(0);
+/* forgets the file name, entry n of the name index x of directory slot dss,
+ * after it got removed: its entries are marked as gone in x and in the
+ * cached listing, its descriptor and content are dropped */
+static void dirforget(unsigned short dss, struct snameidx *x, unsigned long n, char *name) {
+  struct fileprops *ent;
+  unsigned short i;
+  i = fsdbfindin(diritems(dss), name, strlen(name));
+  if (i != FSDB_NONE) {
+    fdclose(i);
+    hotdrop(i);
   }
-  /* otherwise do a regular write */
-  /* DBG("write %u bytes into file '%s' at offset %lu\n", len, fname, offset); */
-  fd = fopen(fname, "r+b");
-  if (fd == NULL) return(-1);
-  if (fseek(fd, offset, SEEK_SET) != 0) {
-    /* DBG("fseek() to %lu failed!\n", offset); */
-    fclose(fd);
-    return(-1);
+  if (x == NULL) return;
+  ent = dirlistent(dss, x->ents[n].fcbname, 0);
+  if (ent != NULL) ent->fattr = DIRENT_GONE;
+  memset(x->ents[n].fcbname, 0, sizeof(x->ents[n].fcbname));
+}
+
+/* notes that item oldname, entry n of the name index x of directory slot
+ * dss (if x is not NULL), got renamed to newname in the same directory. its
+ * open descriptor and cached content stay valid, and so do the items below
+ * it if it is a directory. returns 0 on success, non-zero if x could not
+ * follow (and must be dropped) */
+static int dirrenamed(unsigned short dss, struct snameidx *x, unsigned long n, char *oldname, char *newname) {
+  struct fileprops *ent;
+  unsigned short i;
+  int isdir;
+  i = fsdbfindin(diritems(dss), oldname, strlen(oldname));
+  if ((i != FSDB_NONE) && (fsdbrename(i, diritems(dss), newname) != 0)) {
+    fdclose(i);
+    hotdrop(i);
   }
-  res = fwrite(buff, 1, len, fd);
-  fclose(fd);
+  if (x == NULL) return(0);
+  isdir = x->ents[n].isdir;
+  ent = dirlistent(dss, x->ents[n].fcbname, isdir);
+  if (ent != NULL) filename2fcb(ent->fcbname, newname);
+  memset(x->ents[n].fcbname, 0, sizeof(x->ents[n].fcbname));
+  return(nameidxinsert(x, newname, isdir));
+}
+
+/* splits host path p (copied to buf, of size bufsz) into its directory and
+ * its last component. returns the last component, or NULL if p is not an
+ * absolute path or does not fit */
+static char *splitpath(char *buf, size_t bufsz, const char *p) {
+  char *leaf;
+  if (strlen(p) >= bufsz) return(NULL);
+  strcpy(buf, p);
+  leaf = strrchr(buf, '/');
+  if ((leaf == NULL) || (leaf == buf)) return(NULL);
+  *(leaf++) = 0;
+  return(leaf);
+}
+
+/* the name index of host directory dir, and the slot holding it (in *dss).
+ * a wildcard operation needs it up to date (valid is set), a single file
+ * only has its entry fixed if the index is there already. the index stays
+ * attached to its slot and is updated along with the directory, so what is
+ * cached about other directories is left alone. the slot is the one
+ * FindFirst keeps the listing in, "dir/" for a drive root */
+static struct snameidx *dirindex(const char *dir, unsigned short *dss, int valid) {
+  char key[1024];
+  *dss = FSDB_NONE;
+  if (strlen(dir) + 2 > sizeof(key)) return(NULL);
+  sprintf(key, "%s/", dir);
+  *dss = dirslot(key);
+  if (*dss == FSDB_NONE) return(NULL);
+  return((valid != 0) ? getnameidx(*dss) : FSDB(*dss).nameidx);
+}
+
+/* drops the name index of directory slot dss, that could not follow the
+ * changes made to the directory */
+static void dirindexdrop(unsigned short dss) {
+  nameidxfree(FSDB(dss).nameidx);
+  FSDB(dss).nameidx = NULL;
+}
+
+/* makes the views of directory slot dss fail dirstampok() and dirstamps(),
+ * after a change they could not follow. unlike dropping it, this leaves the
+ * listing to a FindNext under way */
+static void dirspoil(unsigned short dss) {
+  if (FSDB(dss).dirlist != NULL) FSDB(dss).dirlist->stamp.ino = 0;
+  if (FSDB(dss).nameidx != NULL) FSDB(dss).nameidx->stamp.ino = 0;
+}
+
+/* begins a change of directory slot dss, during which other workers may go
+ * on. returns what dirchangeend() expects */
+static unsigned long dirchangebegin(unsigned short dss) {
+  return(++FSDB(dss).dirgen);
+}
+
+/* ends the change of directory slot dss that dirchangebegin() returned gen
+ * for. returns non-zero if no other change of it began or ended meanwhile,
+ * so the views updated along with this one may be restamped. a change
+ * spanning this one sees the bumps: it does not restamp, and spoils the
+ * views if it cannot update them */
+static int dirchangeend(unsigned short dss, unsigned long gen) {
+  return(FSDB(dss).dirgen++ == gen);
+}
+
+/* which cached views of directory slot dss still match host directory dir,
+ * before ethersrv changes it: DIRSTAMP_LIST for its listing, DIRSTAMP_IDX
+ * for its name index. only those get restamped by dirrestamp() */
+#define DIRSTAMP_LIST 1
+#define DIRSTAMP_IDX 2
+static int dirstamps(unsigned short dss, const char *dir) {
+  struct stat st;
+  int res = 0;
+  if ((dss == FSDB_NONE) || ((FSDB(dss).dirlist == NULL) && (FSDB(dss).nameidx == NULL))) return(0);
+  if (stat(dir, &st) != 0) return(0);
+  if ((FSDB(dss).dirlist != NULL) && (dirstampsame(&st, &(FSDB(dss).dirlist->stamp)) != 0)) res |= DIRSTAMP_LIST;
+  if ((FSDB(dss).nameidx != NULL) && (dirstampsame(&st, &(FSDB(dss).nameidx->stamp)) != 0)) res |= DIRSTAMP_IDX;
   return(res);
 }
 
+/* stamps again the views of directory slot dss (as told by dirstamps())
+ * that were updated along with the change ethersrv just made to host
+ * directory dir, so their next use needs no rescan. the two-second guard of
+ * dirstampok() cannot tell a later change within the same second on coarse
+ * timestamps: those views are left to fail it. sub-second timestamps show
+ * a later change (short of one within the same clock tick), so the new
+ * stamp is trusted right away */
+static void dirrestamp(unsigned short dss, const char *dir, int which) {
+  struct sdirstamp stamp;
+  struct stat st;
+  if ((which == 0) || (stat(dir, &st) != 0)) return;
+  if ((STNSEC(&st, m) == 0) && (STNSEC(&st, c) == 0)) return;
+  dirstampof(&stamp, &st, time(NULL));
+  stamp.exact = 1;
+  if (((which & DIRSTAMP_LIST) != 0) && (FSDB(dss).dirlist != NULL)) FSDB(dss).dirlist->stamp = stamp;
+  if (((which & DIRSTAMP_IDX) != 0) && (FSDB(dss).nameidx != NULL)) FSDB(dss).nameidx->stamp = stamp;
+}
+
+/* returns the DOS attributes of file name in directory dfd, 0xff on error */
+static unsigned char attrat(int dfd, char *name, unsigned char fatflag) {
+  struct stat st;
+  if (fstatat(dfd, name, &st, 0) != 0) return(0xff);
+  return(statattr(&st, dfd, name, name, NULL, fatflag));
+}
+
+/* wildcard operations leave hidden and system files alone, like DOS does */
+#define WILDSKIP (FAT_HID | FAT_SYS | FAT_DIR)
+
+/* the index entry of host name name in directory slot dss, looked up again
+ * after other workers went on, and the index it is in. returns NAMEIDX_NONE
+ * (and spoils the views of dss, that cannot follow) if not found */
+static unsigned long direntagain(unsigned short dss, char *name, struct snameidx **x) {
+  unsigned long n = NAMEIDX_NONE;
+  *x = FSDB(dss).nameidx;
+  if (*x != NULL) n = nameidxhost(*x, name);
+  if (n == NAMEIDX_NONE) dirspoil(dss);
+  return(n);
+}
 
-/* remove all files matching the pattern */
-int delfiles(char *pattern) {
-  unsigned int i, fileoffset = 0;
-  int ispattern = 0;
-  char patterncopy[512];
-  char dirnamefcb[12];
-  char *dir, *fil;
+/* remove all files matching the pattern. other workers go on while files
+ * are removed, the views of the directory are updated afterwards */
+int delfiles(char *pattern, unsigned char fatflag) {
+  int fixed, dfd;
+  char dir[512], path[1024];
+  char *fil, *name;
   char filfcb[12];
-  struct dirent *diridx;
-  DIR *dp;
-  
-  for (i = 0; pattern[i] != 0; i++) {
-    if (pattern[i] == '?') ispattern = 1;
-    if (pattern[i] == '/') fileoffset = i;
-    patterncopy[i] = pattern[i];
+  struct snameidx *x;
+  struct snamelist names;
+  unsigned short dss;
+  unsigned long n, i, id = 0, gen = 0;
+  unsigned char attr;
+  int removed = 0, denied = 0, stamps, res, same, alone;
+
+  fil = splitpath(dir, sizeof(dir), pattern);
+  if (fil == NULL) {
+    errno = ENOENT;
+    return(-1);
   }
-  patterncopy[i] = 0;
-  
-  if (ispattern == 0) {
-    if (unlink(pattern) != 0) {
+  x = dirindex(dir, &dss, strchr(fil, '?') != NULL);
+  stamps = dirstamps(dss, dir);
+
+  if (strchr(fil, '?') == NULL) {
+    if (dss != FSDB_NONE) {
+      id = FSDB(dss).id;
+      gen = dirchangebegin(dss);
+    }
+    fsyield();
+    res = unlink(pattern);
+    fsresume();
+    /* the slot may have been dropped meanwhile, its index replaced */
+    if ((dss != FSDB_NONE) && (FSDB(dss).id == id)) {
+      alone = dirchangeend(dss, gen);
+      if (res == 0) {
+        n = direntagain(dss, fil, &x);
+        dirforget(dss, (n != NAMEIDX_NONE) ? x : NULL, n, fil);
+        dirnamesfollowed(dss);
+        if ((n != NAMEIDX_NONE) && (alone != 0)) dirrestamp(dss, dir, stamps);
+      }
+    } else if (res == 0) {
+      fdclosepath(pattern);
+      itemnamesbump(pattern);
+    }
+    if (res != 0) {
       /* DBG("Error: failure to delete file '%s' (%s)\n", pattern, strerror(errno)); */
       return(-1);
     }
     return(1);
   }
-  
-  dir = patterncopy;
-  patterncopy[fileoffset] = 0;
-  fil = patterncopy + fileoffset + 1;
+
+  if (x == NULL) {
+    errno = ENOENT;
+    return(-1);
+  }
   filename2fcb(filfcb, fil);
-  
-  dp = opendir(dir);
-  if (dp == NULL) return(-1);
-  for (;;) {
-    diridx = readdir(dp);
-    if (diridx == NULL) break;
-    if (diridx->d_type == DT_DIR) continue;
-    
-    filename2fcb(dirnamefcb, diridx->d_name);
-    if (matchfile2mask(filfcb, dirnamefcb) == 0) {
-      char fname[512];
-      sprintf(fname, "%s/%s", dir, diridx->d_name);
-      if (unlink(fname) != 0) { /* fprintf(stderr, "failed to delete '%s'\n", fname); */ }
+
+  /* bytes of the mask before the first '?' must match exactly, check them
+   * first. the names are copied, x may change while the files get removed */
+  memset(&names, 0, sizeof(names));
+  for (fixed = 0; (fixed < 11) && (filfcb[fixed] != '?'); fixed++);
+  for (n = 0; n < x->count; n++) {
+    if ((x->ents[n].isdir != 0) || (x->ents[n].fcbname[0] == 0)) continue;
+    if ((memcmp(x->ents[n].fcbname, filfcb, fixed) != 0) || (matchfile2mask(filfcb, x->ents[n].fcbname) != 0)) continue;
+    if (namelistadd(&names, x->names + x->ents[n].nameoff, 0) != 0) {
+      namelistfree(&names);
+      errno = ENOMEM;
+      return(-1);
     }
   }
-  closedir(dp);
+  id = FSDB(dss).id;
+  gen = dirchangebegin(dss);
+
+  /* flags tell which names got removed */
+  fsyield();
+  dfd = open(dir, O_RDONLY | O_DIRECTORY);
+  for (i = 0, name = names.names; (dfd >= 0) && (i < names.count); i++, name += strlen(name) + 1) {
+    attr = attrat(dfd, name, fatflag);
+    if ((attr == 0xff) || (attr & WILDSKIP)) continue;
+    if ((attr & FAT_RO) || (unlinkat(dfd, name, 0) != 0)) {
+      /* fprintf(stderr, "failed to delete '%s'\n", name); */
+      denied++;
+      continue;
+    }
+    names.flags[i] = 1;
+    removed++;
+  }
+  if (dfd >= 0) close(dfd);
+  fsresume();
+
+  same = (FSDB(dss).id == id);
+  alone = (same != 0) && (dirchangeend(dss, gen) != 0);
+  for (i = 0, name = names.names; i < names.count; i++, name += strlen(name) + 1) {
+    if (names.flags[i] == 0) continue;
+    if (same == 0) {
+      /* without the slot, only the items removed are forgotten */
+      if (strlen(dir) + strlen(name) + 2 > sizeof(path)) continue;
+      sprintf(path, "%s/%s", dir, name);
+      fdclosepath(path);
+      continue;
+    }
+    n = direntagain(dss, name, &x);
+    if (n == NAMEIDX_NONE) alone = 0;
+    dirforget(dss, (n != NAMEIDX_NONE) ? x : NULL, n, name);
+  }
+  if ((removed > 0) && (same != 0)) dirnamesfollowed(dss);
+  if ((removed > 0) && (same == 0)) dirnamesbumpat(dir);
+  if ((removed > 0) && (alone != 0)) dirrestamp(dss, dir, stamps);
+  namelistfree(&names);
+  if (dfd < 0) return(-1);
+  if (removed > 0) return(removed);
+  errno = (denied > 0) ? EACCES : ENOENT;
+  return(-1);
+}
 
-  return(0);
+/* renames the files of the directory slot dss (open as dfd, name index x)
+ * matching FCB mask fcb1 after FCB mask fcb2, whose '?' keep the character
+ * of the original name. files with attributes in skip are left alone.
+ * returns the amount of files renamed, or -1 */
+static int renmask(int dfd, unsigned short dss, struct snameidx *x, const char *fcb1, const char *fcb2, unsigned char skip, unsigned char fatflag) {
+  unsigned long n, count = x->count;
+  char oldname[256], newname[13], newfcb[12];
+  unsigned char attr;
+  int i, renamed = 0, failed = 0;
+
+  for (n = 0; n < count; n++) {
+    if ((x->ents[n].isdir != 0) || (x->ents[n].fcbname[0] == 0)) continue;
+    if (matchfile2mask((char *)fcb1, x->ents[n].fcbname) != 0) continue;
+    if (strlen(x->names + x->ents[n].nameoff) >= sizeof(oldname)) continue;
+    strcpy(oldname, x->names + x->ents[n].nameoff); /* x->names may move */
+    for (i = 0; i < 11; i++) newfcb[i] = (fcb2[i] == '?') ? x->ents[n].fcbname[i] : fcb2[i];
+    fcbtodos(newname, newfcb);
+    attr = attrat(dfd, oldname, fatflag);
+    if ((attr == 0xff) || (attr & skip)) continue;
+    /* the new name must not be taken, whatever its case on the host */
+    if ((nameidxfind(x, newfcb, 0) != NAMEIDX_NONE) || (renameat(dfd, oldname, dfd, newname) != 0)) {
+      failed++;
+      continue;
+    }
+    renamed++;
+    if (dirrenamed(dss, x, n, oldname, newname) != 0) {
+      /* out of memory: the index cannot be trusted for the next ones */
+      dirindexdrop(dss);
+      break;
+    }
+  }
+  if (renamed > 0) return(renamed);
+  errno = (failed > 0) ? EACCES : ENOENT;
+  return(-1);
 }
 
-/* rename fn1 into fn2 */
-int renfile(char *fn1, char *fn2) {
-  return(rename(fn1, fn2));
+/* rename fn1 into fn2. a '?' in the last component of fn2 keeps the
+ * character of the name renamed (FCB style, REN A.TXT ?.BAK) */
+int renfile(char *fn1, char *fn2, unsigned char fatflag) {
+  char dir1[512], dir2[512], dst[512];
+  char *leaf1, *leaf2;
+  char fcb1[12], fcb2[12], newfcb[12];
+  struct snameidx *x;
+  unsigned short dss;
+  unsigned long n, id = 0, gen = 0;
+  int i, res, dfd, stamps, wild, alone;
+
+  leaf1 = splitpath(dir1, sizeof(dir1), fn1);
+  leaf2 = splitpath(dir2, sizeof(dir2), fn2);
+  wild = (leaf1 != NULL) && (strchr(leaf1, '?') != NULL);
+
+  /* moving an item elsewhere changes two directories, which get scanned
+   * again, and the paths of what is below it */
+  if ((leaf1 == NULL) || (leaf2 == NULL) || (strcmp(dir1, dir2) != 0)) {
+    if (wild != 0) {
+      errno = EXDEV;
+      return(-1);
+    }
+    if ((leaf2 != NULL) && (strchr(leaf2, '?') != NULL)) {
+      /* the mask is filled from the name renamed, which must not clobber
+       * an item of the destination, whatever its case on the host */
+      x = dirindex(dir2, &dss, 1);
+      if (x == NULL) return(-1);
+      filename2fcb(fcb1, leaf1);
+      filename2fcb(fcb2, leaf2);
+      for (i = 0; i < 11; i++) newfcb[i] = (fcb2[i] == '?') ? fcb1[i] : fcb2[i];
+      if (nameidxfind(x, newfcb, 0) != NAMEIDX_NONE) {
+        errno = EEXIST;
+        return(-1);
+      }
+      if (strlen(dir2) + 14 > sizeof(dst)) {
+        errno = ENAMETOOLONG;
+        return(-1);
+      }
+      sprintf(dst, "%s/", dir2);
+      fcbtodos(dst + strlen(dst), newfcb);
+      fn2 = dst;
+    }
+    fdclosepath(fn1);
+    fdclosepath(fn2);
+    fsyield();
+    res = rename(fn1, fn2);
+    fsresume();
+    fsgen++;
+    if (res == 0) {
+      itemnamesbump(fn1);
+      itemnamesbump(fn2);
+    }
+    return(res);
+  }
+
+  /* a plain name given a mask is renamed like the files matching a mask */
+  x = dirindex(dir1, &dss, (wild != 0) || (strchr(leaf2, '?') != NULL));
+  stamps = dirstamps(dss, dir1);
+  if ((wild == 0) && (strchr(leaf2, '?') == NULL)) {
+    if (dss != FSDB_NONE) {
+      id = FSDB(dss).id;
+      gen = dirchangebegin(dss);
+    }
+    fsyield();
+    res = rename(fn1, fn2);
+    fsresume();
+    /* the slot may have been dropped meanwhile, its index replaced */
+    if ((dss != FSDB_NONE) && (FSDB(dss).id == id)) {
+      alone = dirchangeend(dss, gen);
+      if (res == 0) {
+        /* what is below a directory renamed is known by other paths now */
+        dirmovedat(fn1);
+        dirmovedat(fn2);
+        n = direntagain(dss, leaf1, &x);
+        if (dirrenamed(dss, (n != NAMEIDX_NONE) ? x : NULL, n, leaf1, leaf2) != 0) dirindexdrop(dss);
+        dirnamesfollowed(dss);
+        /* without its index entry, the listing could not follow either */
+        if ((n != NAMEIDX_NONE) && (alone != 0)) dirrestamp(dss, dir1, stamps);
+      }
+    } else if (res == 0) {
+      fdclosepath(fn1);
+      itemnamesbump(fn1);
+      itemnamesbump(fn2);
+    }
+    return(res);
+  }
+
+  if (x == NULL) {
+    errno = ENOENT;
+    return(-1);
+  }
+  dfd = open(dir1, O_RDONLY | O_DIRECTORY);
+  if (dfd < 0) return(-1);
+  filename2fcb(fcb1, leaf1);
+  filename2fcb(fcb2, leaf2);
+  /* a single file is renamed whatever its attributes, like DOS does. the
+   * lock is kept: each name checked must see the renames done before it */
+  gen = dirchangebegin(dss);
+  res = renmask(dfd, dss, x, fcb1, fcb2, (wild != 0) ? WILDSKIP : FAT_DIR, fatflag);
+  close(dfd);
+  if (res > 0) dirnamesfollowed(dss);
+  if ((dirchangeend(dss, gen) != 0) && (res > 0)) dirrestamp(dss, dir1, stamps);
+  return((res < 0) ? -1 : 0);
 }
 
 /* checks if a path resides on a FAT filesystem */
@@ -532,103 +2774,658 @@ int isfat(char *d) {
 /* returns the size of an open file */
 long getfopsize(unsigned short fss) {
   struct fileprops fprops;
-  char *fname = fsdb[fss].name;
-  if (fname == NULL) return(-1);
-  if (getitemattr(fname, &fprops, 0) == 0xff) return(-1);
+  char fname[1024];
+  if (!fsdbvalid(fss)) return(-1);
+  wbflush(fss, 1);
+  if (getitemattr(fsdbpath(fss, fname, sizeof(fname)), &fprops, 0) == 0xff) return(-1);
   return(fprops.fsize);
 }
 
 
-/* shorttolong: Translates a DOS 8.3 path to a Linux long path (case-insensitive) */
-int shorttolong(char *dst, char *src, const char *root) {
-  int found = 0;
+/* returns the pathcache slot for DOS path p */
+static struct spathcache *pathcacheslot(const char *p) {
+  uint32_t h = 2166136261u;
+  while (*p != 0) {
+    h ^= (unsigned char)*p;
+    h *= 16777619u;
+    p++;
+  }
+  return(&(pathcache[(h ^ (h >> 16)) & (PATHCACHESZ - 1)]));
+}
 
-  char *writeptr = dst;
-  char *tmpdir = NULL;
-  char *tmpdir_next = NULL;
-  char to_find_fcb [12];
-  char tmp_fcb [12];
+/* tells whether the names of the directory a translation was found in
+ * (see struct spathdir) are still those it was found among */
+static int pathdirok(const struct spathdir *in) {
+  if (in->dss == FSDB_NONE) return(1);
+  return(fsdbvalid(in->dss) && (FSDB(in->dss).id == in->id) && (FSDB(in->dss).namegen == in->gen));
+}
 
-  struct dirent *entry;
-  DIR *dir;
+/* the spathdir of a name found in name index x of directory slot dss */
+static void pathdirof(struct spathdir *in, unsigned short dss, const struct snameidx *x) {
+  in->dss = diritems(dss);
+  in->id = FSDB(in->dss).id;
+  in->gen = x->gen;
+}
 
-  size_t root_len = strlen(root);
+/* returns the remembered host path of DOS path p, or NULL if unknown */
+static const char *pathcachefind(const char *p) {
+  struct spathcache *c = pathcacheslot(p);
+  time_t now;
+  if ((c->dos == NULL) || (strcmp(c->dos, p) != 0) || (pathdirok(&(c->in)) == 0)) return(NULL);
+  now = time(NULL);
+  if ((now < c->when) || (now - c->when > PATHCACHE_MAXAGE)) return(NULL);
+  return(c->host);
+}
+
+/* remembers that DOS path p translates to host path h, as found in the
+ * directory in. the lock is released during path walks, a translation
+ * found in names that changed meanwhile is not kept */
+static void pathcachestore(const char *p, const char *h, const struct spathdir *in) {
+  struct spathcache *c = pathcacheslot(p);
+  if (pathdirok(in) == 0) return;
+  poolfree(c->dos);
+  poolfree(c->host);
+  c->dos = poolstrndup(p, strlen(p));
+  c->host = poolstrndup(h, strlen(h));
+  if ((c->dos == NULL) || (c->host == NULL)) {
+    poolfree(c->dos);
+    poolfree(c->host);
+    c->dos = NULL;
+    c->host = NULL;
+    return;
+  }
+  c->in = *in;
+  c->when = time(NULL);
+}
+
+/* looks in host directory dir (with a trailing slash) for an entry whose FCB
+ * name is fcb, and appends its host name to dir. if isdir is non-zero, only
+ * directories qualify. *dss is the slot of dir if known, FSDB_NONE for it to
+ * be looked up (and registered if new). it is then set to the slot of the
+ * entry found, if it is known already, so a path walk does not go through
+ * the whole path for each of its directories. *in tells where the entry got
+ * found, for pathcachestore(). returns 0 on success. */
+static int dirlookup(char *dir, unsigned short *dss, const char *fcb, int isdir, struct spathdir *in) {
+  struct snameidx *x;
+  unsigned long n;
+  const char *name;
+
+  if (*dss == FSDB_NONE) *dss = dirslot(dir);
+  if (*dss == FSDB_NONE) return(-1);
+  fsdbtouch(*dss, time(NULL));
+  x = getnameidx(*dss);
+  if (x == NULL) {
+    DBG("ERROR: Failed to open directory %s", dir);
+    *dss = FSDB_NONE;
+    return(-1);
+  }
+  n = nameidxfind(x, fcb, isdir);
+  if (n == NAMEIDX_NONE) return(-1);
+  pathdirof(in, *dss, x);
+  name = x->names + x->ents[n].nameoff;
+  strcat(dir, name);
+  *dss = fsdbfindin(diritems(*dss), name, strlen(name));
+  return(0);
+}
 
-  to_find_fcb[11] = 0;  /* null terminate these */
-  tmp_fcb[11] = 0;
+/* shorttolong: Translates a DOS 8.3 path to a Linux long path (case-insensitive).
+ * translations of the path and of its parent directories are remembered, so
+ * a path that shares a prefix with a recent one only needs its remaining
+ * components to be looked up. */
+static int resolvelong(char *dst, char *src, const char *root) {
+  char dospath[1024];
+  char to_find_fcb[12];
+  char *key, *comp, *next;
+  const char *host;
+  size_t root_len = strlen(root);
+  size_t keylen, cut;
+  unsigned short dss = FSDB_NONE;
+  struct spathdir in;
 
   assert(strncmp(root, src, strlen(root)) == 0);
 
-  src += root_len;
-  writeptr += sprintf(dst, "%s/", root);
+  sprintf(dst, "%s/", root);
 
   /* CRITICAL FIX: Only print if debug requested (removed for performance) */
   /* printf("shorttolong: %s %s %s\n", dst, src, root); */
 
-  if (src[0] != '/') {
-    DBG("ERROR: invalid string for shorttolong encountered: '%s'\n", src);
+  if (src[root_len] != '/') {
+    DBG("ERROR: invalid string for shorttolong encountered: '%s'\n", src + root_len);
     return -1;
   }
 
-  src++;
-
-  /* get the first token */
-  tmpdir = strtok(src, "/");
+  /* the cache key is the DOS path with slashes squeezed and no trailing
+   * slash (except for the root directory itself) */
+  key = (char *)fsdbnorm(dospath, sizeof(dospath), src);
+  if (key != dospath) return -1; /* too long */
+  keylen = strlen(key);
+  while ((keylen > root_len + 1) && (key[keylen - 1] == '/')) key[--keylen] = 0;
+
+  host = pathcachefind(key);
+  if (host != NULL) {
+    strcpy(dst, host);
+    return 0;
+  }
 
-  /* walk through other tokens */
-  while (tmpdir != NULL) {
+  /* find the longest parent directory already translated */
+  cut = root_len;
+  for (next = key + keylen; next > key + root_len; next--) {
+    if (*next != '/') continue;
+    *next = 0;
+    host = pathcachefind(key);
+    *next = '/';
+    if (host != NULL) {
+      sprintf(dst, "%s/", host);
+      cut = next - key;
+      break;
+    }
+  }
 
-    tmpdir_next = strtok(NULL, "/");
+  /* walk through remaining components */
+  in.dss = FSDB_NONE; /* a drive root translates to itself */
+  comp = key + cut + 1;
+  while (*comp != 0) {
+    next = strchr(comp, '/');
+    if (next != NULL) *next = 0;
 
     /* Turn this back into an FCB string */
-    filename2fcb(to_find_fcb, tmpdir);
+    filename2fcb(to_find_fcb, comp);
 
-    /* Walk the current directory depicted by destination */
-    dir = opendir(dst);
-
-    if (dir == NULL) {
-      DBG("ERROR: Failed to open directory %s", dst);
+    if (dirlookup(dst, &dss, to_find_fcb, next != NULL, &in) != 0) {
+      /* Print the raw version as is to the destination string */
+      strcat(dst, comp);
       return -1;
     }
 
-    found = 0;
+    if (next == NULL) break;
+    pathcachestore(key, dst, &in);
+    *next = '/';
+    /* it is a directory, so we must append a / to our destination */
+    strcat(dst, "/");
+    comp = next + 1;
+  }
 
-    while (!found && (entry = readdir(dir)) != NULL) {
-      if ((strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0))
-        continue;
+  pathcachestore(key, dst, &in);
+  return 0;
+}
 
-      /* get FCB name for this */
-      filename2fcb(tmp_fcb, entry->d_name);
+int shorttolong(char *dst, char *src, const char *root) {
+  unsigned long long t = tracebegin();
+  int res = resolvelong(dst, src, root);
+  traceend(TRACE_PATH, t, NULL);
+  return(res);
+}
 
-      /*if if its fcb name matches what we are trying to find, this may be our destination. */
-      if (strcmp(tmp_fcb, to_find_fcb) == 0) {
-        
-        if ((tmpdir_next != NULL) && (entry->d_type != DT_DIR)) {
-          /* DBG("The name matched but isnt a directory.\n"); */
-          continue;
-        }
 
-        writeptr += sprintf(writeptr, "%s", entry->d_name);
+/* a directory whose subdirectories are to be listed ahead of the clients */
+struct sprefetch {
+  char *dos;              /* DOS path (pathcache key), pool block */
+  char *host;             /* host path, pool block */
+  unsigned long id;       /* FSDB(dss).id when queued */
+  unsigned short dss;     /* slot holding the directory's listing */
+  unsigned char fatflag;
+  unsigned char depth;    /* levels of subdirectories still to go */
+};
+
+/* max amount of directories waiting for the prefetcher */
+#define PREFETCHQ 64
+
+/* the prefetcher's queue, guarded by fsmutex like the rest. pfdepth is 0
+ * while the prefetcher does not run */
+static struct sprefetch pfqueue[PREFETCHQ];
+static unsigned int pfhead, pfcount;
+static int pfdepth, pfstop;
+static unsigned long pfbudget;
+static pthread_t pfthread;
+static pthread_cond_t pfcond = PTHREAD_COND_INITIALIZER;
+
+/* copies path s to d (of size dsz) with slashes squeezed and no trailing
+ * one. returns d, or NULL if s does not fit */
+static char *pfnorm(char *d, size_t dsz, const char *s) {
+  size_t len;
+  if (fsdbnorm(d, dsz, s) != d) return(NULL);
+  len = strlen(d);
+  while ((len > 1) && (d[len - 1] == '/')) d[--len] = 0;
+  return(d);
+}
 
-        /* it is a directory, so we must append a / to our destination */
-        if (tmpdir_next != NULL) {
-          writeptr += sprintf(writeptr, "/");
-        }
+/* queues directory dos (host) for the prefetcher, unless it is full */
+static void pfpush(const char *dos, const char *host, unsigned short dss, unsigned char fatflag, int depth) {
+  struct sprefetch *p;
+  if ((pfcount == PREFETCHQ) || (pfstop != 0)) return;
+  p = &(pfqueue[(pfhead + pfcount) % PREFETCHQ]);
+  p->dos = poolstrndup(dos, strlen(dos));
+  p->host = poolstrndup(host, strlen(host));
+  if ((p->dos == NULL) || (p->host == NULL)) {
+    poolfree(p->dos);
+    poolfree(p->host);
+    return;
+  }
+  p->dss = dss;
+  p->id = FSDB(dss).id;
+  p->fatflag = fatflag;
+  p->depth = (unsigned char)depth;
+  pfcount++;
+  pthread_cond_signal(&pfcond);
+}
+
+/* converts FCB name fcb to the name DOS clients use in paths ("name.ext") */
+static void fcbtodos(char *d, const char *fcb) {
+  int i;
+  for (i = 0; (i < 8) && (fcb[i] != ' '); i++) *(d++) = tolower((unsigned char)fcb[i]);
+  if (fcb[8] != ' ') {
+    *(d++) = '.';
+    for (i = 8; (i < 11) && (fcb[i] != ' '); i++) *(d++) = tolower((unsigned char)fcb[i]);
+  }
+  *d = 0;
+}
+
+/* reads all entries of directory path and their inodes, without keeping
+ * anything: this brings them in the kernel's caches, where the actual
+ * listing finds them later on. this is the slow part when disks seek */
+static void pfwarm(const char *path) {
+  struct dirent *e;
+  struct stat st;
+  DIR *dp = opendir(path);
+  if (dp == NULL) return;
+  while ((e = readdir(dp)) != NULL) fstatat(dirfd(dp), e->d_name, &st, 0);
+  closedir(dp);
+}
+
+/* lists the subdirectories of p ahead of the clients, and remembers their
+ * path translations. called with fsmutex held, released while waiting for
+ * the disk */
+static void pfrun(struct sprefetch *p) {
+  struct snameidx *x;
+  struct poolstats ps;
+  char dos[1024], host[1024];
+  char (*kids)[256] = NULL;
+  char (*kidsdos)[13] = NULL;
+  unsigned long i, n = 0;
+  unsigned short dss;
+  struct spathdir in;
+  size_t doslen = strlen(p->dos), hostlen = strlen(p->host);
+
+  /* the client just listed the directory, its name index is there */
+  if (!fsdbvalid(p->dss) || (FSDB(p->dss).id != p->id)) return;
+  x = getnameidx(p->dss);
+  if (x == NULL) return;
+  pathdirof(&in, p->dss, x);
+  for (i = 0; i < x->count; i++) n += x->ents[i].isdir;
+  if (n == 0) return;
+  kids = malloc(n * sizeof(*kids));
+  kidsdos = malloc(n * sizeof(*kidsdos));
+  if ((kids == NULL) || (kidsdos == NULL)) {
+    free(kids);
+    free(kidsdos);
+    return;
+  }
+  for (i = 0, n = 0; i < x->count; i++) {
+    if ((x->ents[i].isdir == 0) || (strlen(x->names + x->ents[i].nameoff) >= sizeof(*kids))) continue;
+    strcpy(kids[n], x->names + x->ents[i].nameoff);
+    fcbtodos(kidsdos[n], x->ents[i].fcbname);
+    n++;
+  }
+
+  for (i = 0; (i < n) && (pfstop == 0); i++) {
+    if ((doslen + strlen(kidsdos[i]) + 2 > sizeof(dos)) || (hostlen + strlen(kids[i]) + 2 > sizeof(host))) continue;
+    sprintf(dos, "%s/%s", (doslen > 1) ? p->dos : "", kidsdos[i]);
+    sprintf(host, "%s/%s", (hostlen > 1) ? p->host : "", kids[i]);
+    poolstats(&ps);
+    if (ps.usedbytes > pfbudget) break;
+
+    pthread_mutex_unlock(&fsmutex);
+    pfwarm(host);
+    pthread_mutex_lock(&fsmutex);
+
+    pathcachestore(dos, host, &in);
+    dss = dirslot(host);
+    if (dss == FSDB_NONE) continue;
+    if ((FSDB(dss).dirlist == NULL) || (dirlistfresh(dss) == 0)) {
+      if (gendirlist(dss, p->fatflag) < 0) continue;
+      stats.pfdirs++;
+    }
+    /* deeper levels get queued, the last one is left to the client's next
+     * FindFirst to trigger */
+    if (p->depth > 1) {
+      FSDB(dss).dirlist->prefetched = 1;
+      pfpush(dos, host, dss, p->fatflag, p->depth - 1);
+    }
+  }
+  free(kids);
+  free(kidsdos);
+}
+
+/* main function of the prefetcher thread */
+static void *pfloop(void *arg) {
+  struct sprefetch p;
+  (void)arg;
+#if defined(__linux__)
+  /* only use the CPU and the disks when nobody else needs them. both only
+   * apply to the calling thread on Linux */
+  setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+  syscall(SYS_ioprio_set, 1, 0, 3 << 13); /* IOPRIO_WHO_PROCESS, IOPRIO_CLASS_IDLE */
+#endif
+  pthread_mutex_lock(&fsmutex);
+  while (pfstop == 0) {
+    if (pfcount == 0) {
+      pthread_cond_wait(&pfcond, &fsmutex);
+      continue;
+    }
+    p = pfqueue[pfhead];
+    pfhead = (pfhead + 1) % PREFETCHQ;
+    pfcount--;
+    pfrun(&p);
+    poolfree(p.dos);
+    poolfree(p.host);
+  }
+  pthread_mutex_unlock(&fsmutex);
+  return(NULL);
+}
+
+int prefetchstart(int depth, unsigned long budget) {
+  sigset_t sigs, oldsigs;
+  int res;
+  pfdepth = depth;
+  pfbudget = budget;
+  /* termination signals are for the main thread */
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGTERM);
+  sigaddset(&sigs, SIGQUIT);
+  sigaddset(&sigs, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &sigs, &oldsigs);
+  res = pthread_create(&pfthread, NULL, pfloop, NULL);
+  pthread_sigmask(SIG_SETMASK, &oldsigs, NULL);
+  if (res != 0) pfdepth = 0;
+  return(res);
+}
+
+void prefetchstop(void) {
+  if (pfdepth == 0) return;
+  pthread_mutex_lock(&fsmutex);
+  pfstop = 1;
+  pthread_cond_signal(&pfcond);
+  pthread_mutex_unlock(&fsmutex);
+  pthread_join(pfthread, NULL);
+  while (pfcount > 0) {
+    poolfree(pfqueue[pfhead].dos);
+    poolfree(pfqueue[pfhead].host);
+    pfhead = (pfhead + 1) % PREFETCHQ;
+    pfcount--;
+  }
+  pfdepth = 0;
+}
 
-        found = 1;
+void prefetchdir(const char *dos, const char *host, unsigned char fatflag) {
+  char d[1024], h[1024];
+  unsigned short dss;
+  if ((pfdepth == 0) || (fsdbready == 0)) return;
+  /* the slot is the one findfile() got, trailing slash and all */
+  if (fsdbnorm(h, sizeof(h), host) != h) return;
+  dss = fsdbfind(h);
+  if ((pfnorm(d, sizeof(d), dos) == NULL) || (pfnorm(h, sizeof(h), host) == NULL)) return;
+  /* each listing gets its subdirectories prefetched once */
+  if ((dss == FSDB_NONE) || (FSDB(dss).dirlist == NULL) || (FSDB(dss).dirlist->prefetched != 0)) return;
+  FSDB(dss).dirlist->prefetched = 1;
+  pfpush(d, h, dss, fatflag, pfdepth);
+}
+
+/* snapshot files start with this magic and the sizes of the structures they
+ * hold, as they are only meant to be loaded by the build that wrote them */
+#define SNAPMAGIC "EDFSNAP2"
+
+struct ssnaphdr {
+  char magic[8];
+  unsigned long recsz;  /* sizeof(struct ssnaprec) */
+  unsigned long count;  /* amount of records */
+};
+
+/* a fsdb slot, followed by the leaflen bytes of its leaf (no NUL) and its
+ * FCB name index if any: count isdir bytes, then the namesz bytes of the
+ * NUL-terminated host names. records go from the least recently used slot
+ * to the most recently used one. listings are not kept: sizes and times of
+ * files change without the directory, there is no telling whether they did
+ * meanwhile. names only change along with the directory and its stamp */
+struct ssnaprec {
+  unsigned long count;  /* entries of its name index, SNAPNOLIST if none */
+  unsigned long namesz;
+  struct sdirstamp stamp;
+  time_t lastused;
+  unsigned short slot, parent, leaflen;
+};
+
+#define SNAPNOLIST (~0ul)
+
+int snapshotsave(const char *file) {
+  char tmpname[1024];
+  struct ssnaphdr hdr;
+  struct ssnaprec rec;
+  struct snameidx *x;
+  unsigned long n;
+  unsigned short i;
+  unsigned char isdir;
+  const char *name;
+  FILE *fd;
+  int err;
+
+  if (strlen(file) + 5 > sizeof(tmpname)) return(-1);
+  sprintf(tmpname, "%s.tmp", file);
+  fd = fopen(tmpname, "wb");
+  if (fd == NULL) return(-1);
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, SNAPMAGIC, 8);
+  hdr.recsz = sizeof(struct ssnaprec);
+  hdr.count = (fsdbready != 0) ? fsdbused : 0;
+  fwrite(&hdr, sizeof(hdr), 1, fd);
+
+  for (i = (fsdbready != 0) ? lrutail : FSDB_NONE; i != FSDB_NONE; i = FSDB(i).lruprev) {
+    memset(&rec, 0, sizeof(rec));
+    x = FSDB(i).nameidx;
+    /* indexes behind changes made since are not worth keeping. entries
+     * of removed files (no FCB name left) are skipped */
+    rec.count = SNAPNOLIST;
+    if ((x != NULL) && (x->gen == DIRNAMEGEN(i))) {
+      rec.count = 0;
+      rec.stamp = x->stamp;
+      for (n = 0; n < x->count; n++) {
+        if (x->ents[n].fcbname[0] == 0) continue;
+        rec.count++;
+        rec.namesz += strlen(x->names + x->ents[n].nameoff) + 1;
       }
+    } else {
+      x = NULL;
     }
+    rec.lastused = FSDB(i).lastused;
+    rec.slot = i;
+    rec.parent = FSDB(i).parent;
+    rec.leaflen = (unsigned short)strlen(FSDB(i).leaf);
+    fwrite(&rec, sizeof(rec), 1, fd);
+    fwrite(FSDB(i).leaf, 1, rec.leaflen, fd);
+    if (x == NULL) continue;
+    for (n = 0; n < x->count; n++) {
+      if (x->ents[n].fcbname[0] == 0) continue;
+      isdir = x->ents[n].isdir;
+      fwrite(&isdir, 1, 1, fd);
+    }
+    for (n = 0; n < x->count; n++) {
+      if (x->ents[n].fcbname[0] == 0) continue;
+      name = x->names + x->ents[n].nameoff;
+      fwrite(name, 1, strlen(name) + 1, fd);
+    }
+  }
 
-    closedir(dir);
+  err = ferror(fd);
+  if ((fclose(fd) != 0) || (err != 0)) {
+    remove(tmpname);
+    return(-1);
+  }
+  return(rename(tmpname, file));
+}
 
-    if (!found) {
-      /* Print the raw version as is to the destination string */
-      writeptr += sprintf(writeptr, "%s", tmpdir);
-      return -1;
+/* tells whether host path is one of roots, lies below one of them or is a
+ * directory leading to one of them */
+static int snapinroots(const char *path, char * const *roots, int count) {
+  size_t plen = strlen(path), rlen;
+  int i;
+  for (i = 0; i < count; i++) {
+    if (roots[i] == NULL) continue;
+    rlen = strlen(roots[i]);
+    if ((rlen == 1) && (roots[i][0] == '/')) return(1);
+    if ((strncmp(path, roots[i], rlen) == 0) && ((path[rlen] == 0) || (path[rlen] == '/'))) return(1);
+    if ((plen < rlen) && (strncmp(roots[i], path, plen) == 0) && (roots[i][plen] == '/')) return(1);
+  }
+  return(0);
+}
+
+/* frees the slots that snapshotload() restored (state[] non-zero) */
+static void snapforget(const unsigned char *state) {
+  unsigned long i;
+  for (i = 0; i < fsdbnext; i++) {
+    if (state[i] == 0) continue;
+    poolfree(FSDB(i).leaf);
+    freedirlist(&(FSDB(i)));
+    memset(&(FSDB(i)), 0, sizeof(struct sfsdb));
+  }
+  fsdbnext = 0;
+}
+
+/* puts every record of the sz bytes long snapshot map back into its own slot,
+ * so start sectors clients got from the previous run still name the same
+ * items. slots get marked in state[] and listed in order[]. returns 0 on
+ * success, the snapshot is corrupt or memory ran out otherwise */
+static int snaprestore(const unsigned char *map, unsigned long sz, unsigned char *state, unsigned short *order) {
+  struct ssnaphdr hdr;
+  struct ssnaprec rec;
+  struct sfsdb *d;
+  unsigned long n, off = sizeof(hdr), shard;
+
+  memcpy(&hdr, map, sizeof(hdr));
+  for (n = 0; n < hdr.count; n++) {
+    if (off + sizeof(rec) > sz) return(-1);
+    memcpy(&rec, map + off, sizeof(rec));
+    off += sizeof(rec);
+    if ((rec.slot >= FSDB_SLOTS) || (state[rec.slot] != 0) || (off + rec.leaflen > sz)) return(-1);
+    if ((memchr(map + off, '/', rec.leaflen) != NULL) || (memchr(map + off, 0, rec.leaflen) != NULL)) return(-1);
+    if ((rec.count != SNAPNOLIST) && ((rec.count > sz) || (rec.namesz > sz) || (off + rec.leaflen + rec.count + rec.namesz > sz))) return(-1);
+    shard = rec.slot / FSDB_SHARDSZ;
+    if (fsdbshards[shard] == NULL) fsdbshards[shard] = calloc(FSDB_SHARDSZ, sizeof(struct sfsdb));
+    if (fsdbshards[shard] == NULL) return(-1);
+    state[rec.slot] = 1;
+    order[n] = rec.slot;
+    if (rec.slot >= fsdbnext) fsdbnext = rec.slot + 1ul;
+    d = &(FSDB(rec.slot));
+    d->leaf = poolstrndup((const char *)map + off, rec.leaflen);
+    if (d->leaf == NULL) return(-1);
+    off += rec.leaflen;
+    d->parent = rec.parent;
+    d->lastused = rec.lastused;
+    if (rec.count == SNAPNOLIST) continue;
+    /* checked against the directory when first used (see getnameidx()) */
+    d->nameidx = nameidxof(map + off, (const char *)map + off + rec.count, rec.count, rec.namesz);
+    if (d->nameidx == NULL) return(-1);
+    off += rec.count + rec.namesz;
+    d->nameidx->gen = 0; /* the name generation a slot starts at */
+    d->nameidx->stamp = rec.stamp;
+  }
+  if (off != sz) return(-1);
+
+  /* free slots must exist up to fsdbnext as well */
+  for (shard = 0; shard * FSDB_SHARDSZ < fsdbnext; shard++) {
+    if (fsdbshards[shard] == NULL) fsdbshards[shard] = calloc(FSDB_SHARDSZ, sizeof(struct sfsdb));
+    if (fsdbshards[shard] == NULL) return(-1);
+  }
+  return(0);
+}
+
+/* marks (state 2) the slots restored from a snapshot that belong to drives
+ * still served. parents of such a slot are kept as well, being below the
+ * same root or leading to it. returns -1 if parents loop */
+static int snapkeep(unsigned char *state, const unsigned short *order, unsigned long count, char * const *roots, int rootcount) {
+  char path[1024];
+  unsigned long n;
+  unsigned short i;
+  int depth;
+  for (n = 0; n < count; n++) {
+    for (i = order[n], depth = 0; (i != FSDB_NONE) && (state[i] != 0); i = FSDB(i).parent) {
+      if (++depth > FSDB_MAXDEPTH) return(-1);
     }
+    if (i != FSDB_NONE) continue; /* its parent is missing */
+    fsdbpath(order[n], path, sizeof(path));
+    if ((path[0] != 0) && (snapinroots(path, roots, rootcount) != 0)) state[order[n]] = 2;
+  }
+  return(0);
+}
+
+int snapshotload(const char *file, char * const *roots, int count) {
+  struct ssnaphdr hdr;
+  struct stat st;
+  unsigned char *map, *state;
+  unsigned short *order, i, h;
+  unsigned long n;
+  int fd;
+
+  if (fsdbready == 0) fsdbinit();
+  if (fsdbnext != 0) return(-1); /* only meant for an empty fsdb */
 
-    tmpdir = tmpdir_next;
+  fd = open(file, O_RDONLY);
+  if (fd == -1) return(-1);
+  if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(hdr))) {
+    close(fd);
+    return(-1);
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return(-1);
+
+  memcpy(&hdr, map, sizeof(hdr));
+  state = calloc(FSDB_SLOTS, 1);
+  order = malloc((hdr.count + 1) * sizeof(unsigned short));
+  if ((memcmp(hdr.magic, SNAPMAGIC, 8) != 0) || (hdr.recsz != sizeof(struct ssnaprec)) || (hdr.count > FSDB_SLOTS)
+      || (state == NULL) || (order == NULL)
+      || (snaprestore(map, st.st_size, state, order) != 0) || (snapkeep(state, order, hdr.count, roots, count) != 0)) {
+    if (state != NULL) snapforget(state);
+    errno = EINVAL;
+    free(state);
+    free(order);
+    munmap(map, st.st_size);
+    return(-1);
+  }
+  munmap(map, st.st_size);
+
+  /* the snapshot is only good for the run that follows the one which wrote
+   * it: should this one not exit cleanly, the next run must not give the
+   * slots it reassigns since back to their old items */
+  if (unlink(file) != 0) {
+    snapforget(state);
+    free(state);
+    free(order);
+    return(-1);
   }
 
-  return 0;
+  /* index the slots kept, in the order they were used */
+  for (n = 0; n < hdr.count; n++) {
+    i = order[n];
+    if (state[i] != 2) {
+      poolfree(FSDB(i).leaf);
+      freedirlist(&(FSDB(i)));
+      memset(&(FSDB(i)), 0, sizeof(struct sfsdb));
+      continue;
+    }
+    if (FSDB(i).parent != FSDB_NONE) FSDB(FSDB(i).parent).kids++;
+    h = fsdbhashof(FSDB(i).parent, FSDB(i).leaf, strlen(FSDB(i).leaf));
+    FSDB(i).hnext = fsdbhash[h];
+    fsdbhash[h] = i;
+    FSDB(i).id = ++fsdbids;
+    lrupush(i);
+    fsdbused++;
+  }
+  for (n = fsdbnext; n-- > 0;) {
+    if (FSDB(n).leaf != NULL) continue;
+    FSDB(n).lrunext = freehead;
+    freehead = (unsigned short)n;
+  }
+  free(state);
+  free(order);
+  return((int)fsdbused);
 }
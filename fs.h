@@ -71,16 +71,130 @@ int changedir(char *d);
  * amount of bytes read or a negative value on error. */
 long readfile(unsigned char *buff, unsigned short fss, unsigned long offset, unsigned short len);
 
+/* same as readfile(), but data that sits in a read-ahead buffer is not
+ * copied: *data is set to point to it, and *ref to a reference on the buffer
+ * that keeps it around until given to readfileunref(). if the data had to
+ * be copied to buff after all, *data is buff and *ref is NULL */
+long readfileref(unsigned char *buff, unsigned short fss, unsigned long offset, unsigned short len, const unsigned char **data, void **ref);
+
+/* readfileasync() result of a read that completes later */
+#define FS_PENDING (-2)
+
+/* enables asynchronous reads (Linux io_uring). returns a descriptor that
+ * gets readable when reads complete, or -1 if they are not available */
+int readasyncinit(void);
+
+/* like readfileref() (data must not be NULL), but reads that miss the
+ * read-ahead cache are only submitted and FS_PENDING is returned: the
+ * result comes later from readasyncdone(), along with cookie */
+long readfileasync(unsigned char *buff, unsigned short fss, unsigned long offset, unsigned short len, const unsigned char **data, void **ref, void *cookie);
+
+/* takes the result of a completed asynchronous read. returns 0 if none is
+ * ready, otherwise sets *cookie, *res, *data and *ref like readfileref()
+ * does and returns 1 */
+int readasyncdone(void **cookie, long *res, const unsigned char **data, void **ref);
+
+/* drops a reference obtained from readfileref() (NULL is ignored) */
+void readfileunref(void *ref);
+
 /* writes len bytes from buff to file fname, starting at offset. returns
- * amount of bytes written or a negative value on error. */
+ * amount of bytes written or a negative value on error. the data may be held
+ * in a write-behind buffer until commitfile(), closefile(), flushwrites() or
+ * any other operation that needs it on disk. */
 long writefile(unsigned char *buff, unsigned short fss, unsigned long offset, unsigned short len);
 
-/* remove all files matching the pattern, returns the number of removed files if any found,
- * or -1 on error or if no matching file found */
-int delfiles(char *pattern);
+/* writes out any buffered data of file fss */
+void commitfile(unsigned short fss);
+
+/* writes out buffered data older than a second, or all of it if all != 0.
+ * meant to be called periodically. */
+void flushwrites(int all);
+
+/* drops any state cached for open file fss (called when the client closes it) */
+void closefile(unsigned short fss);
+
+/* lets the hot file cache keep the whole content of files clients read, up
+ * to bytes of memory, so they are served from memory. 0 (the default)
+ * disables it. files that changed are noticed within a second */
+void hotcachesize(unsigned long bytes);
+
+/* declares that files below root do not change while ethersrv runs: the
+ * hot file cache trusts their content without checking them again */
+void fsimmutable(const char *root);
+
+/* how often the caches of fs calls were hit or missed */
+struct fscachestats {
+  unsigned long fsdbhits, fsdbmisses; /* path to start sector lookups */
+  unsigned long dirhits, dirmisses;   /* FindFirst listings */
+  unsigned long rahits, ramisses;     /* READFIL calls vs the read-ahead cache */
+  unsigned long hothits, hotmisses;   /* READFIL calls vs the hot file cache */
+  unsigned long pfdirs;               /* listings built ahead by the prefetcher */
+  unsigned long prealloced;           /* bytes allocated ahead of appending writes */
+  unsigned long dirtrunc;             /* listings cut off at 65535 entries */
+};
+
+/* fills s with the statistics of all caches since startup */
+void fscachestats(struct fscachestats *s);
+
+/* memory used by the fs caches */
+struct fsmemstats {
+  unsigned long slots;     /* fsdb slots in use */
+  unsigned long slotbytes; /* allocated for fsdb slots and their index */
+  unsigned long poolbytes; /* allocated for names and directory listings */
+  unsigned long poolused;  /* part of poolbytes in use */
+  unsigned long hotbytes;  /* file contents held by the hot file cache */
+};
+
+void fsmemstats(struct fsmemstats *m);
+
+/* all other fs calls must be made between fslock() and fsunlock() when
+ * several threads use them. they may release the lock while waiting for
+ * the disk, so what one returns is only good until the next */
+void fslock(void);
+void fsunlock(void);
+
+/* tells the fs layer that several threads call it (on != 0), so it may let
+ * other threads in while waiting for slow disk reads */
+void fsthreaded(int on);
+
+/* starts the readdir-ahead thread: once a directory got listed, its
+ * subdirectories, down to depth levels, are listed ahead of the clients and
+ * their path translations cached, as long as the names and listings of
+ * the fs caches take less than budget bytes. returns 0 on success */
+int prefetchstart(int depth, unsigned long budget);
+
+/* stops the readdir-ahead thread, if started. must be called without holding
+ * the fs lock */
+void prefetchstop(void);
+
+/* tells the readdir-ahead thread that DOS directory dos, ie. host directory
+ * host, was listed by a client */
+void prefetchdir(const char *dos, const char *host, unsigned char fatflag);
+
+/* writes the fsdb items (the start sectors given to clients) and the
+ * directory name indexes known to file, so a later run can pick them up with
+ * snapshotload(). returns 0 on success */
+int snapshotsave(const char *file);
+
+/* restores the fsdb items and name indexes of a snapshot written by
+ * snapshotsave(), keeping those below the count roots given (NULL ones are
+ * skipped). must be called before any other fs call. a restored name index
+ * serves path lookups as long as its directory's stamp did not change, while
+ * FindFirst always rescans, as sizes and times are not part of it. the file
+ * is removed once loaded, so only a clean exit leaves one behind. returns
+ * the amount of items restored, -1 if the snapshot cannot be used */
+int snapshotload(const char *file, char * const *roots, int count);
 
-/* rename fn1 into fn2 */
-int renfile(char *fn1, char *fn2);
+/* remove all files matching the pattern, returns the number of removed files if any found,
+ * or -1 on error or if no matching file found. the last component of pattern may be a DOS
+ * mask (with '?'), that leaves hidden and system files alone. errno is EACCES if matching
+ * files are read-only, ENOENT if nothing matched */
+int delfiles(char *pattern, unsigned char fatflag);
+
+/* rename fn1 into fn2. the last components of both may be DOS masks (with '?'), then all
+ * matching files of the directory are renamed, '?' of fn2 keeping the original character.
+ * returns 0 if anything was renamed, errno is ENOENT if nothing matched */
+int renfile(char *fn1, char *fn2, unsigned char fatflag);
 
 /* checks if a path resides on a FAT filesystem, returns 0 if so, non-zero otherwise */
 int isfat(char *d);
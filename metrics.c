@@ -0,0 +1,186 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * runtime metrics: lock-free counters and per-query latency histograms,
+ * exported as a Prometheus text file
+ *
+ * Copyright (c) 2025-2026 D. Flissinger (megapearl)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+
+/* latency histograms have log2-scale buckets: bucket 0 holds queries
+ * answered in less than 1 us, bucket i in less than 2^i us, the last one
+ * anything slower */
+#define BUCKETS 24
+
+unsigned long metrics[MET_COUNT];
+int metricson;
+
+static struct {
+  unsigned long count;
+  unsigned long sumns;
+  unsigned long bucket[BUCKETS];
+} queries[256];
+
+unsigned long long metricsclock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return((unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+
+void metricsquery(unsigned char al, unsigned long ns) {
+  unsigned long us = ns / 1000;
+  int b = 0;
+  while ((us != 0) && (b < BUCKETS - 1)) {
+    us >>= 1;
+    b++;
+  }
+  __sync_fetch_and_add(&(queries[al].count), 1);
+  __sync_fetch_and_add(&(queries[al].sumns), ns);
+  __sync_fetch_and_add(&(queries[al].bucket[b]), 1);
+}
+
+const char *alname(int al) {
+  switch (al) {
+    case 0x00: return("INSTALLCHK");
+    case 0x01: return("RMDIR");
+    case 0x03: return("MKDIR");
+    case 0x05: return("CHDIR");
+    case 0x06: return("CLSFIL");
+    case 0x07: return("CMMTFIL");
+    case 0x08: return("READFIL");
+    case 0x09: return("WRITEFIL");
+    case 0x0a: return("LOCKFIL");
+    case 0x0b: return("UNLOCKFIL");
+    case 0x0c: return("DISKSPACE");
+    case 0x0e: return("SETATTR");
+    case 0x0f: return("GETATTR");
+    case 0x11: return("RENAME");
+    case 0x13: return("DELETE");
+    case 0x16: return("OPEN");
+    case 0x17: return("CREATE");
+    case 0x1b: return("FINDFIRST");
+    case 0x1c: return("FINDNEXT");
+    case 0x21: return("SKFMEND");
+    case 0x2e: return("SPOPNFIL");
+  }
+  return("?");
+}
+
+/* writes the HELP and TYPE lines of a metric */
+static void header(FILE *fd, const char *name, const char *type, const char *help) {
+  fprintf(fd, "# HELP ethersrv_%s %s\n# TYPE ethersrv_%s %s\n", name, help, name, type);
+}
+
+/* a cache and its lookups, for the hits and misses families */
+struct scacheline {
+  const char *name;
+  unsigned long hits;
+  unsigned long misses;
+};
+
+/* writes one family of cache counters, all its samples in a block */
+static void cachefamily(FILE *fd, const char *name, const char *help, const struct scacheline *c, int count, int misses) {
+  int i;
+  header(fd, name, "counter", help);
+  for (i = 0; i < count; i++) {
+    fprintf(fd, "ethersrv_%s{cache=\"%s\"} %lu\n", name, c[i].name, (misses != 0) ? c[i].misses : c[i].hits);
+  }
+}
+
+int metricswrite(const char *fname, const struct fscachestats *fs, const struct fsmemstats *mem) {
+  static const struct {
+    int id;
+    const char *name;
+    const char *help;
+  } counters[] = {
+    {MET_FRAMESIN, "frames_received_total", "EtherDFS queries accepted."},
+    {MET_BYTESIN, "bytes_received_total", "Bytes of EtherDFS queries accepted."},
+    {MET_FRAMESOUT, "frames_sent_total", "Answers sent."},
+    {MET_BYTESOUT, "bytes_sent_total", "Bytes of answers sent."},
+    {MET_DROPPED, "frames_dropped_total", "Malformed EtherDFS frames dropped."},
+    {MET_CKSUMERR, "checksum_errors_total", "Queries dropped because of a wrong checksum."},
+    {MET_IGNORED, "queries_ignored_total", "Queries that got no answer."},
+    {MET_PACED, "answers_paced_total", "Answers held back for clients that lose frames."},
+    {MET_TXREJECTED, "ring_frames_rejected_total", "Answers the kernel refused to send from the TX ring."}
+  };
+  struct scacheline caches[7];
+  char tmpname[1024];
+  unsigned long cumul;
+  FILE *fd;
+  int i, b;
+
+  if (strlen(fname) + 5 > sizeof(tmpname)) return(-1);
+  sprintf(tmpname, "%s.tmp", fname);
+  fd = fopen(tmpname, "w");
+  if (fd == NULL) return(-1);
+
+  for (i = 0; i < (int)(sizeof(counters) / sizeof(counters[0])); i++) {
+    header(fd, counters[i].name, "counter", counters[i].help);
+    fprintf(fd, "ethersrv_%s %lu\n", counters[i].name, metrics[counters[i].id]);
+  }
+
+  caches[0].name = "answer";
+  caches[0].hits = metrics[MET_ANSWHITS];
+  caches[0].misses = metrics[MET_ANSWMISSES];
+  caches[1].name = "fsdb";
+  caches[1].hits = fs->fsdbhits;
+  caches[1].misses = fs->fsdbmisses;
+  caches[2].name = "dirlist";
+  caches[2].hits = fs->dirhits;
+  caches[2].misses = fs->dirmisses;
+  caches[3].name = "readahead";
+  caches[3].hits = fs->rahits;
+  caches[3].misses = fs->ramisses;
+  caches[4].name = "hotfile";
+  caches[4].hits = fs->hothits;
+  caches[4].misses = fs->hotmisses;
+  caches[5].name = "getattr";
+  caches[5].hits = metrics[MET_ATTRHITS];
+  caches[5].misses = metrics[MET_ATTRMISSES];
+  caches[6].name = "diskspace";
+  caches[6].hits = metrics[MET_DISKHITS];
+  caches[6].misses = metrics[MET_DISKMISSES];
+  cachefamily(fd, "cache_hits_total", "Lookups served from a cache.", caches, 7, 0);
+  cachefamily(fd, "cache_misses_total", "Lookups that missed a cache.", caches, 7, 1);
+
+  header(fd, "dirs_prefetched_total", "counter", "Directory listings built ahead of the clients.");
+  fprintf(fd, "ethersrv_dirs_prefetched_total %lu\n", fs->pfdirs);
+  header(fd, "bytes_preallocated_total", "counter", "Disk space allocated ahead of files being appended to.");
+  fprintf(fd, "ethersrv_bytes_preallocated_total %lu\n", fs->prealloced);
+  header(fd, "dirs_truncated_total", "counter", "Directory listings cut off at 65535 entries.");
+  fprintf(fd, "ethersrv_dirs_truncated_total %lu\n", fs->dirtrunc);
+
+  header(fd, "fsdb_slots", "gauge", "Files and directories known to the server.");
+  fprintf(fd, "ethersrv_fsdb_slots %lu\n", mem->slots);
+  header(fd, "memory_bytes", "gauge", "Memory allocated by the fs caches.");
+  fprintf(fd, "ethersrv_memory_bytes{kind=\"fsdb\"} %lu\n", mem->slotbytes);
+  fprintf(fd, "ethersrv_memory_bytes{kind=\"pool\"} %lu\n", mem->poolbytes);
+  fprintf(fd, "ethersrv_memory_bytes{kind=\"pool_used\"} %lu\n", mem->poolused);
+  fprintf(fd, "ethersrv_memory_bytes{kind=\"hotfile\"} %lu\n", mem->hotbytes);
+
+  header(fd, "query_duration_seconds", "histogram", "Time taken to answer queries, per AL subfunction.");
+  for (i = 0; i < 256; i++) {
+    if (queries[i].count == 0) continue;
+    for (cumul = 0, b = 0; b < BUCKETS - 1; b++) {
+      cumul += queries[i].bucket[b];
+      fprintf(fd, "ethersrv_query_duration_seconds_bucket{op=\"%s\",al=\"%02X\",le=\"%g\"} %lu\n", alname(i), i, (double)(1ul << b) / 1e6, cumul);
+    }
+    cumul += queries[i].bucket[b];
+    fprintf(fd, "ethersrv_query_duration_seconds_bucket{op=\"%s\",al=\"%02X\",le=\"+Inf\"} %lu\n", alname(i), i, cumul);
+    fprintf(fd, "ethersrv_query_duration_seconds_sum{op=\"%s\",al=\"%02X\"} %.9f\n", alname(i), i, queries[i].sumns / 1e9);
+    fprintf(fd, "ethersrv_query_duration_seconds_count{op=\"%s\",al=\"%02X\"} %lu\n", alname(i), i, cumul);
+  }
+
+  if (fclose(fd) != 0) {
+    remove(tmpname);
+    return(-1);
+  }
+  return(rename(tmpname, fname));
+}
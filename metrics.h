@@ -0,0 +1,54 @@
+/*
+ * part of ethersrv
+ *
+ * Copyright (c) 2025-2026 D. Flissinger (megapearl)
+ */
+
+#ifndef METRICS_H_SENTINEL
+#define METRICS_H_SENTINEL
+
+#include "fs.h"
+
+/* frame-level counters */
+enum {
+  MET_FRAMESIN,   /* queries accepted */
+  MET_BYTESIN,
+  MET_FRAMESOUT,  /* answers sent */
+  MET_BYTESOUT,
+  MET_DROPPED,    /* malformed EtherDFS frames */
+  MET_CKSUMERR,   /* queries with a wrong checksum */
+  MET_IGNORED,    /* queries that got no answer */
+  MET_ANSWHITS,   /* retransmitted queries answered from the answer cache */
+  MET_ANSWMISSES, /* queries that had to be processed */
+  MET_PACED,      /* answers held back for clients that lose frames */
+  MET_ATTRHITS,   /* GETATTR answered from the attribute cache */
+  MET_ATTRMISSES,
+  MET_DISKHITS,   /* DISKSPACE answered from the free space cache */
+  MET_DISKMISSES,
+  MET_TXREJECTED, /* answers the kernel refused from the TX ring (-m) */
+  MET_COUNT
+};
+
+extern unsigned long metrics[MET_COUNT];
+
+/* counters are bumped without any lock, worker threads included */
+#define METRICADD(m, v) __sync_fetch_and_add(&(metrics[m]), (unsigned long)(v))
+
+/* non-zero when query latencies are to be measured */
+extern int metricson;
+
+/* returns a monotonic time in ns, to measure latencies with */
+unsigned long long metricsclock(void);
+
+/* accounts for a query of AL subfunction al that took ns nanoseconds */
+void metricsquery(unsigned char al, unsigned long ns);
+
+/* returns the name of AL subfunction al, or "?" */
+const char *alname(int al);
+
+/* writes all metrics to fname in the Prometheus text format, along with
+ * the cache statistics fs and memory usage mem. the file is replaced
+ * atomically. returns 0 on success */
+int metricswrite(const char *fname, const struct fscachestats *fs, const struct fsmemstats *mem);
+
+#endif
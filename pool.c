@@ -0,0 +1,140 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * power-of-2 block pool, see pool.h
+ *
+ * Copyright (c) 2025-2026 D. Flissinger (megapearl)
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+/* blocks are 2^POOL_MINSHIFT to 2^POOL_MAXSHIFT bytes, header included.
+ * those up to 2^POOL_SMALLSHIFT bytes come from POOL_CHUNK-sized chunks
+ * that are never freed, larger ones are malloc'ed one by one */
+#define POOL_MINSHIFT 4
+#define POOL_SMALLSHIFT 12
+#define POOL_MAXSHIFT 30
+#define POOL_CHUNK (64ul * 1024ul)
+
+/* max amount of free large blocks kept around for each size */
+#define POOL_KEEPLARGE 4
+
+/* header of all blocks, keeps what follows 8-byte aligned */
+struct sblock {
+  unsigned long shift;
+};
+
+/* free blocks of each size, linked through their first data bytes */
+static struct sblock *freelist[POOL_MAXSHIFT + 1];
+static unsigned long freecount[POOL_MAXSHIFT + 1];
+
+/* what is left of the current chunk */
+static unsigned char *chunk;
+static size_t chunkleft;
+
+static struct poolstats stats;
+
+#define NEXTFREE(b) (*(struct sblock **)((b) + 1))
+
+/* puts block b of 2^shift bytes on its free list */
+static void pushfree(struct sblock *b, unsigned int shift) {
+  b->shift = shift;
+  NEXTFREE(b) = freelist[shift];
+  freelist[shift] = b;
+  freecount[shift]++;
+  stats.freebytes += 1ul << shift;
+}
+
+/* returns a block of 2^shift bytes out of the current chunk, starting a
+ * new one if needed. returns NULL if out of memory */
+static struct sblock *carve(unsigned int shift) {
+  struct sblock *b;
+  size_t bsz = (size_t)1 << shift;
+  unsigned int s;
+  if (chunkleft < bsz) {
+    /* the rest of the chunk goes to the free lists of smaller blocks */
+    for (s = POOL_SMALLSHIFT; s >= POOL_MINSHIFT; s--) {
+      while (chunkleft >= ((size_t)1 << s)) {
+        pushfree((struct sblock *)chunk, s);
+        chunk += (size_t)1 << s;
+        chunkleft -= (size_t)1 << s;
+      }
+    }
+    chunk = malloc(POOL_CHUNK);
+    if (chunk == NULL) {
+      chunkleft = 0;
+      return(NULL);
+    }
+    chunkleft = POOL_CHUNK;
+    stats.chunkbytes += POOL_CHUNK;
+  }
+  b = (struct sblock *)chunk;
+  chunk += bsz;
+  chunkleft -= bsz;
+  return(b);
+}
+
+void *poolalloc(size_t sz) {
+  struct sblock *b;
+  unsigned int shift = POOL_MINSHIFT;
+  while (((size_t)1 << shift) < sz + sizeof(struct sblock)) {
+    if (++shift > POOL_MAXSHIFT) return(NULL);
+  }
+  if (freelist[shift] != NULL) {
+    b = freelist[shift];
+    freelist[shift] = NEXTFREE(b);
+    freecount[shift]--;
+    stats.freebytes -= 1ul << shift;
+  } else if (shift <= POOL_SMALLSHIFT) {
+    b = carve(shift);
+  } else {
+    b = malloc((size_t)1 << shift);
+    if (b != NULL) stats.largebytes += 1ul << shift;
+  }
+  if (b == NULL) return(NULL);
+  b->shift = shift;
+  stats.usedbytes += 1ul << shift;
+  return(b + 1);
+}
+
+void *poolrealloc(void *p, size_t sz) {
+  struct sblock *b = (struct sblock *)p - 1;
+  void *n;
+  if (p == NULL) return(poolalloc(sz));
+  if (sz + sizeof(struct sblock) <= ((size_t)1 << b->shift)) return(p);
+  n = poolalloc(sz);
+  if (n == NULL) return(NULL);
+  memcpy(n, p, ((size_t)1 << b->shift) - sizeof(struct sblock));
+  poolfree(p);
+  return(n);
+}
+
+void poolfree(void *p) {
+  struct sblock *b = (struct sblock *)p - 1;
+  unsigned int shift;
+  if (p == NULL) return;
+  shift = b->shift;
+  stats.usedbytes -= 1ul << shift;
+  if ((shift > POOL_SMALLSHIFT) && (freecount[shift] >= POOL_KEEPLARGE)) {
+    stats.largebytes -= 1ul << shift;
+    free(b);
+    return;
+  }
+  pushfree(b, shift);
+}
+
+char *poolstrndup(const char *s, size_t len) {
+  char *r = poolalloc(len + 1);
+  if (r == NULL) return(NULL);
+  memcpy(r, s, len);
+  r[len] = 0;
+  return(r);
+}
+
+void poolstats(struct poolstats *s) {
+  memcpy(s, &stats, sizeof(stats));
+}
@@ -0,0 +1,38 @@
+/*
+ * part of ethersrv
+ *
+ * Copyright (c) 2025-2026 D. Flissinger (megapearl)
+ */
+
+#ifndef POOL_H_SENTINEL
+#define POOL_H_SENTINEL
+
+#include <stddef.h> /* size_t */
+
+/* allocator for the many long-lived blocks of fs.c (names, directory
+ * listings...). blocks are rounded up to a power of 2 and recycled by size,
+ * small ones being carved out of big chunks, so the heap does not get
+ * fragmented over months of uptime. not thread-safe */
+
+/* returns a block of at least sz bytes, or NULL if out of memory */
+void *poolalloc(size_t sz);
+
+/* resizes block p (which may be NULL) to sz bytes, NULL if out of memory */
+void *poolrealloc(void *p, size_t sz);
+
+/* gives block p (which may be NULL) back to the pool */
+void poolfree(void *p);
+
+/* returns a copy of the first len bytes of s, NUL-terminated */
+char *poolstrndup(const char *s, size_t len);
+
+struct poolstats {
+  unsigned long chunkbytes; /* allocated in chunks for small blocks */
+  unsigned long largebytes; /* allocated for large blocks */
+  unsigned long usedbytes;  /* in blocks given out */
+  unsigned long freebytes;  /* in blocks waiting to be reused */
+};
+
+void poolstats(struct poolstats *s);
+
+#endif
@@ -0,0 +1,113 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * latency tracing: spans of queries and of their parts, recorded in a ring
+ * without locks, dumped for offline viewing
+ *
+ * Copyright (c) 2025-2026 D. Flissinger (megapearl)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "metrics.h"
+#include "trace.h"
+
+/* amount of spans kept in the ring, a power of 2 */
+#define TRACESZ 65536
+
+struct tracespan {
+  unsigned long long mark;  /* 1 + position in the ring when complete, 0 while written */
+  unsigned long long start; /* metricsclock() times */
+  unsigned long dur;
+  unsigned short tid;
+  unsigned char kind;
+  unsigned char al;         /* AL subfunction and sequence of the query */
+  unsigned char seq;
+  unsigned char mac[6];     /* client's MAC */
+};
+
+int traceon;
+
+static struct tracespan ring[TRACESZ];
+static unsigned long long ringnext;
+static unsigned short tids;
+
+/* small number telling threads apart in the dump */
+static __thread unsigned short mytid;
+
+unsigned long long tracebegin(void) {
+  if (traceon == 0) return(0);
+  return(metricsclock());
+}
+
+void traceend(int kind, unsigned long long start, const unsigned char *frame) {
+  struct tracespan *s;
+  unsigned long long pos, now;
+  if (start == 0) return;
+  now = metricsclock();
+  if (mytid == 0) mytid = __sync_add_and_fetch(&tids, 1);
+  pos = __sync_fetch_and_add(&ringnext, 1);
+  s = &(ring[pos & (TRACESZ - 1)]);
+  s->mark = 0;
+  __sync_synchronize();
+  s->start = start;
+  s->dur = (unsigned long)(now - start);
+  s->tid = mytid;
+  s->kind = (unsigned char)kind;
+  if (frame != NULL) {
+    s->al = frame[59];
+    s->seq = frame[57];
+    memcpy(s->mac, frame + 6, 6);
+  } else {
+    s->al = 0;
+    s->seq = 0;
+    memset(s->mac, 0, 6);
+  }
+  __sync_synchronize();
+  s->mark = pos + 1;
+}
+
+int tracedump(const char *fname) {
+  static const char *kinds[TRACE_COUNT] = {"query", "handler", "shorttolong", "getitemss", "io", "send"};
+  struct tracespan s;
+  unsigned long long pos, end, first, mark;
+  char tmpname[1024];
+  FILE *fd;
+  int n = 0;
+
+  if (strlen(fname) + 5 > sizeof(tmpname)) return(-1);
+  sprintf(tmpname, "%s.tmp", fname);
+  fd = fopen(tmpname, "w");
+  if (fd == NULL) return(-1);
+
+  /* spans being written meanwhile, or overwritten while copied, are left
+   * out: their mark is not the one expected before and after the copy */
+  end = ringnext;
+  first = (end > TRACESZ) ? end - TRACESZ : 0;
+  fprintf(fd, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  for (pos = first; pos < end; pos++) {
+    mark = ring[pos & (TRACESZ - 1)].mark;
+    if (mark != pos + 1) continue;
+    __sync_synchronize();
+    memcpy(&s, &(ring[pos & (TRACESZ - 1)]), sizeof(s));
+    __sync_synchronize();
+    if ((ring[pos & (TRACESZ - 1)].mark != mark) || (s.kind >= TRACE_COUNT)) continue;
+    fprintf(fd, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu.%03llu,\"dur\":%lu.%03lu,\"pid\":1,\"tid\":%u",
+            (n++ == 0) ? "" : ",\n", ((s.kind == TRACE_QUERY) || (s.kind == TRACE_HANDLER)) ? alname(s.al) : kinds[s.kind], kinds[s.kind],
+            s.start / 1000, s.start % 1000, s.dur / 1000, s.dur % 1000, s.tid);
+    if (s.kind == TRACE_QUERY) {
+      fprintf(fd, ",\"args\":{\"al\":\"%02X\",\"seq\":%u,\"mac\":\"%02X:%02X:%02X:%02X:%02X:%02X\"}",
+              s.al, s.seq, s.mac[0], s.mac[1], s.mac[2], s.mac[3], s.mac[4], s.mac[5]);
+    }
+    fprintf(fd, "}");
+  }
+  fprintf(fd, "\n]}\n");
+
+  if (fclose(fd) != 0) {
+    remove(tmpname);
+    return(-1);
+  }
+  return(rename(tmpname, fname));
+}
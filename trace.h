@@ -0,0 +1,38 @@
+/*
+ * part of ethersrv
+ *
+ * Copyright (c) 2025-2026 D. Flissinger (megapearl)
+ */
+
+#ifndef TRACE_H_SENTINEL
+#define TRACE_H_SENTINEL
+
+/* kinds of spans: a whole query, from its frame to its answer, and the
+ * parts of it that are timed on their own */
+enum {
+  TRACE_QUERY,   /* answering a query, lookups in the answer cache included */
+  TRACE_HANDLER, /* the handler of the query's AL subfunction */
+  TRACE_PATH,    /* shorttolong() */
+  TRACE_ITEM,    /* getitemss() */
+  TRACE_IO,      /* reading or writing a file */
+  TRACE_SEND,    /* sending answers, possibly a whole batch of them */
+  TRACE_COUNT
+};
+
+/* non-zero when spans are to be recorded */
+extern int traceon;
+
+/* returns the start time of a span, 0 if tracing is off */
+unsigned long long tracebegin(void);
+
+/* records a span of kind kind started at start (as returned by
+ * tracebegin()). frame is the query it is about, or NULL. spans are kept in
+ * a ring without any lock, the oldest ones get overwritten */
+void traceend(int kind, unsigned long long start, const unsigned char *frame);
+
+/* writes the spans in the ring to fname, in the Chrome trace event format
+ * that chrome://tracing and Perfetto show as a timeline with a flame chart
+ * per thread. the file is replaced atomically. returns 0 on success */
+int tracedump(const char *fname);
+
+#endif
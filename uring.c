@@ -0,0 +1,144 @@
+/*
+ * part of ethersrv
+ * http://etherdfs.sourceforge.net
+ *
+ * minimal io_uring support, made of raw syscalls so there is no need for
+ * liburing. only one ring, used by a single thread
+ *
+ * Copyright (c) 2025-2026 D. Flissinger (megapearl)
+ */
+
+#include "uring.h"
+
+#if defined(__linux__)
+
+#include <linux/io_uring.h>
+#include <stdint.h>        /* uintptr_t */
+#include <string.h>        /* memset() */
+#include <sys/mman.h>      /* mmap() */
+#include <sys/syscall.h>   /* __NR_io_uring_setup, __NR_io_uring_enter */
+#include <unistd.h>        /* syscall(), close() */
+
+static struct {
+  int fd;
+  unsigned int *sqhead, *sqtail, *sqmask, *sqarray;
+  unsigned int *cqhead, *cqtail, *cqmask;
+  unsigned int entries;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+} ring = {-1, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL};
+
+/* maps the rings of io_uring fd, set up with parameters p. returns 0 on
+ * success. on failure, whatever got mapped stays so: it happens once, at
+ * startup, and is not worth tracking */
+static int uringmap(int fd, struct io_uring_params *p) {
+  unsigned char *sq, *cq;
+  size_t sqsz, cqsz;
+
+  sqsz = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+  cqsz = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+  if ((p->features & IORING_FEAT_SINGLE_MMAP) && (cqsz > sqsz)) sqsz = cqsz;
+  sq = mmap(NULL, sqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED) return(-1);
+  if (p->features & IORING_FEAT_SINGLE_MMAP) {
+    cq = sq;
+  } else {
+    cq = mmap(NULL, cqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED) return(-1);
+  }
+  ring.sqes = mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring.sqes == MAP_FAILED) return(-1);
+
+  ring.sqhead = (unsigned int *)(sq + p->sq_off.head);
+  ring.sqtail = (unsigned int *)(sq + p->sq_off.tail);
+  ring.sqmask = (unsigned int *)(sq + p->sq_off.ring_mask);
+  ring.sqarray = (unsigned int *)(sq + p->sq_off.array);
+  ring.cqhead = (unsigned int *)(cq + p->cq_off.head);
+  ring.cqtail = (unsigned int *)(cq + p->cq_off.tail);
+  ring.cqmask = (unsigned int *)(cq + p->cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+  ring.entries = p->sq_entries;
+  return(0);
+}
+
+int uringinit(unsigned int entries) {
+  struct io_uring_params p;
+  int fd;
+  memset(&p, 0, sizeof(p));
+  fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (fd < 0) return(-1);
+  /* IORING_OP_READ came along with IORING_FEAT_RW_CUR_POS (Linux 5.6) */
+  if (((p.features & IORING_FEAT_RW_CUR_POS) == 0) || (uringmap(fd, &p) != 0)) {
+    close(fd);
+    return(-1);
+  }
+  ring.fd = fd;
+  return(fd);
+}
+
+int uringread(int fd, void *buf, unsigned int len, unsigned long long off, void *cookie) {
+  struct io_uring_sqe *sqe;
+  unsigned int tail, idx;
+  if (ring.fd < 0) return(-1);
+  tail = *ring.sqtail;
+  __sync_synchronize();
+  if (tail - *ring.sqhead >= ring.entries) return(-1);
+  idx = tail & *ring.sqmask;
+  sqe = &(ring.sqes[idx]);
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)buf;
+  sqe->len = len;
+  sqe->off = off;
+  sqe->user_data = (uintptr_t)cookie;
+  ring.sqarray[idx] = idx;
+  __sync_synchronize();
+  *ring.sqtail = tail + 1;
+  __sync_synchronize();
+  if (syscall(__NR_io_uring_enter, ring.fd, 1, 0, 0, NULL, 0) != 1) {
+    /* not consumed: take it back */
+    if (*ring.sqhead == tail) *ring.sqtail = tail;
+    return(-1);
+  }
+  return(0);
+}
+
+int uringreap(void **cookie, long *res) {
+  struct io_uring_cqe *cqe;
+  unsigned int head;
+  if (ring.fd < 0) return(0);
+  head = *ring.cqhead;
+  __sync_synchronize();
+  if (head == *ring.cqtail) return(0);
+  cqe = &(ring.cqes[head & *ring.cqmask]);
+  *cookie = (void *)(uintptr_t)cqe->user_data;
+  *res = cqe->res;
+  __sync_synchronize();
+  *ring.cqhead = head + 1;
+  return(1);
+}
+
+#else
+
+int uringinit(unsigned int entries) {
+  (void)entries;
+  return(-1);
+}
+
+int uringread(int fd, void *buf, unsigned int len, unsigned long long off, void *cookie) {
+  (void)fd;
+  (void)buf;
+  (void)len;
+  (void)off;
+  (void)cookie;
+  return(-1);
+}
+
+int uringreap(void **cookie, long *res) {
+  (void)cookie;
+  (void)res;
+  return(0);
+}
+
+#endif
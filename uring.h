@@ -0,0 +1,24 @@
+/*
+ * part of ethersrv
+ *
+ * Copyright (c) 2025-2026 D. Flissinger (megapearl)
+ */
+
+#ifndef URING_H_SENTINEL
+#define URING_H_SENTINEL
+
+/* sets up an io_uring of (at least) entries slots. returns its descriptor,
+ * readable whenever completions are pending, or -1 if io_uring is not
+ * available (not Linux, kernel older than 5.6, denied by seccomp...) */
+int uringinit(unsigned int entries);
+
+/* submits a read of len bytes at offset off of fd into buf. cookie comes
+ * back with the result. returns 0 on success, -1 if the ring is full or
+ * the submission failed */
+int uringread(int fd, void *buf, unsigned int len, unsigned long long off, void *cookie);
+
+/* takes the oldest completion: sets *cookie and *res (bytes read or a
+ * negative errno) and returns 1, or returns 0 if none is pending */
+int uringreap(void **cookie, long *res);
+
+#endif